@@ -27,6 +27,12 @@ VIDEO_DESC:
 GDT_SIZE  equ $ - GDT_BASE
 GDT_LIMIT equ GDT_SIZE - 1
 times 60 dq 0
+
+; E820 memory map, kernel reads it at 0xc04 (see kernel/memory.c), times
+; would complain if the gdt above grows over it
+times 0x304-($-$$) db 0
+ards_nr dd 0
+ards_buf times E820_ARDS_SIZE * E820_MAX_ENTRIES db 0
 SELECTOR_CODE  equ (0x0001<<3) + TI_GDT + RPL0
 SELECTOR_DATA  equ (0x0002<<3) + TI_GDT + RPL0
 SELECTOR_VIDEO equ (0x0003<<3) + TI_GDT + RPL0
@@ -57,6 +63,50 @@ loader_start:
   mov dx, 0x1800
   int 0x10
 
+; use int 0x15 func 0xE820 to get the memory map, each call fills one ARDS
+; into es:di and returns the continuation value in ebx, 0 for the last one
+get_memory_map:
+  xor ebx, ebx
+  mov di, ards_buf
+.e820_next:
+  mov edx, E820_SMAP
+  mov eax, 0x0000E820
+  mov ecx, E820_ARDS_SIZE
+  int 0x15
+  jc .e820_end          ; cf = 1 also means the end of list
+  add di, E820_ARDS_SIZE
+  inc dword [ards_nr]
+  cmp dword [ards_nr], E820_MAX_ENTRIES
+  je .e820_end
+  cmp ebx, 0
+  jnz .e820_next
+.e820_end:
+  cmp dword [ards_nr], 0
+  je get_memory_size    ; E820 not supported, fall back to E801
+
+; total_mem_bytes = highest end address of usable (type 1) ranges below 4GB
+  mov ecx, [ards_nr]
+  mov ebx, ards_buf
+  xor esi, esi
+.find_max_end:
+  cmp dword [ebx+16], 1
+  jne .next_ards
+  cmp dword [ebx+4], 0  ; base_high
+  jne .next_ards
+  mov eax, [ebx]        ; base_low
+  add eax, [ebx+8]      ; length_low
+  jnc .no_overflow
+  mov eax, 0xfffff000
+.no_overflow:
+  cmp eax, esi
+  jbe .next_ards
+  mov esi, eax
+.next_ards:
+  add ebx, E820_ARDS_SIZE
+  loop .find_max_end
+  mov [total_mem_bytes], esi
+  jmp enter_protect_mode
+
 ; use int 0x15 func 0xE801 to get total memory size
 get_memory_size:
   mov ax, 0xE801
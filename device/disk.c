@@ -95,6 +95,7 @@ void disk_init(void);
 
 #define FS_TYPE_NONE 0x0
 #define FS_TYPE_EXTEND 0x5
+#define FS_TYPE_SWAP 0x82
 #define FS_TYPE_LINUX 0x83
 
 struct partition_table_entry {
@@ -116,6 +117,8 @@ struct boot_sector {
   uint16_t signature;  // 0x55, 0xaa
 } __attribute__((packed));
 
+struct partition* swap_partition;
+
 // Private methods
 
 static struct partition* new_partition(struct disk* hd, uint32_t lba_start,
@@ -434,6 +437,15 @@ static void partition_scan(struct disk* hd, uint32_t lba) {
         p = new_partition(hd, lba + pte->lba_start, pte->sec_cnt, FS_TYPE_LINUX,
                           hd->part_cnt++);
         list_append(&disk_partitions, &p->tag);
+        break;
+      case FS_TYPE_SWAP:
+        p = new_partition(hd, lba + pte->lba_start, pte->sec_cnt, FS_TYPE_SWAP,
+                          hd->part_cnt++);
+        if (swap_partition == NULL) {
+          swap_partition = p;
+        } else {
+          sys_free(p);
+        }
     }
   }
 
@@ -453,6 +465,9 @@ static void partition_string(struct list_elem* elem) {
     case FS_TYPE_LINUX:
       sprintf(type_name, "LINUX");
       break;
+    case FS_TYPE_SWAP:
+      sprintf(type_name, "SWAP");
+      break;
   }
 
   printf("    %s device:%s start:%d sectors:%d size:%dMB type:%s\n", p->name,
@@ -465,6 +480,9 @@ static void partition_string(struct list_elem* elem) {
 static void partition_printall(void) {
   printf("  partitions:\n");
   list_iterate(&disk_partitions, partition_string);
+  if (swap_partition != NULL) {
+    partition_string(&swap_partition->tag);
+  }
 }
 
 static void partition_init(void) {
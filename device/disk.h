@@ -46,4 +46,7 @@ struct partition {
 
 struct list disk_partitions;
 
+// First partition of swap type, NULL if none. It is not in disk_partitions.
+extern struct partition* swap_partition;
+
 #endif
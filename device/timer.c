@@ -7,7 +7,6 @@
 #include "stdint.h"
 #include "thread.h"
 
-#define IRQ0_FREQUENCY 100       // 100 timer interrupt per second
 #define INPUT_FREQUENCY 1193180  // timer device CLK frequency
 #define PIT_CONTROL_PORT 0x43
 #define COUNTER0_VALUE INPUT_FREQUENCY / IRQ0_FREQUENCY
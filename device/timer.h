@@ -1,6 +1,8 @@
 #ifndef __DEVICE_TIMER_H
 #define __DEVICE_TIMER_H
 #include "stdint.h"
+#define IRQ0_FREQUENCY 100  // 100 timer interrupt per second
+extern uint32_t ticks;
 void sys_milisleep(uint32_t miliseconds);
 void sys_sleep(uint32_t seconds);
 void timer_init(void);
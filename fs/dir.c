@@ -11,6 +11,8 @@
 #include "string.h"
 #include "super_block.h"
 
+struct kmem_cache dir_cache;
+
 // Public
 void dir_open_root(struct partition_manager* fsm);
 struct dir* dir_open(struct partition_manager* pmgr, int32_t inode_no);
@@ -33,14 +35,14 @@ void dir_open_root(struct partition_manager* fsm) {
 }
 
 struct dir* dir_open(struct partition_manager* pmgr, int32_t inode_no) {
-  struct dir* dir = (struct dir*)sys_malloc(sizeof(struct dir));
+  struct dir* dir = kmem_cache_alloc(&dir_cache);
   if (dir == NULL) {
     return NULL;
   }
 
   dir->inode_elem = inode_open(pmgr, inode_no);
   if (dir->inode_elem == NULL) {
-    sys_free(dir);
+    kmem_cache_free(&dir_cache, dir);
     return NULL;
   }
   dir->d_pos = 0;
@@ -52,7 +54,7 @@ int32_t dir_close(struct dir* dir) {
     return -1;
   }
   inode_close(dir->inode_elem);
-  sys_free(dir);
+  kmem_cache_free(&dir_cache, dir);
   return 0;
 }
 
@@ -90,7 +92,7 @@ int32_t dir_create_entry(struct dir* parent, struct dir_entry* ent) {
     return -1;
   }
 
-  struct dir_entry* dents = (struct dir_entry*)sys_malloc(BLOCK_SIZE);
+  struct dir_entry* dents = kmem_cache_alloc(&block_buf_cache);
   if (dents == NULL) {
     return -1;
   }
@@ -116,7 +118,7 @@ int32_t dir_create_entry(struct dir* parent, struct dir_entry* ent) {
           inode_sync(parent->inode_elem);
 
           inode_write(parent->inode_elem, i, (char*)dents);
-          sys_free(dents);
+          kmem_cache_free(&block_buf_cache, dents);
           return 0;
         }
       }
@@ -125,7 +127,7 @@ int32_t dir_create_entry(struct dir* parent, struct dir_entry* ent) {
 
   // no free slot
   if (inode_get_blocks(parent->inode_elem, 1) < 0) {
-    sys_free(dents);
+    kmem_cache_free(&block_buf_cache, dents);
     return -1;
   }
 
@@ -138,7 +140,7 @@ int32_t dir_create_entry(struct dir* parent, struct dir_entry* ent) {
   parent_inode->size++;
   inode_sync(parent->inode_elem);
 
-  sys_free(dents);
+  kmem_cache_free(&block_buf_cache, dents);
   return 0;
 }
 
@@ -148,7 +150,7 @@ static int32_t dir_search_de(struct dir* parent, char* filename,
     return -1;
   }
 
-  struct dir_entry* dents = (struct dir_entry*)sys_malloc(BLOCK_SIZE);
+  struct dir_entry* dents = kmem_cache_alloc(&block_buf_cache);
   if (dents == NULL) {
     return -1;
   }
@@ -166,18 +168,18 @@ static int32_t dir_search_de(struct dir* parent, char* filename,
         ent->f_type = dents[j].f_type;
         ent->inode_no = dents[j].inode_no;
 
-        sys_free(dents);
+        kmem_cache_free(&block_buf_cache, dents);
         return 0;
       }
     }
   }
 
-  sys_free(dents);
+  kmem_cache_free(&block_buf_cache, dents);
   return -1;
 }
 
 int32_t dir_delete_entry(struct dir* parent, int32_t inode_no) {
-  struct dir_entry* dents = (struct dir_entry*)sys_malloc(BLOCK_SIZE);
+  struct dir_entry* dents = kmem_cache_alloc(&block_buf_cache);
   if (dents == NULL) {
     return -1;
   }
@@ -197,13 +199,13 @@ int32_t dir_delete_entry(struct dir* parent, int32_t inode_no) {
         parent->inode_elem->inode.size--;
         inode_sync(parent->inode_elem);
 
-        sys_free(dents);
+        kmem_cache_free(&block_buf_cache, dents);
         return 0;
       }
     }
   }
 
-  sys_free(dents);
+  kmem_cache_free(&block_buf_cache, dents);
   return -1;
 }
 
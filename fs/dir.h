@@ -2,6 +2,7 @@
 #define __FS_DIR_H
 
 #include "partition_manager.h"
+#include "slab.h"
 #include "stdint.h"
 #include "super_block.h"
 
@@ -28,6 +29,8 @@ struct dir {
 
 struct dir dir_root;
 
+extern struct kmem_cache dir_cache;
+
 extern void dir_open_root(struct partition_manager* fsm);
 extern struct dir* dir_open(struct partition_manager* pmgr, int32_t inode_no);
 extern int32_t dir_close(struct dir* dir);
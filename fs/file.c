@@ -143,7 +143,7 @@ int32_t file_write(int32_t global_fd, const void* buf, int32_t size) {
     }
   }
 
-  char* write_buf = (char*)sys_malloc(BLOCK_SIZE);
+  char* write_buf = kmem_cache_alloc(&block_buf_cache);
 
   // write first block
   int32_t idx = f->fd_pos / BLOCK_SIZE;
@@ -205,7 +205,7 @@ int32_t file_write(int32_t global_fd, const void* buf, int32_t size) {
 
   f->fd_pos += size;
 
-  sys_free(write_buf);
+  kmem_cache_free(&block_buf_cache, write_buf);
   return size;
 }
 
@@ -222,7 +222,7 @@ int32_t file_read(int32_t global_fd, void* buf, int32_t size) {
     size = fsize - f->fd_pos;
   }
 
-  void* read_buf = sys_malloc(BLOCK_SIZE);
+  void* read_buf = kmem_cache_alloc(&block_buf_cache);
 
   int32_t idx = f->fd_pos / BLOCK_SIZE;
   int32_t off = f->fd_pos % BLOCK_SIZE;
@@ -268,6 +268,6 @@ int32_t file_read(int32_t global_fd, void* buf, int32_t size) {
 
   f->fd_pos += size;
 
-  sys_free(read_buf);
+  kmem_cache_free(&block_buf_cache, read_buf);
   return size;
 }
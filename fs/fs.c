@@ -7,7 +7,7 @@
 #include "file.h"
 #include "global.h"
 #include "inode.h"
-#include "kernel/bitmap.h"
+#include "kernel/hbitmap.h"
 #include "kernel/list.h"
 #include "memory.h"
 #include "partition_manager.h"
@@ -39,6 +39,7 @@ struct dir* sys_opendir(const char* name);
 int32_t sys_closedir(struct dir* dir);
 struct dir_entry* sys_readdir(struct dir* dir);
 int32_t sys_rmdir(const char* name);
+struct inode_elem* fd_inode(int32_t fd);
 
 // Implementation
 
@@ -60,18 +61,26 @@ bool fs_load(struct partition_manager* fsm, struct partition* part) {
   fsm->sblock = sblock;
 
   // Load inode bitmap
-  struct bitmap* inode_btmp_ptr = &fsm->inode_btmp;
-  inode_btmp_ptr->btmp_bytes_len = sblock->inode_btmp_secs * 512;
-  inode_btmp_ptr->bits = (uint8_t*)sys_malloc(inode_btmp_ptr->btmp_bytes_len);
-  disk_read(part->hd, inode_btmp_ptr->bits, sblock->inode_btmp_lba,
+  struct hbitmap* inode_btmp_ptr = &fsm->inode_btmp;
+  inode_btmp_ptr->btmp.btmp_bytes_len = sblock->inode_btmp_secs * 512;
+  inode_btmp_ptr->btmp.bits =
+      (uint8_t*)sys_malloc(inode_btmp_ptr->btmp.btmp_bytes_len);
+  inode_btmp_ptr->summary = (uint32_t*)sys_malloc(
+      hbitmap_summary_bytes(inode_btmp_ptr->btmp.btmp_bytes_len));
+  disk_read(part->hd, inode_btmp_ptr->btmp.bits, sblock->inode_btmp_lba,
             sblock->inode_btmp_secs);
+  hbitmap_rebuild(inode_btmp_ptr);
 
   // Load block bitmap
-  struct bitmap* block_btmp_ptr = &fsm->block_btmp;
-  block_btmp_ptr->btmp_bytes_len = sblock->block_btmp_secs * 512;
-  block_btmp_ptr->bits = (uint8_t*)sys_malloc(block_btmp_ptr->btmp_bytes_len);
-  disk_read(part->hd, block_btmp_ptr->bits, sblock->block_btmp_lba,
+  struct hbitmap* block_btmp_ptr = &fsm->block_btmp;
+  block_btmp_ptr->btmp.btmp_bytes_len = sblock->block_btmp_secs * 512;
+  block_btmp_ptr->btmp.bits =
+      (uint8_t*)sys_malloc(block_btmp_ptr->btmp.btmp_bytes_len);
+  block_btmp_ptr->summary = (uint32_t*)sys_malloc(
+      hbitmap_summary_bytes(block_btmp_ptr->btmp.btmp_bytes_len));
+  disk_read(part->hd, block_btmp_ptr->btmp.bits, sblock->block_btmp_lba,
             sblock->block_btmp_secs);
+  hbitmap_rebuild(block_btmp_ptr);
 
   return true;
 }
@@ -113,40 +122,46 @@ void fs_make(struct partition_manager* fsm, struct partition* part) {
   fsm->sblock = sblock;
 
   // Init inode bitmap
-  struct bitmap* inode_btmp_ptr = &fsm->inode_btmp;
-  inode_btmp_ptr->btmp_bytes_len = sblock->inode_btmp_secs * 512;
-  inode_btmp_ptr->bits = (uint8_t*)sys_malloc(inode_btmp_ptr->btmp_bytes_len);
-  bitmap_init(inode_btmp_ptr);
+  struct hbitmap* inode_btmp_ptr = &fsm->inode_btmp;
+  inode_btmp_ptr->btmp.btmp_bytes_len = sblock->inode_btmp_secs * 512;
+  inode_btmp_ptr->btmp.bits =
+      (uint8_t*)sys_malloc(inode_btmp_ptr->btmp.btmp_bytes_len);
+  inode_btmp_ptr->summary = (uint32_t*)sys_malloc(
+      hbitmap_summary_bytes(inode_btmp_ptr->btmp.btmp_bytes_len));
+  hbitmap_init(inode_btmp_ptr);
 
   // set root inode no
-  bitmap_set(inode_btmp_ptr, sblock->root_inode_no);
+  hbitmap_set(inode_btmp_ptr, sblock->root_inode_no);
 
   // flush all inode bitmap
-  disk_write(part->hd, inode_btmp_ptr->bits, sblock->inode_btmp_lba,
+  disk_write(part->hd, inode_btmp_ptr->btmp.bits, sblock->inode_btmp_lba,
              sblock->inode_btmp_secs);
 
   // Init block bitmap
-  struct bitmap* block_btmp_ptr = &fsm->block_btmp;
-  block_btmp_ptr->btmp_bytes_len = sblock->block_btmp_secs * 512;
-  block_btmp_ptr->bits = (uint8_t*)sys_malloc(block_btmp_ptr->btmp_bytes_len);
-  bitmap_init(block_btmp_ptr);
+  struct hbitmap* block_btmp_ptr = &fsm->block_btmp;
+  block_btmp_ptr->btmp.btmp_bytes_len = sblock->block_btmp_secs * 512;
+  block_btmp_ptr->btmp.bits =
+      (uint8_t*)sys_malloc(block_btmp_ptr->btmp.btmp_bytes_len);
+  block_btmp_ptr->summary = (uint32_t*)sys_malloc(
+      hbitmap_summary_bytes(block_btmp_ptr->btmp.btmp_bytes_len));
+  hbitmap_init(block_btmp_ptr);
 
   // Set used block
   int32_t i, used_block;
   used_block = sblock->data_lba - sblock->part_lba_start;
   for (i = 0; i < used_block; i++) {
-    bitmap_set(block_btmp_ptr, i);
+    hbitmap_set(block_btmp_ptr, i);
   }
 
   // Our block bitmap size may be larger than actual block count,
   // so we need to set the tail non-exist block index to be used.
-  int32_t block_btmp_size = block_btmp_ptr->btmp_bytes_len * 8;
+  int32_t block_btmp_size = block_btmp_ptr->btmp.btmp_bytes_len * 8;
   for (i = sblock->sec_cnt; i < block_btmp_size; i++) {
-    bitmap_set(block_btmp_ptr, i);
+    hbitmap_set(block_btmp_ptr, i);
   }
 
   // flush all block bitmap
-  disk_write(part->hd, block_btmp_ptr->bits, sblock->block_btmp_lba,
+  disk_write(part->hd, block_btmp_ptr->btmp.bits, sblock->block_btmp_lba,
              sblock->block_btmp_secs);
 
   // init root dir
@@ -175,6 +190,13 @@ void fs_init(void) {
   // Init opened inode list
   list_init(&inode_list);
 
+  // Init object caches
+  kmem_cache_create(&inode_cache, "inode", sizeof(struct inode_elem), NULL);
+  kmem_cache_create(&dir_cache, "dir", sizeof(struct dir), NULL);
+  kmem_cache_create(&block_buf_cache, "block_buf", BLOCK_SIZE, NULL);
+  kmem_cache_create(&inode_page_cache, "inode_page", sizeof(struct inode_page),
+                    NULL);
+
   if (!fs_load(&cur_partition, part)) {
     printf("  make default file system\n");
     fs_make(&cur_partition, part);
@@ -300,6 +322,20 @@ int32_t sys_close(int32_t fd) {
   return 0;
 }
 
+// fd_inode
+// Return inode of the file opened as fd by running thread, NULL if fd is not
+// an opened file.
+struct inode_elem* fd_inode(int32_t fd) {
+  if (fd < 3 || fd >= MAX_PROC_OPEN_FD) {
+    return NULL;
+  }
+  int32_t global_fd = running_thread()->fd_table[fd];
+  if (global_fd < 3) {
+    return NULL;
+  }
+  return file_table[global_fd].inode_elem;
+}
+
 int32_t sys_write(int32_t fd, const void* buf, int32_t size) {
   struct task_struct* cur = running_thread();
   int32_t global_fd = cur->fd_table[fd];
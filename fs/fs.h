@@ -31,5 +31,6 @@ extern struct dir* sys_opendir(const char* name);
 extern int32_t sys_closedir(struct dir* dir);
 extern struct dir_entry* sys_readdir(struct dir* dir);
 extern int32_t sys_rmdir(const char* name);
+extern struct inode_elem* fd_inode(int32_t fd);
 
 #endif
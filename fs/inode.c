@@ -2,8 +2,11 @@
 
 #include "debug.h"
 #include "disk.h"
+#include "global.h"
+#include "interrupt.h"
 #include "memory.h"
 #include "partition_manager.h"
+#include "slab.h"
 #include "stdbool.h"
 #include "stdint.h"
 #include "stdio.h"
@@ -11,6 +14,12 @@
 #include "string.h"
 #include "super_block.h"
 
+struct kmem_cache inode_cache;
+struct kmem_cache block_buf_cache;
+struct kmem_cache inode_page_cache;
+
+#define PG_SIZE 4096
+
 // Public
 void inode_sync(struct inode_elem* inode_elem);
 struct inode_elem* inode_create(struct partition_manager* pmgr,
@@ -26,10 +35,14 @@ uint32_t inode_get_or_create_sec(struct inode_elem* inode_elem,
 uint32_t inode_idx_to_lba(struct inode_elem* inode_elem, uint32_t sec_idx);
 int32_t inode_read(struct inode_elem* inode_elem, uint32_t sec_idx, char* buf);
 int32_t inode_write(struct inode_elem* inode_elem, uint32_t sec_idx, char* buf);
+void* inode_page_get(struct inode_elem* inode_elem, uint32_t pg_idx);
 
 // Private
 int32_t inode_read_ext_blocks(struct inode_elem* inode_elem, char* buf);
 int32_t inode_write_ext_blocks(struct inode_elem* inode_elem, char* buf);
+static struct inode_page* inode_page_find(struct inode_elem* inode_elem,
+                                          uint32_t pg_idx);
+static void inode_pages_free(struct inode_elem* inode_elem);
 
 // Implementation
 void inode_sync(struct inode_elem* inode_elem) {
@@ -44,7 +57,7 @@ void inode_sync(struct inode_elem* inode_elem) {
 
   // load block
   // FIXME: this malloc may allocate memory in user space
-  struct inode* inode_table = (struct inode*)sys_malloc(BLOCK_SIZE);
+  struct inode* inode_table = kmem_cache_alloc(&block_buf_cache);
   disk_read(pmgr->part->hd, inode_table, lba, BLOCK_SECS);
 
   // copy new inode
@@ -53,7 +66,7 @@ void inode_sync(struct inode_elem* inode_elem) {
 
   // flush new inode
   disk_write(pmgr->part->hd, inode_table, lba, BLOCK_SECS);
-  sys_free(inode_table);
+  kmem_cache_free(&block_buf_cache, inode_table);
 }
 
 struct inode_elem* inode_create(struct partition_manager* pmgr,
@@ -65,7 +78,7 @@ struct inode_elem* inode_create(struct partition_manager* pmgr,
 
   // inode_elem should be shared in kernel space
   struct inode_elem* inode_elem;
-  inode_elem = (struct inode_elem*)kmalloc(sizeof(struct inode_elem));
+  inode_elem = kmem_cache_alloc(&inode_cache);
   if (inode_elem == NULL) {
     return NULL;
   }
@@ -84,6 +97,7 @@ struct inode_elem* inode_create(struct partition_manager* pmgr,
   inode_elem->partmgr = pmgr;
   list_append(&inode_list, &inode_elem->inode_tag);
   inode_elem->ref = 1;
+  list_init(&inode_elem->pages);
 
   return inode_elem;
 }
@@ -95,7 +109,7 @@ void inode_delete(struct partition_manager* pmgr, uint32_t inode_no) {
     return;
   }
 
-  uint32_t* ext_blk = (uint32_t*)sys_malloc(BLOCK_SIZE);
+  uint32_t* ext_blk = kmem_cache_alloc(&block_buf_cache);
 
   // release all allocate blocks
   if (inode_del->inode.blocks[FS_INODE_EXTEND_BLOCK_INDEX] != 0) {
@@ -124,7 +138,7 @@ void inode_delete(struct partition_manager* pmgr, uint32_t inode_no) {
 
   inode_close(inode_del);
 
-  sys_free(ext_blk);
+  kmem_cache_free(&block_buf_cache, ext_blk);
   return;
 }
 
@@ -149,7 +163,7 @@ struct inode_elem* inode_open(struct partition_manager* pmgr,
   }
 
   // read from disk
-  inode_elem = (struct inode_elem*)kmalloc(sizeof(struct inode_elem));
+  inode_elem = kmem_cache_alloc(&inode_cache);
 
   // locale the block where the inode lives
   uint32_t block_no = inode_no / FS_INODE_TABLES_BLOCK_CNT;
@@ -158,7 +172,7 @@ struct inode_elem* inode_open(struct partition_manager* pmgr,
   ASSERT(lba < pmgr->sblock->inode_table_lba + pmgr->sblock->inode_btmp_secs);
 
   // load block
-  struct inode* inode_table = (struct inode*)sys_malloc(BLOCK_SIZE);
+  struct inode* inode_table = kmem_cache_alloc(&block_buf_cache);
   disk_read(pmgr->part->hd, inode_table, lba, BLOCK_SECS);
 
   // copy to memory
@@ -169,8 +183,9 @@ struct inode_elem* inode_open(struct partition_manager* pmgr,
   inode_elem->partmgr = pmgr;
   list_push(&inode_list, &inode_elem->inode_tag);
   inode_elem->ref = 1;
+  list_init(&inode_elem->pages);
 
-  sys_free(inode_table);
+  kmem_cache_free(&block_buf_cache, inode_table);
   return inode_elem;
 }
 
@@ -178,7 +193,8 @@ void inode_close(struct inode_elem* inode_elem) {
   inode_elem->ref--;
   if (inode_elem->ref == 0) {
     list_remove(&inode_elem->inode_tag);
-    kfree(inode_elem);
+    inode_pages_free(inode_elem);
+    kmem_cache_free(&inode_cache, inode_elem);
   }
 }
 
@@ -219,7 +235,7 @@ int32_t inode_get_blocks(struct inode_elem* inode_elem, uint32_t cnt) {
 
   // we have used extend block
   if (used > FS_INODE_DIRECT_BLOCKS) {
-    uint32_t* ext_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE);
+    uint32_t* ext_blocks = kmem_cache_alloc(&block_buf_cache);
     if (ext_blocks == NULL) {
       // rollback if fail
       for (i = 0; i < cnt; i++) {
@@ -248,7 +264,7 @@ int32_t inode_get_blocks(struct inode_elem* inode_elem, uint32_t cnt) {
   // now we should write both direct block and extend block
 
   // create extend block
-  uint32_t* ext_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE);
+  uint32_t* ext_blocks = kmem_cache_alloc(&block_buf_cache);
   if (ext_blocks == NULL) {
     // rollback if fail
     for (i = 0; i < cnt; i++) {
@@ -261,7 +277,7 @@ int32_t inode_get_blocks(struct inode_elem* inode_elem, uint32_t cnt) {
   int32_t ext_block_no = get_free_block_no(inode_elem->partmgr);
   if (ext_block_no < 0) {
     // rollback if fail
-    sys_free(ext_blocks);
+    kmem_cache_free(&block_buf_cache, ext_blocks);
     for (i = 0; i < cnt; i++) {
       release_block_no(inode_elem->partmgr, blocks[i]);
     }
@@ -306,7 +322,7 @@ uint32_t inode_block_used(struct inode_elem* inode_elem) {
 
   // has indirect block
   uint32_t* ext_blocks;
-  ext_blocks = (uint32_t*)sys_malloc(BLOCK_SIZE);
+  ext_blocks = kmem_cache_alloc(&block_buf_cache);
   inode_read_ext_blocks(inode_elem, (char*)ext_blocks);
 
   for (i = 0; i < FS_INODE_EXTEND_BLOCK_CNT; i++) {
@@ -316,7 +332,7 @@ uint32_t inode_block_used(struct inode_elem* inode_elem) {
     cnt++;
   }
 
-  sys_free(ext_blocks);
+  kmem_cache_free(&block_buf_cache, ext_blocks);
   return cnt;
 }
 
@@ -361,7 +377,7 @@ uint32_t inode_get_or_create_sec(struct inode_elem* inode_elem,
 
   // load extend sector
   uint32_t ext_blk_lba = inode->blocks[FS_INODE_EXTEND_BLOCK_INDEX];
-  uint32_t* ext_sec = (uint32_t*)sys_malloc(BLOCK_SIZE);
+  uint32_t* ext_sec = kmem_cache_alloc(&block_buf_cache);
   struct partition_manager* pmgr = inode_elem->partmgr;
   uint32_t real_lba = pmgr->part->lba_start + ext_blk_lba;
 
@@ -386,7 +402,7 @@ uint32_t inode_get_or_create_sec(struct inode_elem* inode_elem,
   }
 
   uint32_t ret = ext_sec[ext_sec_idx];
-  sys_free(ext_sec);
+  kmem_cache_free(&block_buf_cache, ext_sec);
   return ret;
 }
 
@@ -401,7 +417,7 @@ uint32_t inode_idx_to_lba(struct inode_elem* inode_elem, uint32_t sec_idx) {
     return 0;
   }
 
-  uint32_t* ext_sec = sys_malloc(BLOCK_SIZE);
+  uint32_t* ext_sec = kmem_cache_alloc(&block_buf_cache);
   if (ext_sec == NULL) {
     return 0;
   }
@@ -412,7 +428,7 @@ uint32_t inode_idx_to_lba(struct inode_elem* inode_elem, uint32_t sec_idx) {
   disk_read(pmgr->part->hd, ext_sec, real_lba, BLOCK_SECS);
 
   uint32_t ret = ext_sec[sec_idx - FS_INODE_EXTEND_BLOCK_INDEX];
-  sys_free(ext_sec);
+  kmem_cache_free(&block_buf_cache, ext_sec);
   return ret;
 }
 
@@ -436,6 +452,13 @@ int32_t inode_write(struct inode_elem* inode_elem, uint32_t sec_idx,
   struct partition_manager* pmgr = inode_elem->partmgr;
   uint32_t real_lba = pmgr->part->lba_start + lba;
   disk_write(pmgr->part->hd, buf, real_lba, BLOCK_SECS);
+
+  // Keep cached page in step with disk, it may be mapped by mmap
+  struct inode_page* page =
+      inode_page_find(inode_elem, sec_idx * BLOCK_SIZE / PG_SIZE);
+  if (page != NULL) {
+    memcpy((char*)page->kva + sec_idx * BLOCK_SIZE % PG_SIZE, buf, BLOCK_SIZE);
+  }
   return 0;
 }
 
@@ -458,3 +481,81 @@ int32_t inode_write_ext_blocks(struct inode_elem* inode_elem, char* buf) {
   disk_write(inode_elem->partmgr->part->hd, buf, real_lba, BLOCK_SECS);
   return 1;
 }
+
+static struct inode_page* inode_page_find(struct inode_elem* inode_elem,
+                                          uint32_t pg_idx) {
+  struct list_elem* elem;
+  for (elem = inode_elem->pages.head.next; elem != &inode_elem->pages.tail;
+       elem = elem->next) {
+    struct inode_page* page = elem2entry(struct inode_page, page_tag, elem);
+    if (page->pg_idx == pg_idx) {
+      return page;
+    }
+  }
+  return NULL;
+}
+
+// inode_page_get
+// Return kernel address of cached page pg_idx of file, read it from disk on
+// miss. Bytes beyond file size are zero. Return NULL if the page is past the
+// end of file or it runs out of memory.
+void* inode_page_get(struct inode_elem* inode_elem, uint32_t pg_idx) {
+  uint32_t size = inode_elem->inode.size;
+  if (pg_idx >= DIV_ROUND_UP(size, PG_SIZE)) {
+    return NULL;
+  }
+
+  struct inode_page* page = inode_page_find(inode_elem, pg_idx);
+  if (page != NULL) {
+    return page->kva;
+  }
+
+  page = kmem_cache_alloc(&inode_page_cache);
+  if (page == NULL) {
+    return NULL;
+  }
+  page->pg_idx = pg_idx;
+  page->kva = get_kernel_pages(1);
+  if (page->kva == NULL) {
+    kmem_cache_free(&inode_page_cache, page);
+    return NULL;
+  }
+
+  uint32_t sec_idx = pg_idx * (PG_SIZE / BLOCK_SIZE);
+  uint32_t sec_end = DIV_ROUND_UP(size, BLOCK_SIZE);
+  uint32_t i;
+  for (i = 0; i < PG_SIZE / BLOCK_SIZE && sec_idx + i < sec_end; i++) {
+    inode_read(inode_elem, sec_idx + i, (char*)page->kva + i * BLOCK_SIZE);
+  }
+  // Last block may hold stale bytes past end of file
+  uint32_t tail = size - pg_idx * PG_SIZE;
+  if (tail < PG_SIZE) {
+    memset((char*)page->kva + tail, 0, PG_SIZE - tail);
+  }
+
+  // Another thread may have cached it while we were waiting for disk
+  enum intr_status old_status = intr_disable();
+  struct inode_page* other = inode_page_find(inode_elem, pg_idx);
+  if (other == NULL) {
+    list_append(&inode_elem->pages, &page->page_tag);
+  }
+  intr_set_status(old_status);
+
+  if (other != NULL) {
+    free_kernel_pages(page->kva, 1);
+    kmem_cache_free(&inode_page_cache, page);
+    return other->kva;
+  }
+  return page->kva;
+}
+
+// inode_pages_free
+// Drop all cached pages of inode, nothing maps them once it is closed.
+static void inode_pages_free(struct inode_elem* inode_elem) {
+  while (!list_empty(&inode_elem->pages)) {
+    struct list_elem* elem = list_pop(&inode_elem->pages);
+    struct inode_page* page = elem2entry(struct inode_page, page_tag, elem);
+    free_kernel_pages(page->kva, 1);
+    kmem_cache_free(&inode_page_cache, page);
+  }
+}
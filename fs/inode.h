@@ -3,6 +3,7 @@
 
 #include "kernel/list.h"
 #include "partition_manager.h"
+#include "slab.h"
 #include "stdbool.h"
 #include "stdint.h"
 
@@ -18,12 +19,26 @@ struct inode_elem {
   struct inode inode;
   struct partition_manager* partmgr;
   struct list_elem inode_tag;
-  int32_t ref;  // How many files reference this inode
+  int32_t ref;        // How many files reference this inode
+  struct list pages;  // Cached file pages, see struct inode_page
+};
+
+// A page of file data cached in kernel memory. mmap maps its frame right into
+// user space, so it lives until the inode is closed for the last time.
+struct inode_page {
+  uint32_t pg_idx;  // Offset in file divided by page size
+  void* kva;
+  struct list_elem page_tag;
 };
 
 // inode_list caches opened inodes
 struct list inode_list;
 
+// Object caches for inode_elem, block sized buffers and inode_page
+extern struct kmem_cache inode_cache;
+extern struct kmem_cache block_buf_cache;
+extern struct kmem_cache inode_page_cache;
+
 extern void inode_sync(struct inode_elem* inode_elem);
 extern struct inode_elem* inode_create(struct partition_manager* pmgr,
                                        uint32_t inode_no);
@@ -41,5 +56,6 @@ extern int32_t inode_read(struct inode_elem* inode_elem, uint32_t sec_idx,
                           char* buf);
 extern int32_t inode_write(struct inode_elem* inode_elem, uint32_t sec_idx,
                            char* buf);
+extern void* inode_page_get(struct inode_elem* inode_elem, uint32_t pg_idx);
 
 #endif
@@ -1,7 +1,7 @@
 #ifndef __FS_PARTMGR_H
 #define __FS_PARTMGR_H
 
-#include "kernel/bitmap.h"
+#include "kernel/hbitmap.h"
 #include "stdint.h"
 #include "super_block.h"
 
@@ -10,8 +10,8 @@
 struct partition_manager {
   struct partition* part;
   struct super_block* sblock;
-  struct bitmap inode_btmp;
-  struct bitmap block_btmp;
+  struct hbitmap inode_btmp;
+  struct hbitmap block_btmp;
 };
 
 // default partition manager
@@ -0,0 +1,224 @@
+#include "buddy.h"
+
+#include "debug.h"
+#include "kernel/list.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdnull.h"
+
+// frame_table covers every page frame from physical address 0, it is set up by
+// mem_pool_init in kernel/memory.c
+struct frame* frame_table;
+uint32_t frame_cnt;
+
+// Private
+static void buddy_push(struct buddy* b, uint32_t pfn, uint32_t order);
+static bool buddy_in_range(struct buddy* b, uint32_t pfn, uint32_t order);
+static int32_t buddy_free_order(struct buddy* b, uint32_t pfn);
+
+// Public
+void buddy_init(struct buddy* b, uint32_t start_pfn, uint32_t end_pfn);
+void buddy_free_range(struct buddy* b, uint32_t pfn, uint32_t cnt);
+int32_t buddy_alloc(struct buddy* b, uint32_t order);
+int32_t buddy_alloc_pages(struct buddy* b, uint32_t cnt);
+void buddy_free(struct buddy* b, uint32_t pfn, uint32_t order);
+bool buddy_take_range(struct buddy* b, uint32_t pfn, uint32_t cnt);
+uint32_t buddy_order(uint32_t cnt);
+
+// Implementation
+
+// buddy_push
+// Put a free block into free_area of its order.
+static void buddy_push(struct buddy* b, uint32_t pfn, uint32_t order) {
+  struct frame* f = pfn2frame(pfn);
+  f->order = order;
+  f->flags |= FRAME_FREE;
+  list_push(&b->free_area[order], &f->free_elem);
+  b->free_cnt[order]++;
+}
+
+static bool buddy_in_range(struct buddy* b, uint32_t pfn, uint32_t order) {
+  return pfn >= b->start_pfn && pfn + (1 << order) <= b->end_pfn;
+}
+
+// buddy_init
+// Init an empty buddy system for frames in [start_pfn, end_pfn), use
+// buddy_free_range to add available frames.
+void buddy_init(struct buddy* b, uint32_t start_pfn, uint32_t end_pfn) {
+  ASSERT(start_pfn <= end_pfn && end_pfn <= frame_cnt);
+  b->start_pfn = start_pfn;
+  b->end_pfn = end_pfn;
+  b->free_pages = 0;
+
+  int i;
+  for (i = 0; i < BUDDY_ORDER_CNT; i++) {
+    b->free_cnt[i] = 0;
+    list_init(&b->free_area[i]);
+  }
+}
+
+// buddy_free_range
+// Release cnt frames starting at pfn, split them into the largest aligned
+// blocks.
+void buddy_free_range(struct buddy* b, uint32_t pfn, uint32_t cnt) {
+  while (cnt > 0) {
+    uint32_t order = 0;
+    while (order < BUDDY_ORDER_CNT - 1 && (pfn & ((2 << order) - 1)) == 0 &&
+           (2u << order) <= cnt) {
+      order++;
+    }
+    buddy_free(b, pfn, order);
+    pfn += 1 << order;
+    cnt -= 1 << order;
+  }
+}
+
+// buddy_alloc
+// Allocate a 2^order pages block, return the pfn of first frame, -1 for fail.
+// Split a larger block if there is no free block of the given order.
+int32_t buddy_alloc(struct buddy* b, uint32_t order) {
+  ASSERT(order < BUDDY_ORDER_CNT);
+
+  uint32_t o;
+  for (o = order; o < BUDDY_ORDER_CNT; o++) {
+    if (!list_empty(&b->free_area[o])) {
+      break;
+    }
+  }
+
+  if (o == BUDDY_ORDER_CNT) {
+    return -1;
+  }
+
+  struct frame* f =
+      elem2entry(struct frame, free_elem, list_pop(&b->free_area[o]));
+  b->free_cnt[o]--;
+  f->flags &= ~FRAME_FREE;
+
+  // Return the upper half to free_area until the block fits
+  uint32_t pfn = frame2pfn(f);
+  while (o > order) {
+    o--;
+    buddy_push(b, pfn + (1 << o), o);
+  }
+
+  f->order = order;
+  b->free_pages -= 1 << order;
+  return pfn;
+}
+
+// buddy_alloc_pages
+// Allocate cnt physically continuous pages, the unused tail of the 2^order
+// block is given back at once.
+int32_t buddy_alloc_pages(struct buddy* b, uint32_t cnt) {
+  uint32_t order = buddy_order(cnt);
+  if (order >= BUDDY_ORDER_CNT) {
+    return -1;
+  }
+
+  int32_t pfn = buddy_alloc(b, order);
+  if (pfn < 0) {
+    return -1;
+  }
+
+  if ((1u << order) > cnt) {
+    buddy_free_range(b, pfn + cnt, (1 << order) - cnt);
+  }
+  return pfn;
+}
+
+// buddy_free
+// Release a 2^order pages block, merge it with its buddy as long as the buddy
+// is also free.
+void buddy_free(struct buddy* b, uint32_t pfn, uint32_t order) {
+  ASSERT(buddy_in_range(b, pfn, order));
+  ASSERT(!(pfn2frame(pfn)->flags & FRAME_FREE));
+
+  b->free_pages += 1 << order;
+
+  while (order < BUDDY_ORDER_CNT - 1) {
+    uint32_t buddy_pfn = pfn ^ (1 << order);
+    if (!buddy_in_range(b, buddy_pfn, order)) {
+      break;
+    }
+
+    struct frame* bf = pfn2frame(buddy_pfn);
+    if (!(bf->flags & FRAME_FREE) || bf->order != order) {
+      break;
+    }
+
+    // Take buddy out and merge
+    list_remove(&bf->free_elem);
+    b->free_cnt[order]--;
+    bf->flags &= ~FRAME_FREE;
+
+    pfn &= ~(1 << order);
+    order++;
+  }
+
+  buddy_push(b, pfn, order);
+}
+
+// buddy_free_order
+// Return the order of the free block holding frame pfn, -1 if pfn is in use.
+static int32_t buddy_free_order(struct buddy* b, uint32_t pfn) {
+  uint32_t order;
+  for (order = 0; order < BUDDY_ORDER_CNT; order++) {
+    uint32_t head = pfn & ~((1u << order) - 1);
+    if (!buddy_in_range(b, head, order)) {
+      break;
+    }
+    struct frame* f = pfn2frame(head);
+    if ((f->flags & FRAME_FREE) && f->order == order) {
+      return order;
+    }
+  }
+  return -1;
+}
+
+// buddy_take_range
+// Take cnt frames starting at pfn out of free_area if all of them are free,
+// return false and change nothing otherwise. Free blocks crossing either end
+// of the range are split, the parts outside are given back.
+bool buddy_take_range(struct buddy* b, uint32_t pfn, uint32_t cnt) {
+  uint32_t end = pfn + cnt;
+  uint32_t p = pfn;
+  while (p < end) {
+    int32_t order = buddy_free_order(b, p);
+    if (order < 0) {
+      return false;
+    }
+    p = (p & ~((1u << order) - 1)) + (1 << order);
+  }
+
+  p = pfn;
+  while (p < end) {
+    uint32_t order = buddy_free_order(b, p);
+    uint32_t head = p & ~((1u << order) - 1);
+    struct frame* f = pfn2frame(head);
+    list_remove(&f->free_elem);
+    b->free_cnt[order]--;
+    b->free_pages -= 1 << order;
+    f->flags &= ~FRAME_FREE;
+
+    // Frames of the range are not free, the parts can not merge into it
+    p = head + (1 << order);
+    if (head < pfn) {
+      buddy_free_range(b, head, pfn - head);
+    }
+    if (p > end) {
+      buddy_free_range(b, end, p - end);
+    }
+  }
+  return true;
+}
+
+// buddy_order
+// Return the smallest order whose block holds cnt pages.
+uint32_t buddy_order(uint32_t cnt) {
+  uint32_t order = 0;
+  while (order < 31 && (1u << order) < cnt) {
+    order++;
+  }
+  return order;
+}
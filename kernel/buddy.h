@@ -0,0 +1,61 @@
+#ifndef __KERNEL_BUDDY_H
+#define __KERNEL_BUDDY_H
+
+#include "kernel/list.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+// Largest block is 2^(BUDDY_ORDER_CNT - 1) pages, namely 4MB
+#define BUDDY_ORDER_CNT 11
+
+// frame flags
+#define FRAME_FREE (1 << 0)   // Head of a free block in some buddy free_area
+#define FRAME_ARENA (1 << 1)  // Page of a sys_malloc arena
+#define FRAME_LARGE (1 << 2)  // First page of a sys_malloc large block
+#define FRAME_ZERO (1 << 3)   // Free page kept zeroed in pa_pool zero_frames
+
+// Each physical page frame owns a struct frame in frame_table, indexed by its
+// page frame number (pfn = pa / PG_SIZE).
+struct frame {
+  union {
+    struct list_elem free_elem;  // Tag in buddy free_area list
+    struct {
+      void* arena;            // Arena owning the page, for FRAME_ARENA
+      uint32_t large_pg_cnt;  // Page count of large block, for FRAME_LARGE
+    };
+    struct {
+      int32_t map_pid;  // Process last mapping an anonymous user frame
+      uint32_t map_va;  // and where, so swap can find the PTE
+    };
+  };
+  uint8_t order;  // Block order, only valid for free block head
+  uint8_t flags;
+  uint16_t ref_cnt;  // Other mappings sharing a user frame after fork
+};
+
+// A buddy system manages frames in [start_pfn, end_pfn). Blocks of order k are
+// aligned to 2^k pages in physical address, so the buddy of block pfn is
+// simply pfn ^ (1 << k).
+struct buddy {
+  uint32_t start_pfn;
+  uint32_t end_pfn;
+  uint32_t free_pages;
+  uint32_t free_cnt[BUDDY_ORDER_CNT];  // free block count of each order
+  struct list free_area[BUDDY_ORDER_CNT];
+};
+
+extern struct frame* frame_table;
+extern uint32_t frame_cnt;
+
+#define pfn2frame(pfn) (&frame_table[(pfn)])
+#define frame2pfn(f) ((uint32_t)((f) - frame_table))
+
+void buddy_init(struct buddy* b, uint32_t start_pfn, uint32_t end_pfn);
+void buddy_free_range(struct buddy* b, uint32_t pfn, uint32_t cnt);
+int32_t buddy_alloc(struct buddy* b, uint32_t order);
+int32_t buddy_alloc_pages(struct buddy* b, uint32_t cnt);
+void buddy_free(struct buddy* b, uint32_t pfn, uint32_t order);
+bool buddy_take_range(struct buddy* b, uint32_t pfn, uint32_t cnt);
+uint32_t buddy_order(uint32_t cnt);
+
+#endif
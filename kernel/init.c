@@ -7,6 +7,8 @@
 #include "kernel/print.h"
 #include "keyboard.h"
 #include "memory.h"
+#include "shm.h"
+#include "swap.h"
 #include "syscall.h"
 #include "thread.h"
 #include "timer.h"
@@ -24,4 +26,6 @@ void init_all() {
   syscall_init();
   disk_init();
   fs_init();
+  swap_init();
+  shm_init();
 }
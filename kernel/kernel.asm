@@ -55,16 +55,16 @@ VECTOR 0x04, ZERO
 VECTOR 0x05, ZERO
 VECTOR 0x06, ZERO
 VECTOR 0x07, ZERO
-VECTOR 0x08, ZERO
+VECTOR 0x08, ERROR_CODE
 VECTOR 0x09, ZERO
-VECTOR 0x0A, ZERO
-VECTOR 0x0B, ZERO
-VECTOR 0x0C, ZERO
-VECTOR 0x0D, ZERO
-VECTOR 0x0E, ZERO
+VECTOR 0x0A, ERROR_CODE
+VECTOR 0x0B, ERROR_CODE
+VECTOR 0x0C, ERROR_CODE
+VECTOR 0x0D, ERROR_CODE
+VECTOR 0x0E, ERROR_CODE
 VECTOR 0x0F, ZERO
 VECTOR 0x10, ZERO
-VECTOR 0x11, ZERO
+VECTOR 0x11, ERROR_CODE
 VECTOR 0x12, ZERO
 VECTOR 0x13, ZERO
 VECTOR 0x14, ZERO
@@ -8,10 +8,15 @@
 #include "kernel/print.h"
 #include "memory.h"
 #include "process.h"
+#include "slab.h"
+#include "stdbool.h"
 #include "stdio.h"
 #include "string.h"
+#include "swap.h"
 #include "syscall.h"
 #include "thread.h"
+#include "timer.h"
+#include "user/malloc.h"
 
 // DEBUG ONLY
 #include "file.h"
@@ -20,6 +25,16 @@
 #include "stdnull.h"
 
 void u_malloc_test(void);
+void u_fork_test(void);
+void u_mmap_test(void);
+void u_exit_test(void);
+void u_swap_test(void);
+void u_realloc_test(void);
+void u_meminfo_test(void);
+void u_shm_test(void);
+void k_pool_test(void* arg);
+void k_atomic_test(void* arg);
+void cs_bench(void* arg);
 void test_fs(void);
 // void disk_test(void* arg);
 
@@ -30,7 +45,18 @@ int main(void) {
   intr_enable();
 
   // process_execute(u_malloc_test, "u_malloc_test");
+  // process_execute(u_fork_test, "u_fork_test");
+  // Needs /root/chloe written by test_fs
+  // process_execute(u_mmap_test, "u_mmap_test");
+  // process_execute(u_exit_test, "u_exit_test");
+  // process_execute(u_swap_test, "u_swap_test");
+  // process_execute(u_realloc_test, "u_realloc_test");
+  // process_execute(u_meminfo_test, "u_meminfo_test");
+  // process_execute(u_shm_test, "u_shm_test");
+  // thread_start("k_pool_test", 31, k_pool_test, NULL);
+  // thread_start("k_atomic_test", 31, k_atomic_test, NULL);
   // thread_start("disk_test", 31, disk_test, NULL);
+  // thread_start("cs_bench", 31, cs_bench, NULL);
   process_execute(test_fs, "test_fs");
 
   // while(1);
@@ -46,26 +72,17 @@ void u_malloc_test(void) {
 
   uint32_t test_cnt = 1024;
   // stack storing allocated address
-  uint32_t* s = malloc(sizeof(uint32_t) * test_cnt);
+  uint32_t* s = trap_malloc(sizeof(uint32_t) * test_cnt);
 
-  uint8_t* old_u_bits = malloc(u_pa_pool.btmp.btmp_bytes_len);
-  uint8_t* old_k_bits = malloc(k_pa_pool.btmp.btmp_bytes_len);
+  uint32_t old_u_free = mem_free_pages(PF_USER);
 
   uint32_t i;
-  for (i = 0; i < u_pa_pool.btmp.btmp_bytes_len; i++) {
-    old_u_bits[i] = u_pa_pool.btmp.bits[i];
-  }
-
-  for (i = 0; i < k_pa_pool.btmp.btmp_bytes_len; i++) {
-    old_k_bits[i] = k_pa_pool.btmp.bits[i];
-  }
-
   void* addr;
   uint32_t size;
   rand_set_seed(1997);
   for (i = 0; i < test_cnt; i++) {
     size = rand();
-    addr = malloc(size);
+    addr = trap_malloc(size);
     printf("[test malloc %d] malloc %d bytes beginning at 0x%x\n", i, size,
            (uint32_t)addr);
     s[i] = (uint32_t)addr;
@@ -73,23 +90,498 @@ void u_malloc_test(void) {
 
   for (i = 0; i < test_cnt; i++) {
     printf("[test free %d] free 0x%x\n", i, s[i]);
-    free(s[i]);
+    trap_free(s[i]);
   }
 
-  for (i = 0; i < u_pa_pool.btmp.btmp_bytes_len; i++) {
-    if (old_u_bits[i] != u_pa_pool.btmp.bits[i]) {
-      printf("user bits[%d] not match!!\n", i);
-      while (1)
-        ;
-    }
+  trap_malloc_stats();
+
+  // Blocks cached in magazines still hold their arenas
+  trap_malloc_trim();
+
+  if (mem_free_pages(PF_USER) != old_u_free) {
+    printf("user free pages not match!!\n");
+    while (1)
+      ;
+  }
+
+  printf("Pass user pa_pool free pages test.\n");
+
+  for (i = 0; i < BUDDY_ORDER_CNT; i++) {
+    printf("order %d free blocks : user %d kernel %d\n", i,
+           mem_free_blocks(PF_USER, i), mem_free_blocks(PF_KERNEL, i));
+  }
+
+  // Same random sizes through user space malloc, the heap goes back to kernel
+  // after all blocks are freed and trimmed
+  rand_set_seed(1997);
+  for (i = 0; i < test_cnt; i++) {
+    s[i] = (uint32_t)malloc(rand());
+  }
+  for (i = 0; i < test_cnt; i++) {
+    free((void*)s[i]);
+  }
+  malloc_trim();
+  if (sbrk(0) != (void*)(USER_DATA_PAGE + PG_SIZE)) {
+    printf("user heap not trimmed!!\n");
+    while (1)
+      ;
+  }
+  printf("Pass user heap trim test.\n");
+
+  // Reserve a big heap and touch one page in every 16, only touched pages
+  // take memory
+  uint32_t heap_size = 1024 * PG_SIZE;
+  old_u_free = mem_free_pages(PF_USER);
+  char* heap = sbrk(heap_size);
+  for (i = 0; i < heap_size; i += 16 * PG_SIZE) {
+    heap[i] = 1;
+  }
+  printf("sbrk %d pages, touched %d pages, used %d pages\n",
+         heap_size / PG_SIZE, heap_size / PG_SIZE / 16,
+         old_u_free - mem_free_pages(PF_USER));
+  sbrk(-heap_size);
+  if (mem_free_pages(PF_USER) != old_u_free) {
+    printf("user free pages not match after sbrk!!\n");
+    while (1)
+      ;
+  }
+
+  // Small malloc/free pairs, trapping into kernel every call against user
+  // space malloc
+  uint32_t bench_cnt = 20000;
+  uint32_t start = ticks;
+  for (i = 0; i < bench_cnt; i++) {
+    trap_free(trap_malloc(32 + i % 64));
+  }
+  uint32_t trap_ticks = ticks - start;
+
+  start = ticks;
+  for (i = 0; i < bench_cnt; i++) {
+    free(malloc(32 + i % 64));
+  }
+  uint32_t lib_ticks = ticks - start;
+
+  printf("%d malloc/free pairs: trap %d ticks, lib %d ticks\n", bench_cnt,
+         trap_ticks, lib_ticks);
+  malloc_stats();
+
+  while (1)
+    ;
+}
+
+void u_fork_test(void) {
+  uint32_t pg_cnt = 256;
+  uint32_t i;
+  char* buf = malloc(pg_cnt * PG_SIZE);
+  for (i = 0; i < pg_cnt; i++) {
+    buf[i * PG_SIZE] = 'p';
+  }
+
+  uint32_t old_u_free = mem_free_pages(PF_USER);
+  uint32_t start = ticks;
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Child shares parent's pages until it writes one of them
+    printf("child %d: fork used %d user pages\n", getpid(),
+           old_u_free - mem_free_pages(PF_USER));
+    buf[0] = 'c';
+    printf("child %d: write copied %d user pages, buf[0] %c\n", getpid(),
+           old_u_free - mem_free_pages(PF_USER), buf[0]);
+    while (1)
+      ;
   }
 
-  printf("Pass user pa_pool bitmap test.\n");
+  printf("parent %d: fork child %d with %d touched pages in %d ticks\n",
+         getpid(), pid, pg_cnt, ticks - start);
+  // Let child write first, parent still sees its own data
+  for (i = 0; i < 10000000; i++) {
+    asm volatile("" : : : "memory");
+  }
+  if (buf[0] != 'p') {
+    printf("parent %d: page changed by child!!\n", getpid());
+  } else {
+    printf("Pass fork COW test.\n");
+  }
+  // Page tables of child and its faulted pages come from pre-zeroed pages
+  mem_zero_stats();
 
   while (1)
     ;
 }
 
+void u_mmap_test(void) {
+  int32_t fd = open("/root/chloe", 0);
+  if (fd < 0) {
+    while (1)
+      ;
+  }
+
+  // Compare file pages faulted in from page cache with read()
+  char* map = mmap(NULL, 2 * PG_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  char* buf = malloc(2 * PG_SIZE);
+  int32_t size = read(fd, buf, 2 * PG_SIZE);
+  printf("mmap chloe at 0x%x, read %d bytes\n", (uint32_t)map, size);
+  if (map == MAP_FAILED || memcmp(map, buf, size) != 0) {
+    printf("mmap data differs from read!!\n");
+  }
+
+  // Private writable mapping copies the page on write, file is unchanged
+  char* cow = mmap(NULL, PG_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  cow[0] = 'H';
+  if (cow[0] != 'H' || map[0] != 'h') {
+    printf("private file mapping leaks to page cache!!\n");
+  }
+  munmap(cow, PG_SIZE);
+  munmap(map, 2 * PG_SIZE);
+  close(fd);
+
+  // Anonymous pages come on first touch and go back on munmap
+  uint32_t pg_cnt = 64;
+  uint32_t old_u_free = mem_free_pages(PF_USER);
+  char* anon = mmap(NULL, pg_cnt * PG_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uint32_t i;
+  for (i = 0; i < pg_cnt; i++) {
+    anon[i * PG_SIZE] = 'a';
+  }
+  printf("mmap %d anonymous pages used %d user pages\n", pg_cnt,
+         old_u_free - mem_free_pages(PF_USER));
+  // 64 pages are more than a TLB batch, munmap flushes them by one CR3 reload
+  uint32_t old_all_flush = tlb_stats.all_flush;
+  munmap(anon, pg_cnt * PG_SIZE);
+  printf("munmap %d pages with %d full flush\n", pg_cnt,
+         tlb_stats.all_flush - old_all_flush);
+  tlb_stats_print();
+  if (mem_free_pages(PF_USER) != old_u_free) {
+    printf("munmap leaks %d user pages!!\n",
+           old_u_free - mem_free_pages(PF_USER));
+  } else {
+    printf("Pass mmap test.\n");
+  }
+
+  while (1)
+    ;
+}
+
+// Keep spawning workers which touch some heap and exit, memory should all
+// come back after they are waited.
+void u_exit_test(void) {
+  uint32_t rounds = 100;
+  uint32_t old_u_free = mem_free_pages(PF_USER);
+  uint32_t old_k_free = mem_free_pages(PF_KERNEL);
+  uint32_t i;
+  for (i = 0; i < rounds; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      uint32_t j;
+      char* buf = malloc(16 * PG_SIZE);
+      for (j = 0; j < 16; j++) {
+        buf[j * PG_SIZE] = 'w';
+      }
+      exit(i);
+    }
+    int32_t status;
+    if (wait(&status) != pid || status != (int32_t)i) {
+      printf("worker %d exit status %d!!\n", pid, status);
+    }
+  }
+
+  printf("%d workers: %d user pages, %d kernel pages not back\n", rounds,
+         old_u_free - mem_free_pages(PF_USER),
+         old_k_free - mem_free_pages(PF_KERNEL));
+  if (mem_free_pages(PF_USER) != old_u_free) {
+    printf("exit leaks user pages!!\n");
+  } else {
+    printf("Pass exit test.\n");
+  }
+  exit(0);
+}
+
+// Touch more pages than both pools have, user pool takes what kernel pool can
+// spare and older pages have to go to swap and come back when they are
+// checked. Every other page is filled with noise, which does not compress and
+// goes to the swap partition if there is one.
+void u_swap_test(void) {
+  uint32_t pg_cnt = mem_free_pages(PF_USER) + mem_free_pages(PF_KERNEL) + 256;
+  uint32_t* buf = malloc(pg_cnt * PG_SIZE);
+  if (buf == NULL) {
+    printf("u_swap_test: malloc %d pages failed!!\n", pg_cnt);
+    exit(-1);
+  }
+
+  uint32_t i;
+  uint32_t start = ticks;
+  for (i = 0; i < pg_cnt; i++) {
+    uint32_t* page = &buf[i * PG_SIZE / 4];
+    page[0] = i;
+    if (i % 2 == 1) {
+      uint32_t j;
+      for (j = 1; j < PG_SIZE / 4; j++) {
+        page[j] = rand();
+      }
+    }
+  }
+  for (i = 0; i < pg_cnt; i++) {
+    if (buf[i * PG_SIZE / 4] != i) {
+      printf("page %d lost in swap!!\n", i);
+      exit(-1);
+    }
+  }
+  printf("Pass swap test, %d pages in %d ticks.\n", pg_cnt, ticks - start);
+  swap_stats_print();
+  exit(0);
+}
+
+// Grow a buffer a page at a time as a path builder or directory listing
+// would, both by user heap and by syscall. Content must survive each move,
+// most grows should happen in place.
+void u_realloc_test(void) {
+  uint32_t round = 64;
+  uint32_t* buf = NULL;
+  uint32_t* tbuf = NULL;
+  uint32_t i, j;
+  for (i = 1; i <= round; i++) {
+    uint32_t cnt = i * PG_SIZE / 4;
+    buf = realloc(buf, cnt * 4);
+    tbuf = trap_realloc(tbuf, cnt * 4);
+    if (buf == NULL || tbuf == NULL) {
+      printf("u_realloc_test: realloc %d pages failed!!\n", i);
+      exit(-1);
+    }
+    for (j = cnt - PG_SIZE / 4; j < cnt; j++) {
+      buf[j] = j;
+      tbuf[j] = j;
+    }
+    for (j = 0; j < cnt; j++) {
+      if (buf[j] != j || tbuf[j] != j) {
+        printf("u_realloc_test: word %d lost at %d pages!!\n", j, i);
+        exit(-1);
+      }
+    }
+  }
+  buf = realloc(buf, 100);
+  tbuf = trap_realloc(tbuf, 100);
+  if (buf[24] != 24 || tbuf[24] != 24) {
+    printf("u_realloc_test: shrink lost content!!\n");
+    exit(-1);
+  }
+  free(buf);
+  trap_free(tbuf);
+  printf("Pass realloc test.\n");
+  malloc_stats();
+  trap_malloc_stats();
+  exit(0);
+}
+
+static void meminfo_pool_print(char* name, struct meminfo_pool* mp) {
+  printf("%s: %d pages, %d free, peak %d, alloc %d free %d, %d chunks in\n",
+         name, mp->pages, mp->free_pages, mp->peak_pages, mp->alloc_cnt,
+         mp->free_cnt, mp->grow_cnt);
+}
+
+static void meminfo_class_print(struct meminfo_class* mc) {
+  printf("size alloc free live peak arenas\n");
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    printf("%d %d %d %d %d %d\n", mc[i].block_size, mc[i].alloc_cnt,
+           mc[i].free_cnt, mc[i].live_bytes, mc[i].peak_bytes,
+           mc[i].arena_cnt);
+  }
+}
+
+// Poll meminfo around some trap_malloc and heap page faults, as a memory
+// monitor would.
+void u_meminfo_test(void) {
+  struct meminfo info;
+  uint32_t* s[64];
+  uint32_t i;
+  for (i = 0; i < 64; i++) {
+    s[i] = trap_malloc(16 << (i % 8));
+  }
+  for (i = 0; i < 32; i++) {
+    trap_free(s[i]);
+  }
+  char* heap = malloc(64 * PG_SIZE);
+  for (i = 0; i < 64; i++) {
+    heap[i * PG_SIZE] = i;
+  }
+
+  meminfo(&info);
+  meminfo_pool_print("kernel pool", &info.kernel);
+  meminfo_pool_print("user pool", &info.user);
+  meminfo_class_print(info.u_classes);
+  printf("faults %d: anon %d file %d cow %d swap %d fail %d, ours %d\n",
+         info.faults.total, info.faults.anon, info.faults.file,
+         info.faults.cow, info.faults.swap_in, info.faults.fail,
+         info.proc_faults);
+  exit(0);
+}
+
+// Parent creates a segment and forks, child attaches it by key and waits for
+// parent to fill it. Both see the same pages, no copy is made on write.
+void u_shm_test(void) {
+  uint32_t key = 0x5348;
+  uint32_t pg_cnt = 16;
+  uint32_t words = pg_cnt * PG_SIZE / 4;
+  volatile uint32_t* seg = shm_create(key, pg_cnt * PG_SIZE);
+  if (seg == NULL) {
+    printf("shm_create failed!!\n");
+    exit(-1);
+  }
+
+  uint32_t i;
+  pid_t pid = fork();
+  if (pid == 0) {
+    volatile uint32_t* mine = shm_attach(key);
+    while (mine[0] == 0)
+      ;
+    for (i = 1; i < words; i++) {
+      if (mine[i] != i) {
+        printf("child %d: word %d is %d!!\n", getpid(), i, mine[i]);
+        exit(-1);
+      }
+    }
+    // Parent reads it back through its own mapping
+    mine[1] = 0;
+    shm_detach((void*)mine);
+    exit(0);
+  }
+
+  for (i = 1; i < words; i++) {
+    seg[i] = i;
+  }
+  seg[0] = 1;
+  int32_t status;
+  wait(&status);
+  if (status != 0 || seg[1] != 0) {
+    printf("shm data not shared!!\n");
+  } else {
+    printf("Pass shm test.\n");
+  }
+  struct meminfo info;
+  meminfo(&info);
+  printf("shm faults %d\n", info.faults.shm);
+  shm_detach((void*)seg);
+  exit(0);
+}
+
+// Take kernel pages until kernel pool has grown into user pool by a few
+// chunks, each page links to the previous one. Idle moves chunks back as user
+// pool runs low later.
+void k_pool_test(void* UNUSED_ARG) {
+  uint32_t grow_cnt = k_pa_pool.grow_cnt;
+  uint32_t pg_cnt = 0;
+  void** last = NULL;
+  mem_pool_stats();
+  while (k_pa_pool.grow_cnt < grow_cnt + 4) {
+    void** page = get_kernel_pages(1);
+    if (page == NULL) {
+      printf("k_pool_test: out of memory after %d pages!!\n", pg_cnt);
+      break;
+    }
+    *page = last;
+    last = page;
+    pg_cnt++;
+  }
+  mem_pool_stats();
+
+  while (last != NULL) {
+    void** prev = *last;
+    free_kernel_pages(last, 1);
+    last = prev;
+  }
+  printf("Pass pool test, %d kernel pages.\n", pg_cnt);
+  mem_pool_stats();
+  thread_block(TASK_BLOCKED);
+}
+
+// Drain the reserve of a class with interrupt off, as a burst of interrupt
+// handlers would, then sleep so idle thread refills it.
+void k_atomic_test(void* UNUSED_ARG) {
+  void* blocks[MEM_ATOMIC_HIGH];
+  uint32_t cnt = 0;
+  enum intr_status old_status = intr_disable();
+  while (cnt < MEM_ATOMIC_HIGH) {
+    blocks[cnt] = kmalloc_atomic(64);
+    if (blocks[cnt] == NULL) {
+      break;
+    }
+    cnt++;
+  }
+  bool empty = kmalloc_atomic(64) == NULL;
+  while (cnt > 0) {
+    kfree_atomic(blocks[--cnt]);
+  }
+  intr_set_status(old_status);
+
+  // Take all blocks again and keep them, idle refills the class
+  while (kmalloc_atomic(64) != NULL) {
+  }
+  sys_milisleep(100);
+  if (!empty || mem_atomic_free_blocks(64) < MEM_ATOMIC_LOW) {
+    printf("atomic reserve not refilled!!\n");
+  } else {
+    printf("Pass atomic test, %d blocks refilled.\n",
+           mem_atomic_free_blocks(64));
+  }
+  sys_malloc_stats();
+  thread_block(TASK_BLOCKED);
+}
+
+// Context switch benchmark. Two kernel threads yield to each other and touch
+// CS_TOUCH_PAGES kernel pages after each switch. In the old way each switch
+// writes CR3 and kernel pages are not global, we emulate it by flushing the
+// whole TLB per switch.
+#define CS_ROUNDS 10000
+#define CS_TOUCH_PAGES 32
+
+static char* cs_buf;
+static bool cs_flush;
+static uint32_t cs_done;
+
+static uint32_t rdtsc_low(void) {
+  uint32_t low;
+  asm volatile("rdtsc" : "=a"(low) : : "edx");
+  return low;
+}
+
+static void cs_bench_thread(void* UNUSED_ARG) {
+  uint32_t i, j;
+  for (i = 0; i < CS_ROUNDS; i++) {
+    if (cs_flush) {
+      tlb_flush_all();
+    }
+    for (j = 0; j < CS_TOUCH_PAGES; j++) {
+      cs_buf[j * PG_SIZE]++;
+    }
+    thread_yield();
+  }
+  cs_done++;
+  thread_block(TASK_BLOCKED);
+}
+
+void cs_bench(void* UNUSED_ARG) {
+  cs_buf = get_kernel_pages(CS_TOUCH_PAGES);
+  uint32_t mode;
+  for (mode = 0; mode < 2; mode++) {
+    cs_flush = mode == 0;
+    cs_done = 0;
+    uint32_t old_load = tlb_stats.cr3_load;
+    uint32_t start = rdtsc_low();
+    thread_start("cs_ping", 31, cs_bench_thread, NULL);
+    thread_start("cs_pong", 31, cs_bench_thread, NULL);
+    while (cs_done < 2) {
+      thread_yield();
+    }
+    printf("cs_bench %s: %d cycles per switch, %d CR3 loads\n",
+           cs_flush ? "flush" : "keep",
+           (rdtsc_low() - start) / (2 * CS_ROUNDS),
+           tlb_stats.cr3_load - old_load);
+  }
+  tlb_stats_print();
+  thread_block(TASK_BLOCKED);
+}
+
 /*
 char disk_test_buf_w[512], disk_test_buf_r[512];
 
@@ -196,6 +688,8 @@ void test_fs(void) {
   }
   closedir(dir);
 
+  kmem_cache_report();
+
 loop:
   while (1)
     ;
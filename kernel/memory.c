@@ -1,32 +1,81 @@
 #include "memory.h"
 
+#include "buddy.h"
 #include "debug.h"
+#include "fs.h"
 #include "global.h"
+#include "inode.h"
+#include "interrupt.h"
 #include "kernel/print.h"
+#include "process.h"
+#include "shm.h"
+#include "slab.h"
 #include "stdbool.h"
+#include "stdio.h"
 #include "stdint.h"
 #include "stdnull.h"
 #include "string.h"
+#include "swap.h"
+#include "sync.h"
 #include "thread.h"
+#include "tlb.h"
+#include "vma.h"
 
 #define PG_SIZE 4096
 
-// The memory bitmap base address
-// Our stack top at 0xc009f000, kernel PCB at 0xc009e000. We set up 4 page for
-// out bitmap, then the bitmap can map total 4096 * 8(bit) * 4(kb) * 4(number of
-// bitmap) / 1024 = 512 MB memory.
-#define MEM_BITMAP_BASE 0xc009a000
+// Kernel pool has to fit in the direct map, we leave the rest of kernel space
+// for page mapped allocations. Memory beyond it goes to user pool.
+#define K_POOL_MAX_PAGES (0x20000000 / PG_SIZE)
 
-// Kernel heap start address, skip the first 1MB
-#define K_HEAP_START 0xc0100000
+// Frames move between kernel and user pool MEM_CHUNK_PAGES at a time, by
+// shifting the boundary of them. A pool gets a chunk when it runs out of
+// frames, or when idle finds it below MEM_POOL_LOW free pages, as long as the
+// other pool keeps MEM_POOL_HIGH free pages after giving it.
+#define MEM_CHUNK_PAGES 256
+#define MEM_POOL_LOW 256
+#define MEM_POOL_HIGH 1024
 
-// The address storing total memory size, defined in boot/loader.asm
+// Page mapped kernel space ends where the page table self map begins
+#define K_MAPPED_END 0xffc00000
+
+#define PG_SIZE_4M 0x400000
+#define CR4_PSE (1 << 4)
+#define CPUID_PSE (1 << 3)
+
+// The address storing total memory size, defined in boot/loader.asm, it is the
+// fallback when BIOS does not support E820
 #define MEMORY_TOTAL_BYTES_ADDR 0xa00
 
+// The E820 memory map collected by boot/loader.asm
+#define E820_NR_ADDR 0xc04
+#define E820_MAP_ADDR 0xc08
+#define E820_TYPE_USABLE 1
+
+struct e820_entry {
+  uint64_t base;
+  uint64_t len;
+  uint32_t type;
+} __attribute__((packed));
+
+// Usable physical memory ranges in page frame number, sorted by address
+#define MEM_RANGE_MAX 32
+
+struct mem_range {
+  uint32_t start_pfn;
+  uint32_t end_pfn;
+};
+
+static struct mem_range mem_ranges[MEM_RANGE_MAX];
+static uint32_t mem_range_cnt;
+
 struct pa_pool k_pa_pool, u_pa_pool;
 
 struct va_pool k_va_pool;
 
+uint32_t k_direct_end;
+
+struct pf_stats pf_stats;
+
 static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt);
 
 static void vaddr_free(enum pool_flags pf, void* _vaddr);
@@ -39,23 +88,110 @@ static void* palloc(struct pa_pool* m_pool);
 
 static void pfree(struct pa_pool* m_pool, void* _paddr);
 
+static void* zero_frame_get(struct pa_pool* m_pool);
+
+static void* palloc_zeroed(struct pa_pool* m_pool, bool* zeroed);
+
+static void pool_alloc_note(struct pa_pool* m_pool, uint32_t pg_cnt);
+
 static void page_table_add(void* _vaddr, void* _page_phyaddr);
+static bool pde_fill(uint32_t vaddr);
+static bool page_table_prepare(uint32_t va);
 
 static void page_table_remove(void* _vaddr);
 
+static bool kva_direct(uint32_t va);
+
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt);
 
 void free_page(enum pool_flags pf, void* vaddr);
 
+static void page_free(enum pool_flags pf, void* vaddr);
+
 void* get_kernel_pages(uint32_t pg_cnt);
 
+void free_kernel_pages(void* va, uint32_t pg_cnt);
+
 void* get_user_pages(uint32_t pg_cnt);
 
 void* get_a_page(enum pool_flags pf, uint32_t va);
 
+bool user_va_reserve(uint32_t va, uint32_t pg_cnt);
+
+void* sys_brk(void* brk);
+
+static bool page_mapped(uint32_t va);
+
+static bool page_swapped(uint32_t va);
+
+static void page_swap_drop(uint32_t va);
+
+static bool user_frame(uint32_t pa);
+
+static void frame_map_set(uint32_t pa, uint32_t va);
+
+static void* frame_kva(uint32_t pa, uint32_t window);
+
+static void frame_kva_put(void* kva);
+
+static void* user_page_fill(uint32_t va, bool writable);
+
+static void* file_page_fill(struct vm_area* vma, uint32_t va);
+
+static void* shm_page_fill(struct vm_area* vma, uint32_t va);
+
+static bool cow_break(uint32_t va);
+
+static uint32_t heap_page_copy(uint32_t va, struct task_struct* child);
+
+bool user_pages_share(struct task_struct* child);
+
+void user_space_free(uint32_t* pgdir);
+
+static uint32_t* frame_pte(struct frame* f, struct task_struct** owner);
+
+static bool swap_evict(void);
+
+bool swap_out(void);
+
+static bool swap_in(uint32_t va);
+
+void* sys_mmap(struct mmap_args* args);
+
+int32_t sys_munmap(void* addr, uint32_t len);
+
+void user_pages_unmap(uint32_t start, uint32_t pg_cnt);
+
+static void page_fault_handler(uint32_t vec_no);
+
 uint32_t va2pa(uint32_t va);
 
-static void mem_pool_init(uint32_t all_mem);
+uint32_t mem_free_blocks(enum pool_flags pf, uint32_t order);
+
+uint32_t mem_free_pages(enum pool_flags pf);
+
+bool mem_zero_refill(void);
+
+void mem_zero_stats(void);
+
+static void zero_frames_drain(struct pa_pool* m_pool, uint32_t start_pfn,
+                              uint32_t end_pfn);
+
+bool mem_pool_grow(enum pool_flags pf);
+
+bool mem_rebalance(void);
+
+void mem_pool_stats(void);
+
+static void mem_range_add(uint32_t start_pfn, uint32_t end_pfn);
+
+static void mem_range_remove(uint32_t start_pfn, uint32_t end_pfn);
+
+static void mem_ranges_init(uint32_t reserved_pfn);
+
+static void direct_map_init(uint32_t end);
+
+static void mem_pool_init(void);
 
 void mem_init();
 
@@ -66,6 +202,17 @@ void mem_init();
 // Kernel mem block descriptors
 struct mem_block_desc k_block_descs[MEM_BLOCK_DESC_CNT];
 
+// Magazines of each thread and heap descs of each process
+static struct kmem_cache mag_cache;
+static struct kmem_cache u_descs_cache;
+
+// Reserved blocks of kmalloc_atomic, a stack per class linked through
+// free_elem.next. Only touched with interrupt off.
+static struct mem_block* atomic_blocks[MEM_ATOMIC_DESC_CNT];
+static uint32_t atomic_cnt[MEM_ATOMIC_DESC_CNT];
+
+struct mem_atomic_stats mem_atomic_stats;
+
 // -- Public Method
 
 void mem_block_descs_init(struct mem_block_desc descs[MEM_BLOCK_DESC_CNT]);
@@ -74,18 +221,56 @@ void mem_block_descs_init(struct mem_block_desc descs[MEM_BLOCK_DESC_CNT]);
 // struct arena
 // --
 
+// An arena holds blocks of one size class in arena_pg_cnt continuous pages,
+// the header sits at the beginning of the first page. Large blocks have no
+// arena, they are page aligned and the page count is kept in struct frame.
 struct arena {
   struct mem_block_desc* descptr;
-  // For large arena, cnt = total page cnt
-  // For general arena, cnt = free block cnt in this arena
-  uint32_t cnt;
-  bool large;
+  uint32_t cnt;                // Free block cnt in this arena
+  struct list free_list;       // Free blocks of this arena
+  struct list_elem arena_tag;  // Tag in descs' partial or full arena list
 };
 
-#define block2arena(block_va) ((uint32_t)block_va & 0xfffff000)
+// Arena of a size class spans at most MEM_ARENA_MAX_PG pages
+#define MEM_ARENA_MAX_PG 4
+
+// Size classes, blocks larger than the last one go to large blocks
+static const uint32_t mem_block_sizes[MEM_BLOCK_DESC_CNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 512, 1024, 1536, 2048, 3072};
+
+static struct frame* heap_frame(void* va);
+static uint32_t arena_pages(uint32_t size);
+static struct mem_block_desc* block_desc_find(struct mem_block_desc* descs,
+                                              uint32_t size);
+static struct mem_block* arena_block_get(struct mem_block_desc* mbd,
+                                         enum pool_flags PF);
+static void arena_block_put(struct mem_block* block, enum pool_flags PF);
+static struct mem_magazine* cur_magazine(struct mem_block_desc* mbd);
+void mem_thread_init(struct task_struct* pthread);
+bool mem_proc_init(struct task_struct* pthread);
+bool mem_thread_copy(struct task_struct* child, struct task_struct* parent);
+void mem_thread_free(struct task_struct* pthread);
+static void desc_alloc_note(struct mem_block_desc* mbd, uint32_t size,
+                            bool hit);
+static void desc_free_note(struct mem_block_desc* mbd, bool hit);
+static void large_pages_free(enum pool_flags PF, uint32_t va, uint32_t cnt);
+static bool large_grow(enum pool_flags PF, void* vaddr, struct frame* f,
+                       uint32_t pg_cnt);
 
 void* sys_malloc(uint32_t size);
 void sys_free(void* vaddr);
+void* sys_realloc(void* vaddr, uint32_t size);
+void sys_malloc_trim(void);
+void sys_malloc_stats(void);
+int32_t sys_meminfo(struct meminfo* info);
+static void meminfo_pool_fill(struct meminfo_pool* mp, struct pa_pool* pool);
+static void meminfo_class_fill(struct meminfo_class* mc,
+                               struct mem_block_desc* descs);
+
+void* kmalloc_atomic(uint32_t size);
+void kfree_atomic(void* kva);
+bool mem_atomic_refill(void);
+uint32_t mem_atomic_free_blocks(uint32_t size);
 
 // --
 // -- Implementation
@@ -100,51 +285,42 @@ static void* vaddr_get(enum pool_flags pf, uint32_t pg_cnt) {
 
   if (pf == PF_KERNEL) {
     /* Search bitmap for available pages */
-    bit_start_idx = bitmap_scan(&k_va_pool.btmp, pg_cnt);
+    bit_start_idx = hbitmap_scan(&k_va_pool.btmp, pg_cnt);
     if (bit_start_idx < 0) {
       return NULL;
     }
     /* Set vaddr bitmap */
     while (cnt < pg_cnt) {
-      bitmap_set(&k_va_pool.btmp, bit_start_idx + cnt);
+      hbitmap_set(&k_va_pool.btmp, bit_start_idx + cnt);
       cnt++;
     }
 
     vaddr_start = k_va_pool.start + bit_start_idx * PG_SIZE;
 
   } else {
-    struct task_struct* cur = running_thread();
-    bit_start_idx = bitmap_scan(&cur->u_va_pool.btmp, pg_cnt);
-
-    if (bit_start_idx < 0) {
+    struct vm_map* vm = &running_thread()->vm;
+    vaddr_start = vma_get_unmapped(vm, pg_cnt);
+    if (vaddr_start == 0 || !vma_map(vm, vaddr_start, pg_cnt, 0)) {
       return NULL;
     }
-
-    while (cnt < pg_cnt) {
-      bitmap_set(&cur->u_va_pool.btmp, bit_start_idx + cnt);
-      cnt++;
-    }
-
-    vaddr_start = cur->u_va_pool.start + bit_start_idx * PG_SIZE;
   }
 
   return (void*)vaddr_start;
 }
 
 static void vaddr_free(enum pool_flags pf, void* _vaddr) {
-  struct va_pool* va_pool;
-  if (pf == PF_KERNEL) {
-    va_pool = &k_va_pool;
-  } else {
-    struct task_struct* cur = running_thread();
-    va_pool = &cur->u_va_pool;
+  uint32_t va = (uint32_t)_vaddr;
+  ASSERT((va & 0x00000fff) == 0);
+
+  if (pf == PF_USER) {
+    vma_unmap(&running_thread()->vm, va, 1);
+    return;
   }
 
-  uint32_t va = (uint32_t)_vaddr;
-  ASSERT(((va & 0x00000fff) == 0) && (va >= va_pool->start));
-  uint32_t bit_idx = (va - va_pool->start) / PG_SIZE;
-  ASSERT(bitmap_scan_test(&va_pool->btmp, bit_idx));
-  bitmap_unset(&va_pool->btmp, bit_idx);
+  ASSERT(va >= k_va_pool.start);
+  uint32_t bit_idx = (va - k_va_pool.start) / PG_SIZE;
+  ASSERT(hbitmap_scan_test(&k_va_pool.btmp, bit_idx));
+  hbitmap_unset(&k_va_pool.btmp, bit_idx);
 }
 
 // pte_ptr
@@ -155,6 +331,7 @@ static void vaddr_free(enum pool_flags pf, void* _vaddr) {
 // address, use to search PTE, then we map out virtual address to physical
 // address of PTE.
 // (PTE_IDX(vaddr) * 4) : the last 12 bit offset in PTE
+// Direct mapped kernel address may have no PTE, see va2pa.
 uint32_t* pte_ptr(uint32_t vaddr) {
   return (uint32_t*)(0xffc00000 + (PDE_IDX(vaddr) << 12) +
                      (PTE_IDX(vaddr) * 4));
@@ -172,24 +349,66 @@ uint32_t* pde_ptr(uint32_t vaddr) {
 
 // Allocate one page in m_pool, return the address
 static void* palloc(struct pa_pool* m_pool) {
-  int bit_idx;
-  bit_idx = bitmap_scan(&m_pool->btmp, 1);
-  if (bit_idx < 0) {
-    return NULL;
+  int32_t pfn = buddy_alloc(&m_pool->buddy, 0);
+  void* pa = (void*)(pfn * PG_SIZE);
+  if (pfn < 0) {
+    // Pre-zeroed pages are still free memory
+    pa = zero_frame_get(m_pool);
   }
-  bitmap_set(&m_pool->btmp, bit_idx);
-
-  return (void*)(m_pool->start + bit_idx * PG_SIZE);
+  if (pa != NULL) {
+    pool_alloc_note(m_pool, 1);
+  }
+  return pa;
 }
 
 // Free one page in m_pool
 static void pfree(struct pa_pool* m_pool, void* _paddr) {
   uint32_t pa = (uint32_t)_paddr;
   ASSERT(((pa & 0x00000fff) == 0) && (pa >= m_pool->start));
-  int bit_idx;
-  bit_idx = (pa - m_pool->start) / PG_SIZE;
-  ASSERT(bitmap_scan_test(&m_pool->btmp, bit_idx));
-  bitmap_unset(&m_pool->btmp, bit_idx);
+  buddy_free(&m_pool->buddy, pa / PG_SIZE, 0);
+  m_pool->stats.free_cnt++;
+}
+
+// zero_frame_get
+// Take a pre-zeroed page of m_pool, NULL if there is none. Caller holds the
+// pool lock.
+static void* zero_frame_get(struct pa_pool* m_pool) {
+  if (list_empty(&m_pool->zero_frames)) {
+    return NULL;
+  }
+  struct frame* f =
+      elem2entry(struct frame, free_elem, list_pop(&m_pool->zero_frames));
+  ASSERT(f->flags & FRAME_ZERO);
+  f->flags &= ~FRAME_ZERO;
+  m_pool->zero_cnt--;
+  return (void*)(frame2pfn(f) * PG_SIZE);
+}
+
+// palloc_zeroed
+// Allocate one page in m_pool, prefer a pre-zeroed one and set *zeroed if got
+// it. Caller holds the pool lock and has to clean the page otherwise.
+static void* palloc_zeroed(struct pa_pool* m_pool, bool* zeroed) {
+  void* pa = zero_frame_get(m_pool);
+  *zeroed = (pa != NULL);
+  if (*zeroed) {
+    m_pool->zero_hit++;
+    pool_alloc_note(m_pool, 1);
+    return pa;
+  }
+  m_pool->zero_miss++;
+  return palloc(m_pool);
+}
+
+// pool_alloc_note
+// Count pg_cnt pages allocated in m_pool, keep the most pages in use at once.
+// Caller holds the pool lock.
+static void pool_alloc_note(struct pa_pool* m_pool, uint32_t pg_cnt) {
+  uint32_t used =
+      m_pool->size / PG_SIZE - m_pool->buddy.free_pages - m_pool->zero_cnt;
+  m_pool->stats.alloc_cnt += pg_cnt;
+  if (used > m_pool->stats.peak_pages) {
+    m_pool->stats.peak_pages = used;
+  }
 }
 
 // Add map of given _vaddr and _page_phyaddr to page table
@@ -200,21 +419,52 @@ static void page_table_add(void* _vaddr, void* _page_phyaddr) {
   uint32_t* pte = pte_ptr(vaddr);
 
   // Create PDE if not exist
-  if (!(*pde & PG_P_1)) {
-    uint32_t* pde_phyaddr = palloc(&k_pa_pool);
-    *pde = ((uint32_t)pde_phyaddr | PG_P_1 | PG_RW_W | PG_US_U);
-    // Clean the new page table
-    memset((void*)((int)pte & 0xfffff000), 0, PG_SIZE);
+  if (!(*pde & PG_P_1) && !pde_fill(vaddr)) {
+    PANIC("page_table_add: no page for page table");
   }
 
-  // Create PTE if not exist
+  // Create PTE if not exist, kernel space is same in all page directories
   if (!(*pte & PG_P_1)) {
     *pte = ((uint32_t)page_phyaddr | PG_P_1 | PG_RW_W | PG_US_U);
+    if (vaddr >= K_BASE_ADDR) {
+      *pte |= PG_G;
+    } else if (user_frame(page_phyaddr)) {
+      frame_map_set(page_phyaddr, vaddr);
+    }
   } else {
     PANIC("pte exist!");
   }
 }
 
+// pde_fill
+// Give vaddr a new zeroed page table from kernel pool, caller holds its lock.
+// Return false if kernel pool is out of pages.
+static bool pde_fill(uint32_t vaddr) {
+  uint32_t* pde_phyaddr = palloc(&k_pa_pool);
+  if (pde_phyaddr == NULL) {
+    return false;
+  }
+  *pde_ptr(vaddr) = ((uint32_t)pde_phyaddr | PG_P_1 | PG_RW_W | PG_US_U);
+  // Clean the new page table
+  memset((void*)((uint32_t)pte_ptr(vaddr) & 0xfffff000), 0, PG_SIZE);
+  return true;
+}
+
+// page_table_prepare
+// Make sure the page table covering user va exists before the caller takes
+// u_pa_pool lock, so mapping va under it takes nothing from kernel pool.
+// Return false if kernel pool is out of pages.
+static bool page_table_prepare(uint32_t va) {
+  if (*pde_ptr(va) & PG_P_1) {
+    return true;
+  }
+  spinlock_acquire(&k_pa_pool.lock);
+  // Another thread of the process may have filled it while we waited
+  bool ok = (*pde_ptr(va) & PG_P_1) || pde_fill(va);
+  spinlock_release(&k_pa_pool.lock);
+  return ok;
+}
+
 static void page_table_remove(void* _vaddr) {
   uint32_t va = (uint32_t)_vaddr;
   uint32_t* pde = pde_ptr(va);
@@ -224,24 +474,65 @@ static void page_table_remove(void* _vaddr) {
   ASSERT(*pte & PG_P_1);
 
   *pte &= ~(PG_P_1);
+  tlb_batch_add(va);
+}
+
+static bool kva_direct(uint32_t va) {
+  return va >= K_BASE_ADDR && va - K_BASE_ADDR < k_direct_end;
 }
 
 // Allocate pg_cnt pages
 void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
+  struct pa_pool* m_pool = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+
+  // Try a physically continuous block first, it costs a single buddy
+  // allocation no matter how many pages we need. Kernel block is reached
+  // through direct map without touching page tables.
+  int32_t pfn = buddy_alloc_pages(&m_pool->buddy, pg_cnt);
+  if (pfn >= 0) {
+    pool_alloc_note(m_pool, pg_cnt);
+  }
+  if (pfn >= 0 && pf == PF_KERNEL) {
+    return pa2kva(pfn * PG_SIZE);
+  }
+
   // Allocate virtual space pages
   void* vaddr_start = vaddr_get(pf, pg_cnt);
+  uint32_t vaddr = (uint32_t)vaddr_start;
+  uint32_t i;
   if (vaddr_start == NULL) {
+    for (i = 0; pfn >= 0 && i < pg_cnt; i++) {
+      pfree(m_pool, (void*)((pfn + i) * PG_SIZE));
+    }
     return NULL;
   }
 
-  // Allocate physical space pages
-  uint32_t vaddr = (uint32_t)vaddr_start;
-  struct pa_pool* m_pool = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  if (pfn >= 0) {
+    for (i = 0; i < pg_cnt; i++) {
+      page_table_add((void*)vaddr, (void*)((pfn + i) * PG_SIZE));
+      vaddr += PG_SIZE;
+    }
+    return vaddr_start;
+  }
 
-  while (pg_cnt-- > 0) {
+  // Memory is fragmented, fall back to one page each time
+  uint32_t cnt;
+  for (cnt = 0; cnt < pg_cnt; cnt++) {
     void* phyaddr = palloc(m_pool);
     if (phyaddr == NULL) {
-      // TODO: collect fail allocate memory
+      // Rollback mapped pages and the rest virtual pages
+      vaddr = (uint32_t)vaddr_start;
+      tlb_batch_begin();
+      while (cnt-- > 0) {
+        free_page(pf, (void*)vaddr);
+        vaddr += PG_SIZE;
+        pg_cnt--;
+      }
+      tlb_batch_end();
+      while (pg_cnt-- > 0) {
+        vaddr_free(pf, (void*)vaddr);
+        vaddr += PG_SIZE;
+      }
       return NULL;
     }
     // Map virtual pages and physical pages
@@ -253,6 +544,21 @@ void* malloc_page(enum pool_flags pf, uint32_t pg_cnt) {
 }
 
 void free_page(enum pool_flags pf, void* _vaddr) {
+  // Direct mapped kernel page keeps its mapping
+  if (pf == PF_KERNEL && kva_direct((uint32_t)_vaddr)) {
+    pfree(&k_pa_pool, (void*)va2pa((uint32_t)_vaddr));
+    return;
+  }
+
+  page_free(pf, _vaddr);
+
+  // Free virtual address
+  vaddr_free(pf, _vaddr);
+}
+
+// page_free
+// Unmap page at _vaddr and free its frame, keep its virtual address.
+static void page_free(enum pool_flags pf, void* _vaddr) {
   // Remove page table maps
   page_table_remove(_vaddr);
 
@@ -260,38 +566,81 @@ void free_page(enum pool_flags pf, void* _vaddr) {
   struct pa_pool* m_pool = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
   void* paddr = (void*)va2pa((uint32_t)_vaddr);
 
-  if (pf == PF_KERNEL) {
-    ASSERT((uint32_t)paddr >= k_pa_pool.start &&
-           (uint32_t)paddr < u_pa_pool.start);
+  ASSERT((uint32_t)paddr / PG_SIZE >= m_pool->buddy.start_pfn &&
+         (uint32_t)paddr / PG_SIZE < m_pool->buddy.end_pfn);
+
+  // Frame still mapped by another process after fork, drop our reference
+  struct frame* f = pfn2frame((uint32_t)paddr / PG_SIZE);
+  if (f->ref_cnt > 0) {
+    f->ref_cnt--;
   } else {
-    ASSERT((uint32_t)paddr >= u_pa_pool.start);
+    pfree(m_pool, paddr);
   }
-
-  pfree(m_pool, paddr);
-
-  // Free virtual address
-  vaddr_free(pf, _vaddr);
 }
 
 // get pg_cnt pages from kernel_pool
 void* get_kernel_pages(uint32_t pg_cnt) {
+  void* va;
+  bool zeroed = false;
   spinlock_acquire(&k_pa_pool.lock);
-  void* va = malloc_page(PF_KERNEL, pg_cnt);
-  if (va != NULL) {
-    memset(va, 0, pg_cnt * PG_SIZE);
+  if (pg_cnt == 1) {
+    void* pa = palloc_zeroed(&k_pa_pool, &zeroed);
+    va = (pa == NULL) ? NULL : pa2kva(pa);
+  } else {
+    va = malloc_page(PF_KERNEL, pg_cnt);
   }
   spinlock_release(&k_pa_pool.lock);
+
+  // Out of kernel frames, borrow a chunk of user pool and try again
+  if (va == NULL && mem_pool_grow(PF_KERNEL)) {
+    return get_kernel_pages(pg_cnt);
+  }
+
+  // Pages are ours now, clean them out of the lock
+  if (va != NULL && !zeroed) {
+    memset(va, 0, pg_cnt * PG_SIZE);
+  }
   return va;
 }
 
+// free pg_cnt pages got from get_kernel_pages
+void free_kernel_pages(void* va, uint32_t pg_cnt) {
+  spinlock_acquire(&k_pa_pool.lock);
+  tlb_batch_begin();
+  uint32_t i;
+  for (i = 0; i < pg_cnt; i++) {
+    free_page(PF_KERNEL, (void*)((uint32_t)va + i * PG_SIZE));
+  }
+  tlb_batch_end();
+  spinlock_release(&k_pa_pool.lock);
+}
+
 // get pg_cnt pages from user_pool
 void* get_user_pages(uint32_t pg_cnt) {
+  void* va;
+  bool zeroed = false;
   spinlock_acquire(&u_pa_pool.lock);
-  void* va = malloc_page(PF_USER, pg_cnt);
-  if (va != NULL) {
-    memset(va, 0, pg_cnt * PG_SIZE);
+  if (pg_cnt == 1) {
+    va = vaddr_get(PF_USER, 1);
+    void* pa = (va == NULL) ? NULL : palloc_zeroed(&u_pa_pool, &zeroed);
+    if (pa != NULL) {
+      page_table_add(va, pa);
+    } else if (va != NULL) {
+      vaddr_free(PF_USER, va);
+      va = NULL;
+    }
+  } else {
+    va = malloc_page(PF_USER, pg_cnt);
   }
   spinlock_release(&u_pa_pool.lock);
+
+  if (va == NULL && mem_pool_grow(PF_USER)) {
+    return get_user_pages(pg_cnt);
+  }
+
+  if (va != NULL && !zeroed) {
+    memset(va, 0, pg_cnt * PG_SIZE);
+  }
   return va;
 }
 
@@ -306,18 +655,31 @@ void* get_a_page(enum pool_flags pf, uint32_t va) {
   }
 
   struct pa_pool* pa_pool = pf & PF_KERNEL ? &k_pa_pool : &u_pa_pool;
-  struct va_pool* va_pool = pf & PF_KERNEL ? &k_va_pool : &cur->u_va_pool;
 
   spinlock_acquire(&pa_pool->lock);
 
-  // set va_pool bitmap
-  int32_t bit_idx = (va - va_pool->start) / PG_SIZE;
-  ASSERT(bit_idx > 0);
-  bitmap_set(&va_pool->btmp, bit_idx);
+  // Take the virtual page, user page may be in an area reserved already
+  bool va_taken = false;
+  if (pf & PF_KERNEL) {
+    int32_t bit_idx = (va - k_va_pool.start) / PG_SIZE;
+    ASSERT(bit_idx > 0);
+    hbitmap_set(&k_va_pool.btmp, bit_idx);
+    va_taken = true;
+  } else if (vma_find(&cur->vm, va) == NULL) {
+    if (!vma_map(&cur->vm, va, 1, 0)) {
+      spinlock_release(&pa_pool->lock);
+      return NULL;
+    }
+    va_taken = true;
+  }
 
   // alloc physical page
   void* pa = palloc(pa_pool);
   if (pa == NULL) {
+    if (va_taken) {
+      vaddr_free(pf, (void*)va);
+    }
+    spinlock_release(&pa_pool->lock);
     return NULL;
   }
 
@@ -328,172 +690,1509 @@ void* get_a_page(enum pool_flags pf, uint32_t va) {
   return (void*)va;
 }
 
-// get physical address for given virtual address
-uint32_t va2pa(uint32_t va) {
-  uint32_t* pte = pte_ptr(va);
-  return ((*pte & 0xfffff000) + (va & 0x00000fff));
+// user_va_reserve
+// Mark pg_cnt user pages from va as taken without mapping them, they are
+// filled on first touch by page_fault_handler. Return false if any of them is
+// already taken.
+bool user_va_reserve(uint32_t va, uint32_t pg_cnt) {
+  return vma_map(&running_thread()->vm, va, pg_cnt, VMA_DEMAND | VMA_WRITE);
 }
 
-static void mem_pool_init(uint32_t all_mem) {
-  put_str("    mem_pool init start\n");
-
-  // 1. Calculate used memory
-  // We created 1 PDE and 255 PTE for kernel in loader, and the least 1MB is
-  // used by kernel
-  uint32_t page_table_size = PG_SIZE * 256;
-  uint32_t used_mem = page_table_size + 0x100000;
+// sys_brk
+// Move the end of user heap to brk. Growing only reserves the pages, they are
+// mapped zeroed on first touch, shrinking releases pages already mapped.
+// Return the new end, or the current end if brk is NULL or it can not be
+// moved there.
+void* sys_brk(void* brk) {
+  struct task_struct* cur = running_thread();
+  uint32_t new_brk = (uint32_t)brk;
+  if (cur->pgdir == NULL || new_brk < cur->heap_start ||
+      new_brk > USER_HEAP_END) {
+    return (void*)cur->brk;
+  }
 
-  // 2. Allocate pages for kernel and user
-  // Simply allocate half of all pages to kernel, the rest to user
-  uint32_t free_mem = all_mem - used_mem;
-  uint16_t all_free_pages = free_mem / PG_SIZE;
-  uint16_t kernel_free_pages = all_free_pages / 2;
-  uint16_t user_free_pages = all_free_pages - kernel_free_pages;
+  uint32_t old_end = DIV_ROUND_UP(cur->brk, PG_SIZE) * PG_SIZE;
+  uint32_t new_end = DIV_ROUND_UP(new_brk, PG_SIZE) * PG_SIZE;
 
-  k_pa_pool.size = kernel_free_pages * PG_SIZE;
-  u_pa_pool.size = user_free_pages * PG_SIZE;
+  if (new_end > old_end &&
+      !user_va_reserve(old_end, (new_end - old_end) / PG_SIZE)) {
+    return (void*)cur->brk;
+  }
 
-  uint32_t kp_start = used_mem;
-  uint32_t up_start = kernel_free_pages * PG_SIZE + kp_start;
-  k_pa_pool.start = kp_start;
-  u_pa_pool.start = up_start;
+  uint32_t va;
+  spinlock_acquire(&u_pa_pool.lock);
+  tlb_batch_begin();
+  for (va = new_end; va < old_end; va += PG_SIZE) {
+    if (page_mapped(va)) {
+      page_free(PF_USER, (void*)va);
+    } else {
+      page_swap_drop(va);
+    }
+  }
+  tlb_batch_end();
+  spinlock_release(&u_pa_pool.lock);
+  if (new_end < old_end) {
+    vma_unmap(&cur->vm, new_end, (old_end - new_end) / PG_SIZE);
+  }
 
-  // 3. Init kernel and user bitmap
-  // TODO: We don't handle the remainder of calculated bitmap length, it may
-  // cause loss of memory, but we don't need to check boundary.
-  uint32_t kbm_length = kernel_free_pages / 8;  // byte length of kernel bitmap
-  uint32_t ubm_length = user_free_pages / 8;    // byte length of user bitmap
+  cur->brk = new_brk;
+  return brk;
+}
 
-  k_pa_pool.btmp.btmp_bytes_len = kbm_length;
-  u_pa_pool.btmp.btmp_bytes_len = ubm_length;
+static bool page_mapped(uint32_t va) {
+  return (*pde_ptr(va) & PG_P_1) && (*pte_ptr(va) & PG_P_1);
+}
 
-  k_pa_pool.btmp.bits = (void*)MEM_BITMAP_BASE;
-  u_pa_pool.btmp.bits = (void*)(MEM_BITMAP_BASE + kbm_length);
+static bool page_swapped(uint32_t va) {
+  return (*pde_ptr(va) & PG_P_1) && !(*pte_ptr(va) & PG_P_1) &&
+         (*pte_ptr(va) & PG_SWAP);
+}
 
-  bitmap_init(&k_pa_pool.btmp);
-  bitmap_init(&u_pa_pool.btmp);
+// page_swap_drop
+// Forget page at va of running process if it is swapped out. Caller holds
+// u_pa_pool lock.
+static void page_swap_drop(uint32_t va) {
+  if (page_swapped(va)) {
+    uint32_t* pte = pte_ptr(va);
+    swap_slot_put(*pte >> 12);
+    *pte = 0;
+  }
+}
 
-  // init lock
-  spinlock_init(&k_pa_pool.lock);
-  spinlock_init(&u_pa_pool.lock);
+// user_frame
+// Frames outside user pool, like cached file pages, are mapped to user space
+// without being owned or refcounted by it.
+static bool user_frame(uint32_t pa) {
+  return pa / PG_SIZE >= u_pa_pool.buddy.start_pfn &&
+         pa / PG_SIZE < u_pa_pool.buddy.end_pfn;
+}
 
-  put_str("    kernel pool bitmap start : ");
-  put_int((int)k_pa_pool.btmp.bits);
-  put_char('\n');
-  put_str("    kernel pool physical address start : ");
-  put_int(k_pa_pool.start);
-  put_char('\n');
-  put_str("    kernel pool size : ");
-  put_int(k_pa_pool.size / 1024 / 1024);
-  put_str(" MB\n");
+// frame_map_set
+// Record running process mapping user frame pa at va, as swap has no other
+// way back from a frame to its PTE. Frames shared after fork are not swapped,
+// the record is refreshed when one of the sharers takes the frame back.
+static void frame_map_set(uint32_t pa, uint32_t va) {
+  struct frame* f = pfn2frame(pa / PG_SIZE);
+  f->map_pid = running_thread()->pid;
+  f->map_va = va;
+}
 
-  put_str("    user pool bitmap start : ");
-  put_int((int)u_pa_pool.btmp.bits);
-  put_char('\n');
-  put_str("    user pool physical address start : ");
-  put_int(u_pa_pool.start);
-  put_char('\n');
-  put_str("    user pool size : ");
-  put_int(u_pa_pool.size / 1024 / 1024);
-  put_str(" MB\n");
+// frame_kva
+// Get a kernel address of user frame pa, the direct map if it is there, or
+// else map it at window which the caller owns.
+static void* frame_kva(uint32_t pa, uint32_t window) {
+  if (pa < k_direct_end) {
+    return pa2kva(pa);
+  }
+  // page_table_add may take a page table from kernel pool
+  spinlock_acquire(&k_pa_pool.lock);
+  page_table_add((void*)window, (void*)pa);
+  spinlock_release(&k_pa_pool.lock);
+  return (void*)window;
+}
 
-  // 4. Init kernel virtual address memory pool
-  // Kernel virtual addr pool should be same as physiacl memory pool.
-  k_va_pool.btmp.btmp_bytes_len = kbm_length;
-  k_va_pool.btmp.bits = (void*)(MEM_BITMAP_BASE + kbm_length + ubm_length);
+static void frame_kva_put(void* kva) {
+  if (!kva_direct((uint32_t)kva)) {
+    page_table_remove(kva);
+  }
+}
 
-  k_va_pool.start = K_HEAP_START;
-  bitmap_init(&k_va_pool.btmp);
+// user_page_fill
+// Map a zeroed user page at va whose address is already reserved.
+static void* user_page_fill(uint32_t va, bool writable) {
+  if (!page_table_prepare(va)) {
+    return NULL;
+  }
+  bool zeroed;
+  spinlock_acquire(&u_pa_pool.lock);
+  void* pa = palloc_zeroed(&u_pa_pool, &zeroed);
+  if (pa != NULL) {
+    page_table_add((void*)va, pa);
+  }
+  spinlock_release(&u_pa_pool.lock);
 
-  put_str("    mem_pool_init done\n");
+  if (pa == NULL) {
+    return NULL;
+  }
+  if (!zeroed) {
+    memset((void*)va, 0, PG_SIZE);
+  }
+  if (!writable) {
+    *pte_ptr(va) &= ~PG_RW_W;
+    tlb_flush_page(va);
+  }
+  return (void*)va;
 }
 
-void mem_init() {
-  put_str("mem_init start\n");
-  uint32_t mem_bytes_total = *(uint32_t*)MEMORY_TOTAL_BYTES_ADDR;
+// file_page_fill
+// Map cached file page backing va of file area vma. It is always read-only,
+// a private writable area gets COW so the first write makes its own copy.
+static void* file_page_fill(struct vm_area* vma, uint32_t va) {
+  uint32_t pg_idx = vma->pgoff + (va - vma->start) / PG_SIZE;
+  void* kva = inode_page_get(vma->file, pg_idx);
+  if (kva == NULL || !page_table_prepare(va)) {
+    return NULL;
+  }
 
-  put_str("total memory : ");
-  put_int(mem_bytes_total / 1024 / 1024);
-  put_str(" MB\n");
+  spinlock_acquire(&u_pa_pool.lock);
+  page_table_add((void*)va, (void*)va2pa((uint32_t)kva));
+  uint32_t* pte = pte_ptr(va);
+  *pte &= ~PG_RW_W;
+  if (vma->flags & VMA_WRITE) {
+    *pte |= PG_COW;
+  }
+  spinlock_release(&u_pa_pool.lock);
+  return (void*)va;
+}
 
-  mem_pool_init(mem_bytes_total);
-  mem_block_descs_init(k_block_descs);
-  put_str("mem_init done\n");
+// shm_page_fill
+// Map page of shared memory segment at va, it is writable by all processes
+// attaching the segment.
+static void* shm_page_fill(struct vm_area* vma, uint32_t va) {
+  uint32_t pa = shm_page(vma->shm, vma->pgoff + (va - vma->start) / PG_SIZE);
+  if (!page_table_prepare(va)) {
+    return NULL;
+  }
+  spinlock_acquire(&u_pa_pool.lock);
+  page_table_add((void*)va, (void*)pa);
+  spinlock_release(&u_pa_pool.lock);
+  return (void*)va;
 }
 
-// FIXME: va_pool and mem_block_descs are not thread-safe
-void* sys_malloc(uint32_t size) {
-  struct task_struct* cur = running_thread();
+// Kernel page to map a user frame being copied, it has no physical page
+static uint32_t copy_window;
 
-  struct mem_block_desc* mb_descs;
-  mb_descs = (cur->pgdir == NULL) ? k_block_descs : cur->u_block_descs;
+// cow_break
+// Give the running process its own writable copy of COW page at va. The last
+// sharer just takes the frame back as writable, a cached file page is always
+// copied.
+static bool cow_break(uint32_t va) {
+  spinlock_acquire(&u_pa_pool.lock);
 
-  enum pool_flags PF = (cur->pgdir == NULL) ? PF_KERNEL : PF_USER;
+  uint32_t* pte = pte_ptr(va);
+  uint32_t old_pa = *pte & 0xfffff000;
+  struct frame* old_f = pfn2frame(old_pa / PG_SIZE);
+  bool owned = user_frame(old_pa);
+
+  if (owned && old_f->ref_cnt == 0) {
+    *pte = (*pte | PG_RW_W) & ~PG_COW;
+    frame_map_set(old_pa, va);
+    tlb_flush_page(va);
+    spinlock_release(&u_pa_pool.lock);
+    return true;
+  }
 
-  struct pa_pool* pa_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
-  spinlock_acquire(&pa_pool->lock);
+  void* pa = palloc(&u_pa_pool);
+  if (pa == NULL) {
+    spinlock_release(&u_pa_pool.lock);
+    return false;
+  }
 
-  // Size > 1024, allocate large arena
-  if (size > 1024) {
-    uint32_t pg_cnt = DIV_ROUND_UP((size + sizeof(struct arena)), PG_SIZE);
-    struct arena* arena = (struct arena*)malloc_page(PF, pg_cnt);
+  page_table_add((void*)copy_window, pa);
+  memcpy((void*)copy_window, (void*)va, PG_SIZE);
+  page_table_remove((void*)copy_window);
 
-    if (arena == NULL) {
-      spinlock_release(&pa_pool->lock);
-      return NULL;
-    }
+  if (owned) {
+    old_f->ref_cnt--;
+  }
 
-    arena->descptr = NULL;
-    arena->cnt = pg_cnt;
-    arena->large = true;
+  *pte = (uint32_t)pa | PG_US_U | PG_RW_W | PG_P_1;
+  frame_map_set((uint32_t)pa, va);
+  tlb_flush_page(va);
 
-    spinlock_release(&pa_pool->lock);
-    return (void*)((uint32_t)arena + sizeof(struct arena));
+  spinlock_release(&u_pa_pool.lock);
+  return true;
+}
+
+// heap_page_copy
+// Copy sys_malloc heap page at va of running process to a new frame for
+// child. Pointers into parent's heap descs, i.e. arena's descptr and the list
+// tags linking it to u_block_descs, are moved to the same place in child's.
+// Caller should hold u_pa_pool lock.
+static uint32_t heap_page_copy(uint32_t va, struct task_struct* child) {
+  struct frame* old_f = heap_frame((void*)va);
+  void* pa = palloc(&u_pa_pool);
+  if (pa == NULL) {
+    return 0;
   }
 
-  // Allocate a free block, return the block address
+  page_table_add((void*)copy_window, pa);
+  memcpy((void*)copy_window, (void*)va, PG_SIZE);
 
-  uint32_t i;
-  struct mem_block_desc* mbd;
-  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
-    if (size <= mb_descs[i].block_size) {
-      mbd = &mb_descs[i];
-      break;
+  if ((old_f->flags & FRAME_ARENA) && old_f->arena == (void*)va) {
+    uint32_t descs = (uint32_t)running_thread()->u_block_descs;
+    uint32_t delta = (uint32_t)child->u_block_descs - descs;
+    struct arena* a = (struct arena*)copy_window;
+    a->descptr = (void*)((uint32_t)a->descptr + delta);
+    uint32_t* tag_ptrs[2] = {(uint32_t*)&a->arena_tag.prev,
+                             (uint32_t*)&a->arena_tag.next};
+    uint32_t i;
+    for (i = 0; i < 2; i++) {
+      if (*tag_ptrs[i] >= descs &&
+          *tag_ptrs[i] <
+              descs + MEM_BLOCK_DESC_CNT * sizeof(struct mem_block_desc)) {
+        *tag_ptrs[i] += delta;
+      }
     }
   }
 
-  // No free mem block, allocate new arena page
-  if (list_empty(&mbd->free_list)) {
-    // FIXME: malloc_page is not thread safe
-    struct arena* arena = (struct arena*)malloc_page(PF, 1);
+  // Window is mapped again for next page, do not wait for the batch
+  page_table_remove((void*)copy_window);
+  tlb_flush_page(copy_window);
 
-    if (arena == NULL) {
-      spinlock_release(&pa_pool->lock);
+  struct frame* f = pfn2frame((uint32_t)pa / PG_SIZE);
+  f->flags = old_f->flags & (FRAME_ARENA | FRAME_LARGE);
+  f->arena = old_f->arena;
+  f->large_pg_cnt = old_f->large_pg_cnt;
+  return (uint32_t)pa;
+}
+
+// user_pages_share
+// Map all user pages of running process into page directory of child for
+// fork. Writable pages become read-only COW in both and each shared frame gets
+// one more ref. sys_malloc heap pages are copied at once instead, their
+// metadata lives in frames and they are written with u_pa_pool lock held.
+// Return false if it runs out of memory.
+bool user_pages_share(struct task_struct* child) {
+  uint32_t pde_idx;
+  bool ok = true;
+  tlb_batch_begin();
+  for (pde_idx = PDE_IDX(USER_VADDR_START);
+       ok && pde_idx < PDE_IDX(K_BASE_ADDR); pde_idx++) {
+    uint32_t* pde = (uint32_t*)0xfffff000 + pde_idx;
+    if (!(*pde & PG_P_1)) {
+      continue;
+    }
+
+    uint32_t* child_pt = get_kernel_pages(1);
+    if (child_pt == NULL) {
+      ok = false;
+      break;
+    }
+    child->pgdir[pde_idx] =
+        va2pa((uint32_t)child_pt) | PG_US_U | PG_RW_W | PG_P_1;
+
+    uint32_t* pt = (uint32_t*)(0xffc00000 + (pde_idx << 12));
+    uint32_t pte_idx;
+    spinlock_acquire(&u_pa_pool.lock);
+    for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+      uint32_t pte = pt[pte_idx];
+      if (!(pte & PG_P_1)) {
+        // Swapped out page is shared by its slot, each swap in makes a copy
+        if (pte & PG_SWAP) {
+          swap_slot_dup(pte >> 12);
+          child_pt[pte_idx] = pte;
+        }
+        continue;
+      }
+
+      // Cached file page keeps its read-only or COW entry, shared memory page
+      // stays writable
+      if (!user_frame(pte & 0xfffff000)) {
+        child_pt[pte_idx] = pte;
+        continue;
+      }
+
+      struct frame* f = pfn2frame(pte / PG_SIZE);
+      if (f->flags & (FRAME_ARENA | FRAME_LARGE)) {
+        uint32_t va = (pde_idx << 22) | (pte_idx << 12);
+        uint32_t pa = heap_page_copy(va, child);
+        if (pa == 0) {
+          ok = false;
+          break;
+        }
+        child_pt[pte_idx] = pa | (pte & 0xfff);
+        continue;
+      }
+
+      if (pte & PG_RW_W) {
+        pt[pte_idx] = (pte & ~PG_RW_W) | PG_COW;
+        tlb_batch_add((pde_idx << 22) | (pte_idx << 12));
+      }
+      child_pt[pte_idx] = pt[pte_idx];
+      f->ref_cnt++;
+    }
+    spinlock_release(&u_pa_pool.lock);
+  }
+
+  // Our writable entries just became read-only
+  tlb_batch_end();
+  return ok;
+}
+
+// user_space_free
+// Free all user frames and page tables of pgdir, then pgdir itself. pgdir
+// must not be loaded, its tables are reached through direct map. Frames still
+// shared with other processes only drop a reference.
+void user_space_free(uint32_t* pgdir) {
+  uint32_t pde_idx, pte_idx;
+
+  spinlock_acquire(&u_pa_pool.lock);
+  for (pde_idx = PDE_IDX(USER_VADDR_START); pde_idx < PDE_IDX(K_BASE_ADDR);
+       pde_idx++) {
+    if (!(pgdir[pde_idx] & PG_P_1)) {
+      continue;
+    }
+    uint32_t* pt = pa2kva(pgdir[pde_idx] & 0xfffff000);
+    for (pte_idx = 0; pte_idx < 1024; pte_idx++) {
+      uint32_t pte = pt[pte_idx];
+      if (!(pte & PG_P_1) && (pte & PG_SWAP)) {
+        swap_slot_put(pte >> 12);
+        continue;
+      }
+      if (!(pte & PG_P_1) || !user_frame(pte & 0xfffff000)) {
+        continue;
+      }
+      struct frame* f = pfn2frame(pte / PG_SIZE);
+      if (f->ref_cnt > 0) {
+        f->ref_cnt--;
+        continue;
+      }
+      f->flags &= ~(FRAME_ARENA | FRAME_LARGE);
+      pfree(&u_pa_pool, (void*)(pte & 0xfffff000));
+    }
+  }
+  spinlock_release(&u_pa_pool.lock);
+
+  // Page tables come from kernel pool, either by page_table_add or
+  // user_pages_share
+  spinlock_acquire(&k_pa_pool.lock);
+  for (pde_idx = PDE_IDX(USER_VADDR_START); pde_idx < PDE_IDX(K_BASE_ADDR);
+       pde_idx++) {
+    if (pgdir[pde_idx] & PG_P_1) {
+      pfree(&k_pa_pool, (void*)(pgdir[pde_idx] & 0xfffff000));
+    }
+  }
+  spinlock_release(&k_pa_pool.lock);
+
+  free_kernel_pages(pgdir, 1);
+}
+
+// Kernel page to map a user frame being swapped, used with swap_lock held
+static uint32_t swap_window;
+
+// Swap I/O goes one page at a time, so a page being written out is never
+// read back before it is on disk
+static lock_t swap_lock;
+
+// CLOCK hand going round user pool
+static uint32_t clock_hand;
+
+// frame_pte
+// Get the PTE mapping anonymous user frame f in its owner process, and the
+// owner, NULL if f is free, shared or not mapped like that. Caller holds
+// u_pa_pool lock, the owner can not free its page tables without it.
+static uint32_t* frame_pte(struct frame* f, struct task_struct** owner) {
+  if ((f->flags & (FRAME_FREE | FRAME_ZERO | FRAME_ARENA | FRAME_LARGE)) ||
+      f->ref_cnt > 0 || f->map_va >= K_BASE_ADDR) {
+    return NULL;
+  }
+  struct task_struct* t = thread_find(f->map_pid);
+  if (t == NULL || t->pgdir == NULL) {
+    return NULL;
+  }
+  uint32_t pde = t->pgdir[PDE_IDX(f->map_va)];
+  if (!(pde & PG_P_1)) {
+    return NULL;
+  }
+  uint32_t* pte = (uint32_t*)pa2kva(pde & 0xfffff000) + PTE_IDX(f->map_va);
+  if (!(*pte & PG_P_1) || *pte / PG_SIZE != frame2pfn(f)) {
+    return NULL;
+  }
+  *owner = t;
+  return pte;
+}
+
+// swap_evict
+// Evict one user page and free its frame. The victim is chosen by CLOCK: a
+// page accessed since the hand last passed gets its accessed bit cleared and
+// a second chance. It is kept compressed in memory if it compresses well,
+// else written to disk, both out of u_pa_pool lock. Without swap partition a
+// page which does not compress is passed over. Caller holds swap_lock.
+static bool swap_evict(void) {
+  struct buddy* b = &u_pa_pool.buddy;
+  struct task_struct* owner = NULL;
+  uint32_t scan;
+
+  spinlock_acquire(&u_pa_pool.lock);
+  // Two rounds at most, the first may only clear accessed bits
+  for (scan = 0; scan < 2 * (b->end_pfn - b->start_pfn); scan++) {
+    if (clock_hand < b->start_pfn || clock_hand >= b->end_pfn) {
+      clock_hand = b->start_pfn;
+    }
+    struct frame* f = pfn2frame(clock_hand++);
+    uint32_t* pte = frame_pte(f, &owner);
+    if (pte == NULL) {
+      continue;
+    }
+    if (*pte & PG_A) {
+      *pte &= ~PG_A;
+      // Other processes have no TLB entries, their PTEs are read on switch
+      if (owner == running_thread()) {
+        tlb_flush_page(f->map_va);
+      }
+      continue;
+    }
+
+    int32_t slot = swap_slot_alloc();
+    if (slot < 0) {
+      break;
+    }
+    uint32_t pa = frame2pfn(f) * PG_SIZE;
+    uint32_t old_pte = *pte;
+    struct task_struct* old_owner = owner;
+
+    // Compress out of the lock, the page stays mapped meanwhile
+    spinlock_release(&u_pa_pool.lock);
+    void* kva = frame_kva(pa, swap_window);
+    bool stored = swap_store(slot, kva);
+    frame_kva_put(kva);
+    spinlock_acquire(&u_pa_pool.lock);
+
+    // Owner may have touched, shared or unmapped the page since. Any access
+    // sets PG_A, so an equal PTE means the stored copy is still good.
+    if (frame_pte(f, &owner) != pte || owner != old_owner ||
+        *pte != old_pte || (!stored && !swap_has_disk())) {
+      swap_slot_put(slot);
+      continue;
+    }
+
+    *pte = ((uint32_t)slot << 12) | (*pte & 0xfff & ~(PG_P_1 | PG_A | PG_D)) |
+           PG_SWAP;
+    if (owner == running_thread()) {
+      tlb_flush_page(f->map_va);
+    }
+
+    if (!stored) {
+      // Frame is off every page table, nobody else touches it now
+      spinlock_release(&u_pa_pool.lock);
+      kva = frame_kva(pa, swap_window);
+      swap_write(slot, kva);
+      frame_kva_put(kva);
+      spinlock_acquire(&u_pa_pool.lock);
+    }
+
+    pfree(&u_pa_pool, (void*)pa);
+    spinlock_release(&u_pa_pool.lock);
+    swap_stats.swap_out++;
+    return true;
+  }
+  spinlock_release(&u_pa_pool.lock);
+  return false;
+}
+
+// swap_out
+// Evict a user page to make room, false if there is no swap, swap is full or
+// nothing can be evicted.
+bool swap_out(void) {
+  if (swap_stats.slot_cnt == 0) {
+    return false;
+  }
+  lock_acquire(&swap_lock);
+  bool ok = swap_evict();
+  lock_release(&swap_lock);
+  return ok;
+}
+
+// swap_in
+// Read swapped out page at va of running process back into a new frame.
+static bool swap_in(uint32_t va) {
+  lock_acquire(&swap_lock);
+  void* pa;
+  while (1) {
+    spinlock_acquire(&u_pa_pool.lock);
+    pa = palloc(&u_pa_pool);
+    spinlock_release(&u_pa_pool.lock);
+    // Taking a chunk of kernel pool is cheaper than eviction
+    if (pa != NULL || (!mem_pool_grow(PF_USER) && !swap_evict())) {
+      break;
+    }
+  }
+  if (pa == NULL) {
+    lock_release(&swap_lock);
+    return false;
+  }
+
+  // Only we change our own swapped PTEs, it stays while we wait for disk
+  uint32_t pte = *pte_ptr(va);
+  void* kva = frame_kva((uint32_t)pa, swap_window);
+  swap_read(pte >> 12, kva);
+  frame_kva_put(kva);
+
+  spinlock_acquire(&u_pa_pool.lock);
+  swap_slot_put(pte >> 12);
+  *pte_ptr(va) = (uint32_t)pa | (pte & 0xfff & ~PG_SWAP) | PG_P_1;
+  frame_map_set((uint32_t)pa, va);
+  spinlock_release(&u_pa_pool.lock);
+  swap_stats.swap_in++;
+
+  lock_release(&swap_lock);
+  return true;
+}
+
+// sys_mmap
+// Map args->len bytes at args->addr if it is page aligned and free, else at the
+// lowest free range. MAP_ANONYMOUS gets zeroed pages, else the file opened as
+// args->fd is mapped from args->offset. Pages are mapped on first touch.
+// Shared anonymous and shared writable file mappings are not supported since
+// pages are COW after fork and never written back. Return MAP_FAILED on
+// error.
+void* sys_mmap(struct mmap_args* args) {
+  struct task_struct* cur = running_thread();
+  struct mmap_args a = *args;
+  uint32_t pg_cnt = DIV_ROUND_UP(a.len, PG_SIZE);
+  bool shared = a.flags & MAP_SHARED;
+  if (cur->pgdir == NULL || pg_cnt == 0 || a.len > K_BASE_ADDR ||
+      shared == !!(a.flags & MAP_PRIVATE)) {
+    return MAP_FAILED;
+  }
+
+  uint32_t flags = VMA_MMAP;
+  if (a.prot & PROT_WRITE) {
+    flags |= VMA_WRITE;
+  }
+
+  struct inode_elem* file = NULL;
+  if (a.flags & MAP_ANONYMOUS) {
+    if (shared) {
+      return MAP_FAILED;
+    }
+    flags |= VMA_DEMAND;
+  } else {
+    file = fd_inode(a.fd);
+    if (file == NULL || a.offset % PG_SIZE != 0 ||
+        (shared && (a.prot & PROT_WRITE))) {
+      return MAP_FAILED;
+    }
+    flags |= VMA_FILE;
+  }
+
+  uint32_t va = (uint32_t)a.addr;
+  uint32_t pgoff = a.offset / PG_SIZE;
+  if (va % PG_SIZE != 0 ||
+      !vma_map_file(&cur->vm, va, pg_cnt, flags, file, pgoff)) {
+    va = vma_get_unmapped(&cur->vm, pg_cnt);
+    if (va == 0 || !vma_map_file(&cur->vm, va, pg_cnt, flags, file, pgoff)) {
+      return MAP_FAILED;
+    }
+  }
+  return (void*)va;
+}
+
+// sys_munmap
+// Remove pages in [addr, addr + len) from mmap areas. Return -1 if addr is not
+// page aligned or the range covers pages not created by mmap.
+int32_t sys_munmap(void* addr, uint32_t len) {
+  struct task_struct* cur = running_thread();
+  uint32_t start = (uint32_t)addr;
+  uint32_t pg_cnt = DIV_ROUND_UP(len, PG_SIZE);
+  uint32_t end = start + pg_cnt * PG_SIZE;
+  if (cur->pgdir == NULL || start % PG_SIZE != 0 || pg_cnt == 0 ||
+      start < USER_VADDR_START || end > K_BASE_ADDR || end < start) {
+    return -1;
+  }
+
+  uint32_t va;
+  for (va = start; va < end; va += PG_SIZE) {
+    struct vm_area* vma = vma_find(&cur->vm, va);
+    if (vma != NULL && !(vma->flags & VMA_MMAP)) {
+      return -1;
+    }
+  }
+
+  user_pages_unmap(start, pg_cnt);
+
+  // Drops file refs of removed areas, so do it after the pages are unmapped
+  return vma_unmap(&cur->vm, start, pg_cnt) ? 0 : -1;
+}
+
+// user_pages_unmap
+// Unmap pg_cnt pages from start of running process. User frames are freed,
+// others like cached file pages and shared memory pages only lose the
+// mapping.
+void user_pages_unmap(uint32_t start, uint32_t pg_cnt) {
+  uint32_t va;
+  uint32_t end = start + pg_cnt * PG_SIZE;
+  spinlock_acquire(&u_pa_pool.lock);
+  tlb_batch_begin();
+  for (va = start; va < end; va += PG_SIZE) {
+    if (!page_mapped(va)) {
+      page_swap_drop(va);
+      continue;
+    }
+    if (user_frame(va2pa(va))) {
+      page_free(PF_USER, (void*)va);
+    } else {
+      page_table_remove((void*)va);
+    }
+  }
+  tlb_batch_end();
+  spinlock_release(&u_pa_pool.lock);
+}
+
+// page_fault_handler
+// A write to a COW page gets a private copy, a not-present fault inside a
+// VMA_DEMAND area like user heap and stack gets a zeroed page, and one inside a
+// VMA_FILE or VMA_SHM area gets the cached file page or the segment page.
+// Anything else is fatal. Faults are counted in pf_stats and in the faulting
+// task.
+static void page_fault_handler(uint32_t vec_no) {
+  // vec_no is the first field of the frame pushed by kernel.asm
+  struct intr_stack* frame = (struct intr_stack*)&vec_no;
+  struct task_struct* cur = running_thread();
+  uint32_t va;
+  asm volatile("movl %%cr2, %0" : "=r"(va));
+
+  uint32_t page = va & 0xfffff000;
+  struct vm_area* vma = NULL;
+  pf_stats.total++;
+  cur->pf_cnt++;
+  if (cur->pgdir != NULL && va < K_BASE_ADDR) {
+    vma = vma_find(&cur->vm, va);
+  }
+  bool lazy =
+      vma != NULL && (vma->flags & (VMA_DEMAND | VMA_FILE | VMA_SHM));
+
+  if (!(frame->err_code & PF_ERR_PRESENT) && cur->pgdir != NULL &&
+      va < K_BASE_ADDR && page_swapped(va)) {
+    intr_enable();
+    if (swap_in(page)) {
+      pf_stats.swap_in++;
+      return;
+    }
+    put_str("page fault: out of user memory\n");
+  } else if ((frame->err_code & PF_ERR_PRESENT) &&
+             (frame->err_code & PF_ERR_WRITE) && cur->pgdir != NULL &&
+             va < K_BASE_ADDR && (*pte_ptr(va) & PG_COW)) {
+    intr_enable();
+    if (cow_break(page)) {
+      pf_stats.cow++;
+      return;
+    }
+    // Out of memory, retry after growing user pool or evicting a page
+    if (mem_pool_grow(PF_USER) || swap_out()) {
+      return;
+    }
+    put_str("page fault: out of user memory\n");
+  } else if (!(frame->err_code & PF_ERR_PRESENT) && cur->pgdir != NULL &&
+             lazy) {
+    // cr2 is saved, let others run while we wait for u_pa_pool lock, iretd
+    // restores the interrupt flag of the faulting context
+    intr_enable();
+    if (vma->flags & VMA_SHM) {
+      if (shm_page_fill(vma, page) != NULL) {
+        pf_stats.shm++;
+        return;
+      }
+      if (mem_pool_grow(PF_KERNEL)) {
+        return;
+      }
+      put_str("page fault: out of kernel memory\n");
+    } else if (vma->flags & VMA_FILE) {
+      if (file_page_fill(vma, page) != NULL) {
+        pf_stats.file++;
+        return;
+      }
+      // Cache page or page table may be short of kernel pages
+      if (mem_pool_grow(PF_KERNEL)) {
+        return;
+      }
+      put_str("page fault: no file page\n");
+    } else {
+      if (user_page_fill(page, vma->flags & VMA_WRITE) != NULL) {
+        pf_stats.anon++;
+        return;
+      }
+      // Out of user pages, or of kernel pages for the page table
+      if (mem_pool_grow(PF_USER) || mem_pool_grow(PF_KERNEL) || swap_out()) {
+        return;
+      }
+      put_str("page fault: out of user memory\n");
+    }
+  }
+
+  pf_stats.fail++;
+  put_str("page fault address : ");
+  put_int(va);
+  put_str(" eip : ");
+  put_int((uint32_t)frame->eip);
+  put_str(" error code : ");
+  put_int(frame->err_code);
+  put_char('\n');
+
+  while (1)
+    ;
+}
+
+// get physical address for given virtual address
+uint32_t va2pa(uint32_t va) {
+  if (kva_direct(va)) {
+    return va - K_BASE_ADDR;
+  }
+  uint32_t* pte = pte_ptr(va);
+  return ((*pte & 0xfffff000) + (va & 0x00000fff));
+}
+
+// Get free block count of given order in kernel/user pool
+uint32_t mem_free_blocks(enum pool_flags pf, uint32_t order) {
+  ASSERT(order < BUDDY_ORDER_CNT);
+  struct pa_pool* pa_pool = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  return pa_pool->buddy.free_cnt[order];
+}
+
+// Get free page count in kernel/user pool
+uint32_t mem_free_pages(enum pool_flags pf) {
+  struct pa_pool* pa_pool = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  return pa_pool->buddy.free_pages + pa_pool->zero_cnt;
+}
+
+// Kernel page to map a user frame being zeroed, only used by idle thread
+static uint32_t zero_window;
+
+// mem_zero_refill
+// Zero one free page for the pool having fewer pre-zeroed pages. It is called
+// by idle thread with interrupt on, so the page is cleaned out of the pool
+// lock. Return false if there is nothing to do.
+bool mem_zero_refill(void) {
+  struct pa_pool* m_pool =
+      (k_pa_pool.zero_cnt <= u_pa_pool.zero_cnt) ? &k_pa_pool : &u_pa_pool;
+  if (m_pool->zero_cnt >= ZERO_FRAME_MAX) {
+    return false;
+  }
+
+  spinlock_acquire(&m_pool->lock);
+  int32_t pfn = buddy_alloc(&m_pool->buddy, 0);
+  spinlock_release(&m_pool->lock);
+  if (pfn < 0) {
+    return false;
+  }
+
+  void* kva = frame_kva(pfn * PG_SIZE, zero_window);
+  memset(kva, 0, PG_SIZE);
+  frame_kva_put(kva);
+
+  spinlock_acquire(&m_pool->lock);
+  struct frame* f = pfn2frame(pfn);
+  f->flags |= FRAME_ZERO;
+  list_push(&m_pool->zero_frames, &f->free_elem);
+  m_pool->zero_cnt++;
+  spinlock_release(&m_pool->lock);
+  return true;
+}
+
+// Print pre-zeroed page statistics of both pools
+void mem_zero_stats(void) {
+  printf("zero: kernel %d cached, %d hit, %d miss\n", k_pa_pool.zero_cnt,
+         k_pa_pool.zero_hit, k_pa_pool.zero_miss);
+  printf("zero: user %d cached, %d hit, %d miss\n", u_pa_pool.zero_cnt,
+         u_pa_pool.zero_hit, u_pa_pool.zero_miss);
+}
+
+// zero_frames_drain
+// Give pre-zeroed pages of m_pool in [start_pfn, end_pfn) back to buddy.
+// Caller holds the pool lock.
+static void zero_frames_drain(struct pa_pool* m_pool, uint32_t start_pfn,
+                              uint32_t end_pfn) {
+  struct list_elem* elem = m_pool->zero_frames.head.next;
+  while (elem != &m_pool->zero_frames.tail) {
+    struct list_elem* next = elem->next;
+    struct frame* f = elem2entry(struct frame, free_elem, elem);
+    uint32_t pfn = frame2pfn(f);
+    if (pfn >= start_pfn && pfn < end_pfn) {
+      list_remove(elem);
+      f->flags &= ~FRAME_ZERO;
+      m_pool->zero_cnt--;
+      buddy_free(&m_pool->buddy, pfn, 0);
+    }
+    elem = next;
+  }
+}
+
+// mem_pool_grow
+// Move the chunk next to the boundary of kernel and user pool into the pool
+// of pf. Kernel pool ends where user pool starts, and can only grow within
+// direct map. Return false if the other pool is short of free pages itself or
+// the chunk is not all free, or if caller holds a spinlock.
+bool mem_pool_grow(enum pool_flags pf) {
+  // Caller may hold one of the pool locks taken here already, or a lock
+  // ordered before them. Its allocation fails instead, and idle grows the pool
+  // before it runs out again.
+  if (running_thread()->spin_cnt > 0) {
+    return false;
+  }
+
+  struct pa_pool* from = (pf == PF_KERNEL) ? &u_pa_pool : &k_pa_pool;
+  struct pa_pool* to = (pf == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  struct buddy* kb = &k_pa_pool.buddy;
+  struct buddy* ub = &u_pa_pool.buddy;
+
+  spinlock_acquire(&u_pa_pool.lock);
+  spinlock_acquire(&k_pa_pool.lock);
+
+  // Keep the boundary aligned to chunks once it has moved
+  uint32_t split = ub->start_pfn;
+  uint32_t start, end;
+  if (pf == PF_KERNEL) {
+    start = split;
+    end = (split / MEM_CHUNK_PAGES + 1) * MEM_CHUNK_PAGES;
+    if (end > ub->end_pfn) {
+      end = ub->end_pfn;
+    }
+    if (end > k_direct_end / PG_SIZE) {
+      end = k_direct_end / PG_SIZE;
+    }
+  } else {
+    end = split;
+    start = split == 0 ? 0 : (split - 1) / MEM_CHUNK_PAGES * MEM_CHUNK_PAGES;
+    if (start < kb->start_pfn) {
+      start = kb->start_pfn;
+    }
+  }
+
+  bool ok = start < end && from->buddy.free_pages + from->zero_cnt >=
+                               end - start + MEM_POOL_HIGH;
+  if (ok) {
+    zero_frames_drain(from, start, end);
+    ok = buddy_take_range(&from->buddy, start, end - start);
+  }
+
+  if (ok) {
+    split = (pf == PF_KERNEL) ? end : start;
+    kb->end_pfn = split;
+    ub->start_pfn = split;
+    u_pa_pool.start = split * PG_SIZE;
+    from->size -= (end - start) * PG_SIZE;
+    to->size += (end - start) * PG_SIZE;
+    buddy_free_range(&to->buddy, start, end - start);
+    to->grow_cnt++;
+  }
+
+  spinlock_release(&k_pa_pool.lock);
+  spinlock_release(&u_pa_pool.lock);
+  return ok;
+}
+
+// mem_rebalance
+// Grow the pool below low watermark, called by idle thread before it runs out.
+// Return true if a chunk is moved.
+bool mem_rebalance(void) {
+  if (mem_free_pages(PF_KERNEL) < MEM_POOL_LOW) {
+    return mem_pool_grow(PF_KERNEL);
+  }
+  if (mem_free_pages(PF_USER) < MEM_POOL_LOW) {
+    return mem_pool_grow(PF_USER);
+  }
+  return false;
+}
+
+// Print the split of kernel and user pool and chunks moved between them
+void mem_pool_stats(void) {
+  printf("pool: split at 0x%x, kernel %dKB, user %dKB\n",
+         u_pa_pool.start, k_pa_pool.size / 1024, u_pa_pool.size / 1024);
+  printf("pool: kernel %d free, %d chunks in; user %d free, %d chunks in\n",
+         mem_free_pages(PF_KERNEL), k_pa_pool.grow_cnt,
+         mem_free_pages(PF_USER), u_pa_pool.grow_cnt);
+}
+
+static void mem_range_add(uint32_t start_pfn, uint32_t end_pfn) {
+  if (start_pfn >= end_pfn) {
+    return;
+  }
+  if (mem_range_cnt == MEM_RANGE_MAX) {
+    put_str("    too many memory ranges, ignore the rest\n");
+    return;
+  }
+  mem_ranges[mem_range_cnt].start_pfn = start_pfn;
+  mem_ranges[mem_range_cnt].end_pfn = end_pfn;
+  mem_range_cnt++;
+}
+
+// mem_range_remove
+// Cut [start_pfn, end_pfn) out of usable ranges, a range may be split into two.
+static void mem_range_remove(uint32_t start_pfn, uint32_t end_pfn) {
+  uint32_t i, cnt = mem_range_cnt;
+  for (i = 0; i < cnt; i++) {
+    struct mem_range* r = &mem_ranges[i];
+    if (end_pfn <= r->start_pfn || start_pfn >= r->end_pfn) {
+      continue;
+    }
+    uint32_t old_end = r->end_pfn;
+    if (start_pfn > r->start_pfn) {
+      r->end_pfn = start_pfn;
+      mem_range_add(end_pfn, old_end);
+    } else {
+      r->start_pfn = end_pfn < old_end ? end_pfn : old_end;
+    }
+  }
+}
+
+// mem_ranges_init
+// Build usable memory ranges from the E820 map, frames below reserved_pfn are
+// used by kernel image and loader page tables. Holes and reserved ranges are
+// excluded. We have no PAE, memory above 4GB is ignored.
+static void mem_ranges_init(uint32_t reserved_pfn) {
+  uint32_t nr = *(uint32_t*)E820_NR_ADDR;
+  struct e820_entry* map = (struct e820_entry*)E820_MAP_ADDR;
+  uint64_t mem_limit = 0x100000000ULL;
+
+  mem_range_cnt = 0;
+
+  if (nr == 0) {
+    // No E820, E801 only tells us the total size
+    uint32_t mem_bytes_total = *(uint32_t*)MEMORY_TOTAL_BYTES_ADDR;
+    mem_range_add(0, mem_bytes_total / PG_SIZE);
+  }
+
+  uint32_t i;
+  for (i = 0; i < nr; i++) {
+    if (map[i].type != E820_TYPE_USABLE || map[i].base >= mem_limit) {
+      continue;
+    }
+    uint64_t end = map[i].base + map[i].len;
+    if (end > mem_limit) {
+      end = mem_limit;
+    }
+    mem_range_add((uint32_t)((map[i].base + PG_SIZE - 1) >> 12),
+                  (uint32_t)(end >> 12));
+  }
+
+  // Reserved ranges may overlap usable ones on some BIOS, trust reserved
+  for (i = 0; i < nr; i++) {
+    if (map[i].type == E820_TYPE_USABLE || map[i].base >= mem_limit) {
+      continue;
+    }
+    uint64_t end = map[i].base + map[i].len;
+    if (end > mem_limit) {
+      end = mem_limit;
+    }
+    mem_range_remove((uint32_t)(map[i].base >> 12),
+                     (uint32_t)((end + PG_SIZE - 1) >> 12));
+  }
+
+  mem_range_remove(0, reserved_pfn);
+
+  // Insertion sort by address, remove empty ranges
+  uint32_t j, cnt = 0;
+  for (i = 0; i < mem_range_cnt; i++) {
+    struct mem_range r = mem_ranges[i];
+    if (r.start_pfn >= r.end_pfn) {
+      continue;
+    }
+    j = cnt;
+    while (j > 0 && mem_ranges[j - 1].start_pfn > r.start_pfn) {
+      mem_ranges[j] = mem_ranges[j - 1];
+      j--;
+    }
+    mem_ranges[j] = r;
+    cnt++;
+  }
+  mem_range_cnt = cnt;
+
+  for (i = 0; i < mem_range_cnt; i++) {
+    put_str("    usable memory : ");
+    put_int(mem_ranges[i].start_pfn * PG_SIZE);
+    put_str(" ~ ");
+    put_int(mem_ranges[i].end_pfn * PG_SIZE - 1);
+    put_char('\n');
+  }
+}
+
+// direct_map_init
+// Map physical memory [0, end) at K_BASE_ADDR. With PSE each 4MB is a single
+// PDE, else we fill PTEs of page tables created in loader. Kernel PDEs are
+// copied into every page directory, so all processes share the map.
+static void direct_map_init(uint32_t end) {
+  uint32_t edx;
+  asm volatile("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+  bool pse = edx & CPUID_PSE;
+  if (pse) {
+    asm volatile("movl %%cr4, %%eax; orl %0, %%eax; movl %%eax, %%cr4"
+                 :
+                 : "i"(CR4_PSE)
+                 : "eax", "memory");
+  }
+
+  uint32_t pa;
+  for (pa = 0; pa < end; pa += PG_SIZE_4M) {
+    uint32_t va = K_BASE_ADDR + pa;
+    if (pse) {
+      *pde_ptr(va) = pa | PG_PS | PG_US_U | PG_RW_W | PG_P_1;
+      continue;
+    }
+    uint32_t off;
+    for (off = 0; off < PG_SIZE_4M; off += PG_SIZE) {
+      *pte_ptr(va + off) = (pa + off) | PG_US_U | PG_RW_W | PG_P_1;
+    }
+  }
+
+  asm volatile("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+
+  put_str("    direct map end : ");
+  put_int(end);
+  put_str(pse ? " with 4MB pages\n" : " with 4KB pages\n");
+}
+
+static void mem_pool_init(void) {
+  put_str("    mem_pool init start\n");
+
+  // 1. Collect usable memory
+  // We created 1 PDE and 255 PTE for kernel in loader, and the least 1MB is
+  // used by kernel
+  uint32_t page_table_size = PG_SIZE * 256;
+  uint32_t used_mem = page_table_size + 0x100000;
+  mem_ranges_init(used_mem / PG_SIZE);
+
+  if (mem_range_cnt == 0) {
+    PANIC("mem_pool_init: no usable memory");
+  }
+
+  uint32_t i;
+  uint32_t all_free_pages = 0;
+  for (i = 0; i < mem_range_cnt; i++) {
+    all_free_pages += mem_ranges[i].end_pfn - mem_ranges[i].start_pfn;
+  }
+
+  // 2. Allocate pages for kernel and user
+  // Simply allocate half of all pages to kernel, the rest to user. The pools
+  // are split at split_pfn, holes inside them are never given to buddy.
+  uint32_t kernel_free_pages = all_free_pages / 2;
+  if (kernel_free_pages > K_POOL_MAX_PAGES) {
+    kernel_free_pages = K_POOL_MAX_PAGES;
+  }
+  uint32_t user_free_pages = all_free_pages - kernel_free_pages;
+
+  uint32_t split_pfn = mem_ranges[0].start_pfn;
+  uint32_t left = kernel_free_pages;
+  for (i = 0; i < mem_range_cnt && left > 0; i++) {
+    uint32_t range_pages = mem_ranges[i].end_pfn - mem_ranges[i].start_pfn;
+    if (range_pages >= left) {
+      split_pfn = mem_ranges[i].start_pfn + left;
+      break;
+    }
+    left -= range_pages;
+  }
+
+  // Holes may push split_pfn beyond the direct map, give the rest to user
+  if (split_pfn > K_DIRECT_MAX / PG_SIZE) {
+    split_pfn = K_DIRECT_MAX / PG_SIZE;
+    kernel_free_pages = 0;
+    for (i = 0; i < mem_range_cnt && mem_ranges[i].start_pfn < split_pfn;
+         i++) {
+      uint32_t end = mem_ranges[i].end_pfn;
+      kernel_free_pages += (end < split_pfn ? end : split_pfn) -
+                           mem_ranges[i].start_pfn;
+    }
+    user_free_pages = all_free_pages - kernel_free_pages;
+  }
+
+  uint32_t kp_start_pfn = mem_ranges[0].start_pfn;
+  uint32_t max_pfn = mem_ranges[mem_range_cnt - 1].end_pfn;
+
+  k_pa_pool.start = kp_start_pfn * PG_SIZE;
+  u_pa_pool.start = split_pfn * PG_SIZE;
+  k_pa_pool.size = kernel_free_pages * PG_SIZE;
+  u_pa_pool.size = user_free_pages * PG_SIZE;
+
+  // 3. Map memory linearly at K_BASE_ADDR
+  // Not only kernel pool but as much as direct map holds, kernel pool may take
+  // frames of user pool later, see mem_pool_grow.
+  k_direct_end = K_DIRECT_MAX;
+  if (max_pfn < K_DIRECT_MAX / PG_SIZE) {
+    k_direct_end = DIV_ROUND_UP(max_pfn * PG_SIZE, PG_SIZE_4M) * PG_SIZE_4M;
+  }
+  direct_map_init(k_direct_end);
+
+  // 4. Set up frame table and kernel virtual address bitmap
+  // Both of them live in the first pages of kernel pool and are reached by
+  // direct map. The bitmap covers page mapped kernel space after direct map,
+  // whose PDEs are all created in loader.
+  frame_cnt = max_pfn;
+  uint32_t ft_pg_cnt = DIV_ROUND_UP(frame_cnt * sizeof(struct frame), PG_SIZE);
+  uint32_t k_mapped_start = K_BASE_ADDR + k_direct_end;
+  uint32_t kbm_length =
+      DIV_ROUND_UP((K_MAPPED_END - k_mapped_start) / PG_SIZE, 8);
+  uint32_t ksum_off = DIV_ROUND_UP(kbm_length, 4) * 4;
+  uint32_t kbm_pg_cnt = DIV_ROUND_UP(
+      ksum_off + hbitmap_summary_bytes(kbm_length), PG_SIZE);
+  uint32_t boot_pg_cnt = ft_pg_cnt + kbm_pg_cnt;
+
+  if (boot_pg_cnt >= mem_ranges[0].end_pfn - kp_start_pfn ||
+      boot_pg_cnt >= kernel_free_pages) {
+    PANIC("mem_pool_init: no room for frame table");
+  }
+
+  frame_table = pa2kva(k_pa_pool.start);
+  memset(frame_table, 0, ft_pg_cnt * PG_SIZE);
+
+  k_va_pool.btmp.btmp.btmp_bytes_len = kbm_length;
+  k_va_pool.btmp.btmp.bits = pa2kva(k_pa_pool.start + ft_pg_cnt * PG_SIZE);
+  k_va_pool.btmp.summary = (void*)(k_va_pool.btmp.btmp.bits + ksum_off);
+  k_va_pool.start = k_mapped_start;
+  hbitmap_init(&k_va_pool.btmp);
+
+  // 5. Init buddy system for kernel and user
+  buddy_init(&k_pa_pool.buddy, kp_start_pfn, split_pfn);
+  buddy_init(&u_pa_pool.buddy, split_pfn, max_pfn);
+
+  uint32_t boot_end_pfn = kp_start_pfn + boot_pg_cnt;
+  for (i = 0; i < mem_range_cnt; i++) {
+    uint32_t start = mem_ranges[i].start_pfn;
+    uint32_t end = mem_ranges[i].end_pfn;
+    if (start < boot_end_pfn) {
+      start = boot_end_pfn;
+    }
+
+    if (start < split_pfn) {
+      uint32_t k_end = end < split_pfn ? end : split_pfn;
+      buddy_free_range(&k_pa_pool.buddy, start, k_end - start);
+      start = k_end;
+    }
+
+    if (start < end) {
+      buddy_free_range(&u_pa_pool.buddy, start, end - start);
+    }
+  }
+
+  // init lock
+  spinlock_init(&k_pa_pool.lock);
+  spinlock_init(&u_pa_pool.lock);
+  list_init(&k_pa_pool.zero_frames);
+  list_init(&u_pa_pool.zero_frames);
+
+  put_str("    frame table start : ");
+  put_int((int)frame_table);
+  put_char('\n');
+  put_str("    kernel pool physical address start : ");
+  put_int(k_pa_pool.start);
+  put_char('\n');
+  put_str("    kernel pool size : ");
+  put_int(k_pa_pool.size / 1024 / 1024);
+  put_str(" MB\n");
+
+  put_str("    user pool physical address start : ");
+  put_int(u_pa_pool.start);
+  put_char('\n');
+  put_str("    user pool size : ");
+  put_int(u_pa_pool.size / 1024 / 1024);
+  put_str(" MB\n");
+
+  put_str("    mem_pool_init done\n");
+}
+
+void mem_init() {
+  put_str("mem_init start\n");
+  mem_pool_init();
+
+  put_str("total free memory : ");
+  put_int((mem_free_pages(PF_KERNEL) + mem_free_pages(PF_USER)) / 256);
+  put_str(" MB\n");
+
+  mem_block_descs_init(k_block_descs);
+  slab_init();
+  kmem_cache_create(&mag_cache, "magazines",
+                    MEM_BLOCK_DESC_CNT * sizeof(struct mem_magazine), NULL);
+  kmem_cache_create(&u_descs_cache, "u_block_descs",
+                    MEM_BLOCK_DESC_CNT * sizeof(struct mem_block_desc), NULL);
+  vma_init();
+  tlb_init();
+  copy_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+  zero_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+  swap_window = (uint32_t)vaddr_get(PF_KERNEL, 1);
+  lock_init(&swap_lock);
+  register_handler(0x0e, page_fault_handler);
+  mem_atomic_refill();
+
+  // Let kernel writes fault on read-only user pages too, so COW also works
+  // when kernel writes to user buffers
+  asm volatile("movl %%cr0, %%eax; orl $0x10000, %%eax; movl %%eax, %%cr0"
+               :
+               :
+               : "eax", "memory");
+  put_str("mem_init done\n");
+}
+
+// heap_frame
+// Return the frame of the page holding heap address va, arena and large block
+// metadata is kept there instead of inside the page.
+static struct frame* heap_frame(void* va) {
+  return pfn2frame(va2pa((uint32_t)va) / PG_SIZE);
+}
+
+// block_desc_find
+// Find the smallest size class holding size bytes, NULL for large size.
+static struct mem_block_desc* block_desc_find(struct mem_block_desc* descs,
+                                              uint32_t size) {
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    if (size <= descs[i].block_size) {
+      return &descs[i];
+    }
+  }
+  return NULL;
+}
+
+// arena_block_get
+// Take a free block of mbd from the first partial arena, allocate a new arena
+// page if there is none. Caller should hold pa_pool lock.
+static struct mem_block* arena_block_get(struct mem_block_desc* mbd,
+                                         enum pool_flags PF) {
+  struct arena* arena;
+
+  // No partial arena, allocate new arena pages
+  if (list_empty(&mbd->partial_arenas)) {
+    uint32_t arena_size = mbd->arena_pg_cnt * PG_SIZE;
+    arena = (struct arena*)malloc_page(PF, mbd->arena_pg_cnt);
+
+    if (arena == NULL) {
       return NULL;
     }
 
     arena->descptr = mbd;
     arena->cnt = mbd->block_cnt_per_arena;
-    arena->large = false;
+    list_init(&arena->free_list);
+
+    // Blocks may lie in any page of arena, each frame points back to it
+    uint32_t i;
+    for (i = 0; i < mbd->arena_pg_cnt; i++) {
+      struct frame* f = heap_frame((void*)((uint32_t)arena + i * PG_SIZE));
+      f->arena = arena;
+      f->flags |= FRAME_ARENA;
+    }
 
-    // Add free block to descs' free block list
+    // Add free blocks to arena's own free block list
     struct mem_block* block =
         (struct mem_block*)((uint32_t)arena + sizeof(struct arena));
     for (i = 0; i < arena->cnt; i++) {
-      ASSERT((uint32_t)block <= (uint32_t)arena + PG_SIZE - mbd->block_size);
-      list_append(&mbd->free_list, &block->free_elem);
+      ASSERT((uint32_t)block <= (uint32_t)arena + arena_size - mbd->block_size);
+      list_append(&arena->free_list, &block->free_elem);
       block = (struct mem_block*)((uint32_t)block + mbd->block_size);
     }
+
+    list_push(&mbd->partial_arenas, &arena->arena_tag);
+    mbd->arena_cnt++;
+    mbd->free_cnt += arena->cnt;
   }
 
-  struct mem_block* free_block =
-      elem2entry(struct mem_block, free_elem, list_pop(&mbd->free_list));
+  arena = elem2entry(struct arena, arena_tag, list_top(&mbd->partial_arenas));
 
-  struct arena* arena = (struct arena*)block2arena(free_block);
+  struct mem_block* free_block =
+      elem2entry(struct mem_block, free_elem, list_pop(&arena->free_list));
   arena->cnt--;
+  mbd->free_cnt--;
+
+  // No free block left, move it to full arenas
+  if (arena->cnt == 0) {
+    list_remove(&arena->arena_tag);
+    list_append(&mbd->full_arenas, &arena->arena_tag);
+  }
+
+  return free_block;
+}
+
+// arena_block_put
+// Give a block back to its arena, free the arena if all its blocks are free.
+// Caller should hold pa_pool lock.
+static void arena_block_put(struct mem_block* block, enum pool_flags PF) {
+  struct frame* f = heap_frame(block);
+  ASSERT(f->flags & FRAME_ARENA);
+  struct arena* arena = f->arena;
+  struct mem_block_desc* mbd = arena->descptr;
+  ASSERT(mbd != NULL);
+  ASSERT(arena->cnt < mbd->block_cnt_per_arena);
+
+  list_push(&arena->free_list, &block->free_elem);
+  mbd->free_cnt++;
+
+  // Full arena gets a free block, it becomes partial
+  if (arena->cnt == 0) {
+    list_remove(&arena->arena_tag);
+    list_push(&mbd->partial_arenas, &arena->arena_tag);
+  }
+
+  arena->cnt++;
 
+  // If the arena has no busy block, free it. Its free blocks all live in the
+  // arena pages, nothing else refers to them.
+  if (arena->cnt == mbd->block_cnt_per_arena) {
+    list_remove(&arena->arena_tag);
+    mbd->arena_cnt--;
+    mbd->free_cnt -= arena->cnt;
+
+    uint32_t i;
+    tlb_batch_begin();
+    for (i = 0; i < mbd->arena_pg_cnt; i++) {
+      void* page = (void*)((uint32_t)arena + i * PG_SIZE);
+      heap_frame(page)->flags &= ~FRAME_ARENA;
+      free_page(PF, page);
+    }
+    tlb_batch_end();
+  }
+}
+
+// cur_magazine
+// Return the magazine of running thread for mbd, NULL if mbd is not in the
+// descs cached by its magazines, e.g. kmalloc in user process.
+static struct mem_magazine* cur_magazine(struct mem_block_desc* mbd) {
+  struct task_struct* cur = running_thread();
+  if (cur->mags == NULL || mbd < cur->mag_descs ||
+      mbd >= cur->mag_descs + MEM_BLOCK_DESC_CNT) {
+    return NULL;
+  }
+  return &cur->mags[mbd - cur->mag_descs];
+}
+
+// mem_thread_init
+// Give new thread empty magazines for k_block_descs. A thread goes to arenas
+// every time if there is no memory for them.
+void mem_thread_init(struct task_struct* pthread) {
+  pthread->u_block_descs = NULL;
+  pthread->mag_descs = k_block_descs;
+  pthread->mags = kmem_cache_alloc(&mag_cache);
+  if (pthread->mags != NULL) {
+    memset(pthread->mags, 0, MEM_BLOCK_DESC_CNT * sizeof(struct mem_magazine));
+  }
+}
+
+// mem_proc_init
+// Give new process heap descs of its own, its magazines cache them from now
+// on. Return false if kernel pool is out.
+bool mem_proc_init(struct task_struct* pthread) {
+  ASSERT(pthread->u_block_descs == NULL);
+  pthread->u_block_descs = kmem_cache_alloc(&u_descs_cache);
+  if (pthread->u_block_descs == NULL) {
+    return false;
+  }
+  mem_block_descs_init(pthread->u_block_descs);
+  pthread->mag_descs = pthread->u_block_descs;
+  return true;
+}
+
+// mem_thread_copy
+// Give forked child copies of parent's heap descs and magazines, child PCB is
+// a copy of parent's still pointing to them. Sentinels of an empty arena list
+// point to themselves in parent's descs, a non-empty list ends at arena tags
+// in heap pages, which heap_page_copy moves to child's descs. Return false if
+// kernel pool is out.
+bool mem_thread_copy(struct task_struct* child, struct task_struct* parent) {
+  ASSERT(parent->u_block_descs != NULL);
+  child->u_block_descs = kmem_cache_alloc(&u_descs_cache);
+  child->mag_descs = child->u_block_descs;
+  // Blocks cached by parent are free in child only if it has magazines too
+  child->mags = (parent->mags == NULL) ? NULL : kmem_cache_alloc(&mag_cache);
+  if (child->u_block_descs == NULL ||
+      (parent->mags != NULL && child->mags == NULL)) {
+    mem_thread_free(child);
+    return false;
+  }
+
+  memcpy(child->u_block_descs, parent->u_block_descs,
+         MEM_BLOCK_DESC_CNT * sizeof(struct mem_block_desc));
+  if (child->mags != NULL) {
+    memcpy(child->mags, parent->mags,
+           MEM_BLOCK_DESC_CNT * sizeof(struct mem_magazine));
+  }
+
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    struct mem_block_desc* d = &child->u_block_descs[i];
+    if (list_empty(&parent->u_block_descs[i].partial_arenas)) {
+      list_init(&d->partial_arenas);
+    }
+    if (list_empty(&parent->u_block_descs[i].full_arenas)) {
+      list_init(&d->full_arenas);
+    }
+  }
+  return true;
+}
+
+// mem_thread_free
+// Free magazines and heap descs of a dead thread. Kernel blocks still cached
+// go back to arenas, user blocks go with the address space.
+void mem_thread_free(struct task_struct* pthread) {
+  if (pthread->mags != NULL) {
+    if (pthread->mag_descs == k_block_descs) {
+      spinlock_acquire(&k_pa_pool.lock);
+      uint32_t i;
+      for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+        struct mem_magazine* mag = &pthread->mags[i];
+        while (mag->cnt > 0) {
+          arena_block_put(mag->rounds[--mag->cnt], PF_KERNEL);
+        }
+      }
+      spinlock_release(&k_pa_pool.lock);
+    }
+    kmem_cache_free(&mag_cache, pthread->mags);
+    pthread->mags = NULL;
+  }
+  if (pthread->u_block_descs != NULL) {
+    kmem_cache_free(&u_descs_cache, pthread->u_block_descs);
+    pthread->u_block_descs = NULL;
+  }
+}
+
+// FIXME: va_pool and mem_block_descs are not thread-safe
+void* sys_malloc(uint32_t size) {
+  struct task_struct* cur = running_thread();
+
+  struct mem_block_desc* mb_descs;
+  mb_descs = (cur->pgdir == NULL) ? k_block_descs : cur->u_block_descs;
+
+  enum pool_flags PF = (cur->pgdir == NULL) ? PF_KERNEL : PF_USER;
+
+  struct pa_pool* pa_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+
+  // Size larger than all classes, allocate whole pages without header
+  struct mem_block_desc* mbd = block_desc_find(mb_descs, size);
+  if (mbd == NULL) {
+    // Larger than all memory, page count would also wrap when rounded up
+    if (size > k_pa_pool.size + u_pa_pool.size) {
+      return NULL;
+    }
+    uint32_t pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+    spinlock_acquire(&pa_pool->lock);
+    void* va = malloc_page(PF, pg_cnt);
+
+    if (va == NULL) {
+      spinlock_release(&pa_pool->lock);
+      return mem_pool_grow(PF) ? sys_malloc(size) : NULL;
+    }
+
+    struct frame* f = heap_frame(va);
+    f->large_pg_cnt = pg_cnt;
+    f->flags |= FRAME_LARGE;
+
+    spinlock_release(&pa_pool->lock);
+    return va;
+  }
+
+  // Only the owner thread touches its magazine, no lock needed
+  struct mem_magazine* mag = cur_magazine(mbd);
+  if (mag != NULL && mag->cnt > 0) {
+    desc_alloc_note(mbd, size, true);
+    return mag->rounds[--mag->cnt];
+  }
+
+  struct mem_block* block;
+  spinlock_acquire(&pa_pool->lock);
+  block = arena_block_get(mbd, PF);
+  if (mag != NULL && block != NULL) {
+    // Refill half of the magazine within the same lock
+    mbd->mag_miss++;
+    while (mag->cnt < MEM_MAG_SIZE / 2) {
+      struct mem_block* b = arena_block_get(mbd, PF);
+      if (b == NULL) {
+        break;
+      }
+      mag->rounds[mag->cnt++] = b;
+    }
+  }
   spinlock_release(&pa_pool->lock);
-  return (void*)free_block;
+
+  if (block == NULL) {
+    return mem_pool_grow(PF) ? sys_malloc(size) : NULL;
+  }
+  desc_alloc_note(mbd, size, false);
+  return (void*)block;
 }
 
 void sys_free(void* vaddr) {
@@ -501,52 +2200,316 @@ void sys_free(void* vaddr) {
   enum pool_flags PF = (cur->pgdir == NULL) ? PF_KERNEL : PF_USER;
 
   struct pa_pool* pa_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
-  spinlock_acquire(&pa_pool->lock);
 
   struct mem_block* block = (struct mem_block*)vaddr;
-  // The block coresponding arena
-  struct arena* arena = (struct arena*)block2arena(vaddr);
-
-  // For large arena, free arena pages
-  if (arena->large) {
-    uint32_t cnt = arena->cnt;
-    uint32_t i;
-    for (i = 0; i < cnt; i++) {
-      free_page(PF, (void*)((uint32_t)arena + i * PG_SIZE));
-    }
+  struct frame* f = heap_frame(vaddr);
+
+  // For large block, free its pages
+  if (f->flags & FRAME_LARGE) {
+    ASSERT(((uint32_t)vaddr & 0x00000fff) == 0);
+    spinlock_acquire(&pa_pool->lock);
+    uint32_t cnt = f->large_pg_cnt;
+    f->flags &= ~FRAME_LARGE;
+    tlb_batch_begin();
+    large_pages_free(PF, (uint32_t)vaddr, cnt);
+    tlb_batch_end();
     spinlock_release(&pa_pool->lock);
     return;
   }
 
-  // For general block, just add it to descs' free block list
-  struct mem_block_desc* mbd = arena->descptr;
-  ASSERT(mbd != NULL);
+  // For general block, keep it in magazine if there is room
+  ASSERT(f->flags & FRAME_ARENA);
+  struct mem_block_desc* mbd = ((struct arena*)f->arena)->descptr;
+  struct mem_magazine* mag = cur_magazine(mbd);
+  bool hit = mag != NULL && mag->cnt < MEM_MAG_SIZE;
+  desc_free_note(mbd, hit);
+  if (hit) {
+    mag->rounds[mag->cnt++] = vaddr;
+    return;
+  }
+
+  spinlock_acquire(&pa_pool->lock);
+  if (mag != NULL) {
+    // Magazine is full, give half of it back within the same lock
+    mbd->mag_miss++;
+    while (mag->cnt > MEM_MAG_SIZE / 2) {
+      arena_block_put(mag->rounds[--mag->cnt], PF);
+    }
+    mag->rounds[mag->cnt++] = vaddr;
+  } else {
+    arena_block_put(block, PF);
+  }
+  spinlock_release(&pa_pool->lock);
+}
 
-  ASSERT(!elem_find(&mbd->free_list, &block->free_elem));
-  list_push(&mbd->free_list, &block->free_elem);
+// desc_alloc_note
+// Count a block of mbd given out for size bytes, hit if a magazine served it.
+// Kernel descs are shared by all threads and magazine hits take no lock, so
+// the counters are updated with interrupt off, or a preempted update is lost.
+static void desc_alloc_note(struct mem_block_desc* mbd, uint32_t size,
+                            bool hit) {
+  enum intr_status old_status = intr_disable();
+  mbd->alloc_cnt++;
+  mbd->round_waste += mbd->block_size - size;
+  mbd->live_cnt++;
+  if (mbd->live_cnt > mbd->live_peak) {
+    mbd->live_peak = mbd->live_cnt;
+  }
+  if (hit) {
+    mbd->mag_hit++;
+  }
+  intr_set_status(old_status);
+}
 
-  arena->cnt++;
+// desc_free_note
+// Count a block of mbd freed, hit if a magazine kept it. See desc_alloc_note.
+static void desc_free_note(struct mem_block_desc* mbd, bool hit) {
+  enum intr_status old_status = intr_disable();
+  mbd->dealloc_cnt++;
+  mbd->live_cnt--;
+  if (hit) {
+    mbd->mag_hit++;
+  }
+  intr_set_status(old_status);
+}
 
-  // If the arena has no busy block, free it
-  if (arena->cnt == mbd->block_cnt_per_arena) {
-    // Remove free block from descs owning this arena
+// large_pages_free
+// Free cnt pages of a large block from va. Caller holds pool lock and batches
+// TLB flush.
+static void large_pages_free(enum pool_flags PF, uint32_t va, uint32_t cnt) {
+  uint32_t i;
+  for (i = 0; i < cnt; i++, va += PG_SIZE) {
+    // Pages after the first one are plain user pages, they may be swapped
+    if (PF == PF_USER && page_swapped(va)) {
+      page_swap_drop(va);
+    } else {
+      free_page(PF, (void*)va);
+    }
+  }
+}
 
-    uint32_t i;
-    struct mem_block* free_block;
-    free_block = (struct mem_block*)((uint32_t)arena + sizeof(struct arena));
+// large_grow
+// Extend large block at vaddr to pg_cnt pages in place, false if the pages
+// after it are taken. Caller holds pool lock.
+static bool large_grow(enum pool_flags PF, void* vaddr, struct frame* f,
+                       uint32_t pg_cnt) {
+  struct pa_pool* m_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  uint32_t extra = pg_cnt - f->large_pg_cnt;
+  uint32_t end = (uint32_t)vaddr + f->large_pg_cnt * PG_SIZE;
+  uint32_t i;
+
+  // Direct mapped block takes the free frames right after it
+  if (PF == PF_KERNEL && kva_direct((uint32_t)vaddr)) {
+    if (!buddy_take_range(&m_pool->buddy, (end - K_BASE_ADDR) / PG_SIZE,
+                          extra)) {
+      return false;
+    }
+    pool_alloc_note(m_pool, extra);
+    f->large_pg_cnt = pg_cnt;
+    return true;
+  }
+
+  // Page mapped block takes the virtual pages after it and maps new frames
+  if (PF == PF_KERNEL) {
+    uint32_t bit_idx = (end - k_va_pool.start) / PG_SIZE;
+    if (bit_idx + extra > k_va_pool.btmp.btmp.btmp_bytes_len * 8) {
+      return false;
+    }
+    for (i = 0; i < extra; i++) {
+      if (hbitmap_scan_test(&k_va_pool.btmp, bit_idx + i)) {
+        return false;
+      }
+    }
+    for (i = 0; i < extra; i++) {
+      hbitmap_set(&k_va_pool.btmp, bit_idx + i);
+    }
+  } else if (!vma_map(&running_thread()->vm, end, extra, 0)) {
+    return false;
+  }
+
+  for (i = 0; i < extra; i++) {
+    void* pa = palloc(m_pool);
+    if (pa == NULL) {
+      // Rollback mapped pages and the rest virtual pages
+      tlb_batch_begin();
+      uint32_t j;
+      for (j = 0; j < i; j++) {
+        free_page(PF, (void*)(end + j * PG_SIZE));
+      }
+      tlb_batch_end();
+      for (; j < extra; j++) {
+        vaddr_free(PF, (void*)(end + j * PG_SIZE));
+      }
+      return false;
+    }
+    page_table_add((void*)(end + i * PG_SIZE), pa);
+  }
+  f->large_pg_cnt = pg_cnt;
+  return true;
+}
+
+// sys_realloc
+// Resize block at vaddr to size bytes, keep its content up to the smaller
+// size. A large block shrinks, or grows when the pages after it are free, in
+// place, others move to a new block. Return NULL and leave the old block as
+// it is if there is no memory.
+void* sys_realloc(void* vaddr, uint32_t size) {
+  if (vaddr == NULL) {
+    return sys_malloc(size);
+  }
+  if (size == 0) {
+    sys_free(vaddr);
+    return NULL;
+  }
+  // Larger than all memory, page count would also wrap when rounded up
+  if (size > k_pa_pool.size + u_pa_pool.size) {
+    return NULL;
+  }
 
-    for (i = 0; i < mbd->block_cnt_per_arena; i++) {
-      ASSERT(elem_find(&mbd->free_list, &free_block->free_elem));
-      list_remove(&free_block->free_elem);
-      // Iter next block
-      free_block = (struct mem_block*)((uint32_t)free_block + mbd->block_size);
+  struct task_struct* cur = running_thread();
+  struct mem_block_desc* mb_descs =
+      (cur->pgdir == NULL) ? k_block_descs : cur->u_block_descs;
+  enum pool_flags PF = (cur->pgdir == NULL) ? PF_KERNEL : PF_USER;
+  struct pa_pool* pa_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+  struct frame* f = heap_frame(vaddr);
+
+  uint32_t old_size;
+  if (f->flags & FRAME_LARGE) {
+    old_size = f->large_pg_cnt * PG_SIZE;
+    // Still a large block, only the pages after the new end change
+    if (block_desc_find(mb_descs, size) == NULL) {
+      uint32_t pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+      bool ok = true;
+      spinlock_acquire(&pa_pool->lock);
+      if (pg_cnt < f->large_pg_cnt) {
+        tlb_batch_begin();
+        large_pages_free(PF, (uint32_t)vaddr + pg_cnt * PG_SIZE,
+                         f->large_pg_cnt - pg_cnt);
+        tlb_batch_end();
+        f->large_pg_cnt = pg_cnt;
+      } else if (pg_cnt > f->large_pg_cnt) {
+        ok = large_grow(PF, vaddr, f, pg_cnt);
+        if (ok) {
+          pa_pool->realloc_inplace++;
+        }
+      }
+      spinlock_release(&pa_pool->lock);
+      if (ok) {
+        return vaddr;
+      }
     }
+  } else {
+    ASSERT(f->flags & FRAME_ARENA);
+    old_size = ((struct arena*)f->arena)->descptr->block_size;
+    if (size <= old_size) {
+      return vaddr;
+    }
+  }
 
-    free_page(PF, arena);
+  void* new = sys_malloc(size);
+  if (new == NULL) {
+    return NULL;
   }
+  memcpy(new, vaddr, size < old_size ? size : old_size);
+  sys_free(vaddr);
+  if (size > old_size) {
+    pa_pool->realloc_copy++;
+  }
+  return new;
+}
 
+// sys_malloc_trim
+// Give all blocks cached in magazines of running thread back to arenas.
+void sys_malloc_trim(void) {
+  struct task_struct* cur = running_thread();
+  enum pool_flags PF = (cur->mag_descs == k_block_descs) ? PF_KERNEL : PF_USER;
+  struct pa_pool* pa_pool = (PF == PF_KERNEL) ? &k_pa_pool : &u_pa_pool;
+
+  if (cur->mags == NULL) {
+    return;
+  }
+  spinlock_acquire(&pa_pool->lock);
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    struct mem_magazine* mag = &cur->mags[i];
+    while (mag->cnt > 0) {
+      arena_block_put(mag->rounds[--mag->cnt], PF);
+    }
+  }
   spinlock_release(&pa_pool->lock);
-  return;
+}
+
+// sys_malloc_stats
+// Print usage of each size class used by running thread. Waste counts bytes of
+// free blocks plus arena header and tail, avg round is the average bytes lost
+// by rounding a request up to the class size.
+void sys_malloc_stats(void) {
+  struct mem_block_desc* descs = running_thread()->mag_descs;
+  struct pa_pool* pa_pool = (descs == k_block_descs) ? &k_pa_pool : &u_pa_pool;
+  printf("size arenas used waste avg_round mag_hit mag_miss\n");
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    struct mem_block_desc* d = &descs[i];
+    uint32_t blocks = d->arena_cnt * d->block_cnt_per_arena;
+    uint32_t slack =
+        d->arena_pg_cnt * PG_SIZE - d->block_cnt_per_arena * d->block_size;
+    uint32_t waste = d->free_cnt * d->block_size + d->arena_cnt * slack;
+    printf("%d %d %d %d %d %d %d\n", d->block_size, d->arena_cnt,
+           blocks - d->free_cnt, waste,
+           d->alloc_cnt == 0 ? 0 : d->round_waste / d->alloc_cnt, d->mag_hit,
+           d->mag_miss);
+  }
+  printf("realloc grow in place %d copied %d\n", pa_pool->realloc_inplace,
+         pa_pool->realloc_copy);
+  if (descs == k_block_descs) {
+    printf("atomic alloc %d free %d fail %d refill %d\n",
+           mem_atomic_stats.alloc_cnt, mem_atomic_stats.free_cnt,
+           mem_atomic_stats.fail_cnt, mem_atomic_stats.refill_cnt);
+  }
+}
+
+// sys_meminfo
+// Copy counters of both pools, size classes of kernel and running process and
+// page faults into info, return -1 if info is NULL.
+int32_t sys_meminfo(struct meminfo* info) {
+  if (info == NULL) {
+    return -1;
+  }
+  meminfo_pool_fill(&info->kernel, &k_pa_pool);
+  meminfo_pool_fill(&info->user, &u_pa_pool);
+
+  struct task_struct* cur = running_thread();
+  meminfo_class_fill(info->k_classes, k_block_descs);
+  if (cur->pgdir != NULL) {
+    meminfo_class_fill(info->u_classes, cur->u_block_descs);
+  } else {
+    memset(info->u_classes, 0, sizeof(info->u_classes));
+  }
+  info->faults = pf_stats;
+  info->proc_faults = cur->pf_cnt;
+  return 0;
+}
+
+static void meminfo_pool_fill(struct meminfo_pool* mp, struct pa_pool* pool) {
+  mp->pages = pool->size / PG_SIZE;
+  mp->free_pages = pool->buddy.free_pages + pool->zero_cnt;
+  mp->peak_pages = pool->stats.peak_pages;
+  mp->alloc_cnt = pool->stats.alloc_cnt;
+  mp->free_cnt = pool->stats.free_cnt;
+  mp->grow_cnt = pool->grow_cnt;
+}
+
+static void meminfo_class_fill(struct meminfo_class* mc,
+                               struct mem_block_desc* descs) {
+  uint32_t i;
+  for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    mc[i].block_size = descs[i].block_size;
+    mc[i].alloc_cnt = descs[i].alloc_cnt;
+    mc[i].free_cnt = descs[i].dealloc_cnt;
+    mc[i].live_bytes = descs[i].live_cnt * descs[i].block_size;
+    mc[i].peak_bytes = descs[i].live_peak * descs[i].block_size;
+    mc[i].arena_cnt = descs[i].arena_cnt;
+  }
 }
 
 // kmalloc allocate virtual address in kernel space
@@ -568,19 +2531,160 @@ void kfree(void* kva) {
   cur->pgdir = cur_pgdir;
 }
 
-void mem_block_descs_init(struct mem_block_desc descs[MEM_BLOCK_DESC_CNT]) {
-  // minimum size is 16 bytes
-  uint32_t size = 16;
+void* krealloc(void* kva, uint32_t size) {
+  void* new;
+  struct task_struct* cur = running_thread();
+  uint32_t* cur_pgdir = cur->pgdir;
+  cur->pgdir = NULL;
+  new = sys_realloc(kva, size);
+  cur->pgdir = cur_pgdir;
+  return new;
+}
 
+// arena_pages
+// Pick page count of arena for block size, the fewest pages whose unused tail
+// is within 1/8 of arena, or the best ratio up to MEM_ARENA_MAX_PG.
+static uint32_t arena_pages(uint32_t size) {
+  uint32_t pg, best_pg = 1, best_waste = PG_SIZE;
+  for (pg = 1; pg <= MEM_ARENA_MAX_PG; pg++) {
+    uint32_t waste = (pg * PG_SIZE - sizeof(struct arena)) % size;
+    if (waste * 8 <= pg * PG_SIZE) {
+      return pg;
+    }
+    if (waste * best_pg < best_waste * pg) {
+      best_pg = pg;
+      best_waste = waste;
+    }
+  }
+  return best_pg;
+}
+
+void mem_block_descs_init(struct mem_block_desc descs[MEM_BLOCK_DESC_CNT]) {
   int i;
   for (i = 0; i < MEM_BLOCK_DESC_CNT; i++) {
+    uint32_t size = mem_block_sizes[i];
     descs[i].block_size = size;
-    descs[i].block_cnt_per_arena = (PG_SIZE - sizeof(struct arena)) / size;
+    descs[i].arena_pg_cnt = arena_pages(size);
+    descs[i].block_cnt_per_arena =
+        (descs[i].arena_pg_cnt * PG_SIZE - sizeof(struct arena)) / size;
+
+    ASSERT(descs[i].block_cnt_per_arena > 0);
+
+    list_init(&descs[i].partial_arenas);
+    list_init(&descs[i].full_arenas);
+    descs[i].arena_cnt = 0;
+    descs[i].free_cnt = 0;
+    descs[i].alloc_cnt = 0;
+    descs[i].dealloc_cnt = 0;
+    descs[i].live_cnt = 0;
+    descs[i].live_peak = 0;
+    descs[i].round_waste = 0;
+    descs[i].mag_hit = 0;
+    descs[i].mag_miss = 0;
+  }
+}
 
-    ASSERT((descs[i].block_size * descs[i].block_cnt_per_arena +
-            sizeof(struct arena)) < PG_SIZE);
+// kmalloc_atomic
+// Take a block of size bytes from the reserve, NULL if size is larger than the
+// reserved classes or the reserve of its class is empty. It never sleeps or
+// spins, so it is safe in interrupt handlers. The block is counted in its
+// size class like any kmalloc block, so it may be freed with kfree in thread
+// context as well as with kfree_atomic.
+void* kmalloc_atomic(uint32_t size) {
+  struct mem_block_desc* mbd = block_desc_find(k_block_descs, size);
+  uint32_t idx = (mbd == NULL) ? MEM_ATOMIC_DESC_CNT : mbd - k_block_descs;
+  struct mem_block* block = NULL;
+
+  enum intr_status old_status = intr_disable();
+  if (idx < MEM_ATOMIC_DESC_CNT && atomic_cnt[idx] > 0) {
+    block = atomic_blocks[idx];
+    atomic_blocks[idx] = (struct mem_block*)block->free_elem.next;
+    atomic_cnt[idx]--;
+    mem_atomic_stats.alloc_cnt++;
+  } else {
+    mem_atomic_stats.fail_cnt++;
+  }
+  intr_set_status(old_status);
 
-    list_init(&descs[i].free_list);
-    size *= 2;
+  if (block != NULL) {
+    desc_alloc_note(mbd, size, false);
   }
+  return block;
+}
+
+// kfree_atomic
+// Put a kmalloc or kmalloc_atomic block of a reserved class into the reserve,
+// safe in interrupt handlers. Idle thread returns the surplus to arenas.
+void kfree_atomic(void* kva) {
+  struct frame* f = heap_frame(kva);
+  ASSERT(f->flags & FRAME_ARENA);
+  struct mem_block_desc* mbd = ((struct arena*)f->arena)->descptr;
+  uint32_t idx = mbd - k_block_descs;
+  ASSERT(idx < MEM_ATOMIC_DESC_CNT);
+  desc_free_note(mbd, false);
+
+  struct mem_block* block = kva;
+  enum intr_status old_status = intr_disable();
+  block->free_elem.next = (struct list_elem*)atomic_blocks[idx];
+  atomic_blocks[idx] = block;
+  atomic_cnt[idx]++;
+  mem_atomic_stats.free_cnt++;
+  intr_set_status(old_status);
+}
+
+// mem_atomic_refill
+// Refill classes of the reserve below MEM_ATOMIC_LOW blocks up to
+// MEM_ATOMIC_HIGH from arenas, and give blocks beyond MEM_ATOMIC_HIGH back.
+// Called by idle thread and at boot, never in interrupt handlers. Return false
+// if there is nothing to do.
+bool mem_atomic_refill(void) {
+  bool moved = false;
+  uint32_t i;
+  spinlock_acquire(&k_pa_pool.lock);
+  for (i = 0; i < MEM_ATOMIC_DESC_CNT; i++) {
+    struct mem_block_desc* mbd = &k_block_descs[i];
+    if (atomic_cnt[i] < MEM_ATOMIC_LOW) {
+      while (atomic_cnt[i] < MEM_ATOMIC_HIGH) {
+        struct mem_block* block = arena_block_get(mbd, PF_KERNEL);
+        if (block == NULL) {
+          break;
+        }
+        enum intr_status old_status = intr_disable();
+        block->free_elem.next = (struct list_elem*)atomic_blocks[i];
+        atomic_blocks[i] = block;
+        atomic_cnt[i]++;
+        mem_atomic_stats.refill_cnt++;
+        intr_set_status(old_status);
+        moved = true;
+      }
+    }
+
+    // Take the surplus off in one go, then give it back to arenas
+    struct mem_block* surplus = NULL;
+    enum intr_status old_status = intr_disable();
+    while (atomic_cnt[i] > MEM_ATOMIC_HIGH) {
+      struct mem_block* block = atomic_blocks[i];
+      atomic_blocks[i] = (struct mem_block*)block->free_elem.next;
+      atomic_cnt[i]--;
+      block->free_elem.next = (struct list_elem*)surplus;
+      surplus = block;
+    }
+    intr_set_status(old_status);
+    while (surplus != NULL) {
+      struct mem_block* next = (struct mem_block*)surplus->free_elem.next;
+      arena_block_put(surplus, PF_KERNEL);
+      surplus = next;
+      moved = true;
+    }
+  }
+  spinlock_release(&k_pa_pool.lock);
+  return moved;
+}
+
+// mem_atomic_free_blocks
+// Return reserved blocks of the class holding size bytes.
+uint32_t mem_atomic_free_blocks(uint32_t size) {
+  struct mem_block_desc* mbd = block_desc_find(k_block_descs, size);
+  uint32_t idx = (mbd == NULL) ? MEM_ATOMIC_DESC_CNT : mbd - k_block_descs;
+  return idx < MEM_ATOMIC_DESC_CNT ? atomic_cnt[idx] : 0;
 }
@@ -1,14 +1,23 @@
 #ifndef __KERNEL_MEMORY_H
 #define __KERNEL_MEMORY_H
 
-#include "kernel/bitmap.h"
+#include "buddy.h"
+#include "kernel/hbitmap.h"
 #include "kernel/list.h"
 #include "spinlock.h"
+#include "stdbool.h"
 #include "stdint.h"
 
 // Kernel base address
 #define K_BASE_ADDR 0xc0000000
 
+// Physical memory below k_direct_end, which holds all of kernel pool and the
+// part of user pool kernel pool may grow into, is mapped linearly at
+// K_BASE_ADDR. Kernel space above it is for page mapped allocations that can
+// not get physically continuous pages.
+#define K_DIRECT_MAX 0x38000000
+#define pa2kva(pa) ((void*)((uint32_t)(pa) + K_BASE_ADDR))
+
 // Macros to find PDE and PTE index for a given address
 #define PDE_IDX(addr) (addr >> 22)
 #define PTE_IDX(addr) ((addr << 10) >> 22)
@@ -22,25 +31,109 @@ enum pool_flags { PF_KERNEL = 1, PF_USER = 2 };
 #define PG_RW_W (1 << 1)
 #define PG_US_S 0
 #define PG_US_U (1 << 2)
+#define PG_A (1 << 5)    // Accessed, set by CPU
+#define PG_D (1 << 6)    // Dirty, set by CPU
+#define PG_PS (1 << 7)   // PDE maps a 4MB page
+#define PG_G (1 << 8)    // Global, kept in TLB across CR3 reloads
+#define PG_COW (1 << 9)  // Available bit, read-only page shared by fork
+#define PG_SWAP (1 << 10)  // Available bit, page is out in swap slot pte >> 12
+
+// Page fault error code bits
+#define PF_ERR_PRESENT (1 << 0)  // Protection violation, else not present
+#define PF_ERR_WRITE (1 << 1)
+#define PF_ERR_USER (1 << 2)
 
 // FIXME: va_pool should be thread-safe, not yet
 struct va_pool {
-  struct bitmap btmp;
+  struct hbitmap btmp;
   uint32_t start;
 };
 
+// Free pages zeroed in background by idle thread, so single page allocations
+// need not memset on their critical path
+#define ZERO_FRAME_MAX 64
+
+// Page counters of a pool
+struct pool_stats {
+  uint32_t alloc_cnt;   // Pages allocated
+  uint32_t free_cnt;    // Pages freed
+  uint32_t peak_pages;  // Most pages in use at once
+};
+
 struct pa_pool {
   spinlock_t lock;
-  struct bitmap btmp;
+  struct buddy buddy;
   uint32_t start;
   uint32_t size;
+
+  struct list zero_frames;  // Pre-zeroed free pages, taken off buddy
+  uint32_t zero_cnt;
+  uint32_t zero_hit;   // Allocations served by zero_frames
+  uint32_t zero_miss;  // Allocations which had to zero the page
+
+  uint32_t grow_cnt;  // Chunks taken from the other pool
+
+  uint32_t realloc_inplace;  // Large blocks grown over the pages after them
+  uint32_t realloc_copy;     // Blocks grown by moving to a new one
+
+  struct pool_stats stats;
+};
+
+// Page faults handled, counted by how they are resolved
+struct pf_stats {
+  uint32_t total;
+  uint32_t anon;     // Zeroed page of VMA_DEMAND area
+  uint32_t file;     // Cached page of VMA_FILE area
+  uint32_t cow;      // Private copy of shared page
+  uint32_t swap_in;  // Page read back from swap
+  uint32_t shm;      // Page of shared memory segment
+  uint32_t fail;     // Faults nothing can resolve
+};
+
+extern struct pf_stats pf_stats;
+
+// mmap prot and flags
+#define PROT_READ (1 << 0)
+#define PROT_WRITE (1 << 1)
+#define MAP_SHARED (1 << 0)
+#define MAP_PRIVATE (1 << 1)
+#define MAP_ANONYMOUS (1 << 2)
+#define MAP_FAILED ((void*)-1)
+
+// Arguments of mmap, syscall passes at most three of them in registers
+struct mmap_args {
+  void* addr;  // Hint, used if page aligned and free
+  uint32_t len;
+  int32_t prot;
+  int32_t flags;
+  int32_t fd;
+  uint32_t offset;  // Page aligned offset in file
 };
 
+struct task_struct;
+
 extern struct pa_pool k_pa_pool, u_pa_pool;
+extern uint32_t k_direct_end;
 void* get_kernel_pages(uint32_t pg_cnt);
+void free_kernel_pages(void* va, uint32_t pg_cnt);
 void* get_user_pages(uint32_t pg_cnt);
 void* get_a_page(enum pool_flags pf, uint32_t va);
+bool user_va_reserve(uint32_t va, uint32_t pg_cnt);
+void* sys_brk(void* brk);
+bool user_pages_share(struct task_struct* child);
+void user_space_free(uint32_t* pgdir);
+bool swap_out(void);
+void* sys_mmap(struct mmap_args* args);
+int32_t sys_munmap(void* addr, uint32_t len);
+void user_pages_unmap(uint32_t start, uint32_t pg_cnt);
 uint32_t va2pa(uint32_t va);
+uint32_t mem_free_blocks(enum pool_flags pf, uint32_t order);
+uint32_t mem_free_pages(enum pool_flags pf);
+bool mem_zero_refill(void);
+void mem_zero_stats(void);
+bool mem_pool_grow(enum pool_flags pf);
+bool mem_rebalance(void);
+void mem_pool_stats(void);
 void mem_init(void);
 
 struct mem_block {
@@ -50,15 +143,101 @@ struct mem_block {
 struct mem_block_desc {
   uint32_t block_size;
   uint32_t block_cnt_per_arena;
-  struct list free_list;
+  uint32_t arena_pg_cnt;       // Pages of each arena
+  struct list partial_arenas;  // Arenas with free blocks
+  struct list full_arenas;     // Arenas with all blocks in use
+
+  // statistics
+  uint32_t arena_cnt;    // Arenas in use
+  uint32_t free_cnt;     // Free blocks in arenas
+  uint32_t alloc_cnt;    // malloc served by this class
+  uint32_t dealloc_cnt;  // free of blocks of this class
+  uint32_t live_cnt;     // Blocks given out and not freed yet
+  uint32_t live_peak;    // Most blocks given out at once
+  uint32_t round_waste;  // Bytes lost by rounding up to block_size
+  uint32_t mag_hit;      // malloc/free served by magazine
+  uint32_t mag_miss;     // malloc/free going to arenas
+};
+
+#define MEM_BLOCK_DESC_CNT 13
+
+// Per-thread cache of free blocks of a size class. Typical malloc/free pairs
+// are served here without taking pa_pool lock, an empty magazine is refilled
+// with half of MEM_MAG_SIZE blocks and a full one gives half of them back.
+#define MEM_MAG_SIZE 8
+
+struct mem_magazine {
+  uint32_t cnt;
+  void* rounds[MEM_MAG_SIZE];
+};
+
+extern struct mem_block_desc k_block_descs[MEM_BLOCK_DESC_CNT];
+
+// Blocks of the first MEM_ATOMIC_DESC_CNT kernel size classes are kept aside
+// for kmalloc_atomic. It takes no lock and does not look at running thread, so
+// interrupt handlers may call it. Idle thread refills a class below
+// MEM_ATOMIC_LOW blocks up to MEM_ATOMIC_HIGH, and gives blocks beyond
+// MEM_ATOMIC_HIGH back to arenas. Reserved blocks are not live in the size
+// class stats until kmalloc_atomic hands them out.
+#define MEM_ATOMIC_DESC_CNT 10
+#define MEM_ATOMIC_LOW 4
+#define MEM_ATOMIC_HIGH 16
+
+struct mem_atomic_stats {
+  uint32_t alloc_cnt;
+  uint32_t free_cnt;
+  uint32_t fail_cnt;    // Size too large or reserve of the class empty
+  uint32_t refill_cnt;  // Blocks moved in by idle thread
+};
+
+extern struct mem_atomic_stats mem_atomic_stats;
+
+// Allocator and paging counters for user space, filled by sys_meminfo. They
+// are read without locks and may be off by allocations in flight.
+struct meminfo_pool {
+  uint32_t pages;  // Pages in pool now, chunks move between pools
+  uint32_t free_pages;
+  uint32_t peak_pages;
+  uint32_t alloc_cnt;
+  uint32_t free_cnt;
+  uint32_t grow_cnt;
 };
 
-#define MEM_BLOCK_DESC_CNT 7
+struct meminfo_class {
+  uint32_t block_size;
+  uint32_t alloc_cnt;
+  uint32_t free_cnt;
+  uint32_t live_bytes;
+  uint32_t peak_bytes;
+  uint32_t arena_cnt;
+};
+
+struct meminfo {
+  struct meminfo_pool kernel;
+  struct meminfo_pool user;
+  struct meminfo_class k_classes[MEM_BLOCK_DESC_CNT];  // kmalloc of all
+  struct meminfo_class u_classes[MEM_BLOCK_DESC_CNT];  // trap_malloc of caller
+  struct pf_stats faults;                              // All processes
+  uint32_t proc_faults;                                // Caller only
+};
 
 void mem_block_descs_init(struct mem_block_desc descs[MEM_BLOCK_DESC_CNT]);
+void mem_thread_init(struct task_struct* pthread);
+bool mem_proc_init(struct task_struct* pthread);
+bool mem_thread_copy(struct task_struct* child, struct task_struct* parent);
+void mem_thread_free(struct task_struct* pthread);
 void* sys_malloc(uint32_t size);
 void sys_free(void* va);
+void* sys_realloc(void* va, uint32_t size);
+void sys_malloc_trim(void);
+void sys_malloc_stats(void);
+int32_t sys_meminfo(struct meminfo* info);
 void* kmalloc(uint32_t size);
 void kfree(void* kva);
+void* krealloc(void* kva, uint32_t size);
+void* kmalloc_atomic(uint32_t size);
+void kfree_atomic(void* kva);
+bool mem_atomic_refill(void);
+uint32_t mem_atomic_free_blocks(uint32_t size);
 
 #endif
@@ -0,0 +1,195 @@
+#include "shm.h"
+
+#include "debug.h"
+#include "global.h"
+#include "kernel/print.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "stdnull.h"
+#include "thread.h"
+#include "vma.h"
+
+static struct shm_segment shm_table[SHM_MAX];
+
+// Protects shm_table and segment refs, which vma_free drops
+static spinlock_t shm_lock;
+
+// Private
+static struct shm_segment* shm_find(uint32_t key);
+static void* shm_map(struct shm_segment* shm);
+
+// Public
+void shm_init(void);
+void shm_get(struct shm_segment* shm);
+void shm_put(struct shm_segment* shm);
+uint32_t shm_page(struct shm_segment* shm, uint32_t idx);
+void* sys_shm_create(uint32_t key, uint32_t size);
+void* sys_shm_attach(uint32_t key);
+int32_t sys_shm_detach(void* addr);
+
+// Implementation
+
+// shm_find
+// Return the segment of key, NULL if there is none. Caller holds shm_lock.
+static struct shm_segment* shm_find(uint32_t key) {
+  uint32_t i;
+  for (i = 0; i < SHM_MAX; i++) {
+    if (shm_table[i].ref > 0 && shm_table[i].key == key) {
+      return &shm_table[i];
+    }
+  }
+  return NULL;
+}
+
+// shm_map
+// Add an area of shm to running process at the lowest free range, its pages
+// are mapped on touch. Return the start, NULL if there is no room.
+static void* shm_map(struct shm_segment* shm) {
+  struct vm_map* vm = &running_thread()->vm;
+  uint32_t va = vma_get_unmapped(vm, shm->pg_cnt);
+  if (va == 0 ||
+      !vma_map_shm(vm, va, shm->pg_cnt, VMA_SHM | VMA_WRITE, shm)) {
+    return NULL;
+  }
+  return (void*)va;
+}
+
+void shm_init(void) {
+  put_str("shm_init start\n");
+  spinlock_init(&shm_lock);
+  put_str("shm_init done\n");
+}
+
+void shm_get(struct shm_segment* shm) {
+  spinlock_acquire(&shm_lock);
+  ASSERT(shm->ref > 0);
+  shm->ref++;
+  spinlock_release(&shm_lock);
+}
+
+// shm_put
+// Drop a reference of shm, free its pages with the last one. No process maps
+// them by then.
+void shm_put(struct shm_segment* shm) {
+  spinlock_acquire(&shm_lock);
+  ASSERT(shm->ref > 0);
+  if (--shm->ref > 0) {
+    spinlock_release(&shm_lock);
+    return;
+  }
+  void** pages = shm->pages;
+  uint32_t pg_cnt = shm->pg_cnt;
+  shm->pages = NULL;
+  spinlock_release(&shm_lock);
+
+  uint32_t i;
+  for (i = 0; i < pg_cnt; i++) {
+    free_kernel_pages(pages[i], 1);
+  }
+  kfree(pages);
+}
+
+// shm_page
+// Return the physical address of page idx of shm.
+uint32_t shm_page(struct shm_segment* shm, uint32_t idx) {
+  ASSERT(idx < shm->pg_cnt);
+  return va2pa((uint32_t)shm->pages[idx]);
+}
+
+// sys_shm_create
+// Create a segment of size bytes under key and attach it, return its address
+// in running process, or NULL if key is taken or there is no memory.
+void* sys_shm_create(uint32_t key, uint32_t size) {
+  uint32_t pg_cnt = DIV_ROUND_UP(size, PG_SIZE);
+  if (running_thread()->pgdir == NULL || pg_cnt == 0 ||
+      pg_cnt > SHM_MAX_PAGES) {
+    return NULL;
+  }
+
+  void** pages = kmalloc(pg_cnt * sizeof(void*));
+  if (pages == NULL) {
+    return NULL;
+  }
+  uint32_t i;
+  for (i = 0; i < pg_cnt; i++) {
+    pages[i] = get_kernel_pages(1);
+    if (pages[i] == NULL) {
+      while (i-- > 0) {
+        free_kernel_pages(pages[i], 1);
+      }
+      kfree(pages);
+      return NULL;
+    }
+  }
+
+  // Hold the new segment until it is mapped, shm_put frees it on failure
+  struct shm_segment* shm = NULL;
+  spinlock_acquire(&shm_lock);
+  if (shm_find(key) == NULL) {
+    for (i = 0; i < SHM_MAX; i++) {
+      if (shm_table[i].ref == 0) {
+        shm = &shm_table[i];
+        shm->key = key;
+        shm->pg_cnt = pg_cnt;
+        shm->pages = pages;
+        shm->ref = 1;
+        break;
+      }
+    }
+  }
+  spinlock_release(&shm_lock);
+
+  if (shm == NULL) {
+    for (i = 0; i < pg_cnt; i++) {
+      free_kernel_pages(pages[i], 1);
+    }
+    kfree(pages);
+    return NULL;
+  }
+
+  void* va = shm_map(shm);
+  shm_put(shm);
+  return va;
+}
+
+// sys_shm_attach
+// Map segment of key into running process, return its address or NULL.
+void* sys_shm_attach(uint32_t key) {
+  if (running_thread()->pgdir == NULL) {
+    return NULL;
+  }
+
+  spinlock_acquire(&shm_lock);
+  struct shm_segment* shm = shm_find(key);
+  if (shm != NULL) {
+    shm->ref++;
+  }
+  spinlock_release(&shm_lock);
+  if (shm == NULL) {
+    return NULL;
+  }
+
+  void* va = shm_map(shm);
+  shm_put(shm);
+  return va;
+}
+
+// sys_shm_detach
+// Unmap segment attached at addr from running process. Return -1 if addr is
+// not the start of a segment area.
+int32_t sys_shm_detach(void* addr) {
+  struct task_struct* cur = running_thread();
+  uint32_t va = (uint32_t)addr;
+  struct vm_area* vma = NULL;
+  if (cur->pgdir != NULL && va < K_BASE_ADDR) {
+    vma = vma_find(&cur->vm, va);
+  }
+  if (vma == NULL || !(vma->flags & VMA_SHM) || vma->start != va) {
+    return -1;
+  }
+
+  uint32_t pg_cnt = (vma->end - vma->start) / PG_SIZE;
+  user_pages_unmap(va, pg_cnt);
+  // Drops the segment ref, so do it after the pages are unmapped
+  return vma_unmap(&cur->vm, va, pg_cnt) ? 0 : -1;
+}
@@ -0,0 +1,31 @@
+#ifndef __KERNEL_SHM_H
+#define __KERNEL_SHM_H
+
+#include "stdbool.h"
+#include "stdint.h"
+
+// A shared memory segment is a run of zeroed kernel pool pages known by a key
+// the processes agree on. Every process attaching it maps the same frames, as
+// they are not user frames they are never swapped, copied on write or freed
+// with a process. Each VMA_SHM area holds one reference, so fork shares the
+// segment too, and the segment is freed with its last area.
+
+#define SHM_MAX 16
+#define SHM_MAX_PAGES 1024
+
+struct shm_segment {
+  uint32_t key;
+  uint32_t pg_cnt;
+  void** pages;  // Kernel address of each page
+  uint32_t ref;  // 0 for free entry
+};
+
+void shm_init(void);
+void shm_get(struct shm_segment* shm);
+void shm_put(struct shm_segment* shm);
+uint32_t shm_page(struct shm_segment* shm, uint32_t idx);
+void* sys_shm_create(uint32_t key, uint32_t size);
+void* sys_shm_attach(uint32_t key);
+int32_t sys_shm_detach(void* addr);
+
+#endif
@@ -0,0 +1,268 @@
+#include "slab.h"
+
+#include "debug.h"
+#include "global.h"
+#include "kernel/list.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdnull.h"
+
+#define PG_SIZE 4096
+
+// Empty slabs kept by each cache, the rest are given back to kernel pool
+#define KMEM_EMPTY_SLAB_KEEP 1
+// Free page objects kept by each page object cache
+#define KMEM_FREE_PAGE_KEEP 8
+
+// Header at the beginning of each small object slab page
+struct slab {
+  struct kmem_cache* cache;
+  uint32_t inuse;
+  void* free;                  // First free slot, slots are singly linked
+  struct list_elem slab_tag;   // Tag in cache slabs_partial or slabs_full
+};
+
+#define obj2slab(obj) ((struct slab*)((uint32_t)(obj) & 0xfffff000))
+#define slot_link(cache, slot) ((void**)((uint32_t)(slot) + (cache)->link_off))
+
+static struct list kmem_cache_list;
+
+// Private
+static struct slab* slab_new(struct kmem_cache* cache);
+static void slab_release(struct kmem_cache* cache, struct slab* slab);
+static void* kmem_page_alloc(struct kmem_cache* cache);
+static void kmem_page_free(struct kmem_cache* cache, void* obj);
+
+// Public
+void slab_init(void);
+void kmem_cache_create(struct kmem_cache* cache, const char* name,
+                       uint32_t obj_size, kmem_ctor* ctor);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void kmem_cache_report(void);
+
+// Implementation
+
+void slab_init(void) { list_init(&kmem_cache_list); }
+
+// kmem_cache_create
+// Set up a cache for objects of obj_size bytes, ctor is called once when the
+// object is first carved from a new slab.
+void kmem_cache_create(struct kmem_cache* cache, const char* name,
+                       uint32_t obj_size, kmem_ctor* ctor) {
+  ASSERT(obj_size > 0);
+
+  cache->name = name;
+  cache->obj_size = obj_size;
+  cache->ctor = ctor;
+  spinlock_init(&cache->lock);
+
+  list_init(&cache->slabs_partial);
+  list_init(&cache->slabs_full);
+  cache->empty_slab_cnt = 0;
+  list_init(&cache->free_pages);
+  cache->free_page_cnt = 0;
+
+  cache->slab_cnt = 0;
+  cache->obj_inuse = 0;
+  cache->alloc_cnt = 0;
+  cache->free_cnt = 0;
+  cache->ctor_cnt = 0;
+
+  if (obj_size % PG_SIZE == 0) {
+    ASSERT(ctor == NULL);
+    cache->slot_size = obj_size;
+    cache->link_off = 0;
+    cache->obj_per_slab = 0;
+    cache->obj_pg_cnt = obj_size / PG_SIZE;
+  } else {
+    // Free link overlaps object unless it has to keep constructed state
+    uint32_t size = DIV_ROUND_UP(obj_size, sizeof(void*)) * sizeof(void*);
+    cache->link_off = ctor != NULL ? size : 0;
+    cache->slot_size = ctor != NULL ? size + sizeof(void*) : size;
+    cache->obj_per_slab = (PG_SIZE - sizeof(struct slab)) / cache->slot_size;
+    cache->obj_pg_cnt = 0;
+    ASSERT(cache->obj_per_slab > 0);
+  }
+
+  list_append(&kmem_cache_list, &cache->cache_tag);
+}
+
+// slab_new
+// Get a new slab page, construct all its objects and chain them as free. It is
+// called out of cache lock, so that kernel pool may grow for the page.
+static struct slab* slab_new(struct kmem_cache* cache) {
+  struct slab* slab = get_kernel_pages(1);
+  if (slab == NULL) {
+    return NULL;
+  }
+
+  slab->cache = cache;
+  slab->inuse = 0;
+  slab->free = NULL;
+
+  // Chain from the last slot so that allocation goes with address
+  uint32_t i = cache->obj_per_slab;
+  while (i-- > 0) {
+    void* slot =
+        (void*)((uint32_t)slab + sizeof(struct slab) + i * cache->slot_size);
+    if (cache->ctor != NULL) {
+      cache->ctor(slot);
+    }
+    *slot_link(cache, slot) = slab->free;
+    slab->free = slot;
+  }
+  return slab;
+}
+
+static void slab_release(struct kmem_cache* cache, struct slab* slab) {
+  list_remove(&slab->slab_tag);
+  cache->slab_cnt--;
+  free_kernel_pages(slab, 1);
+}
+
+// kmem_page_alloc
+// Take a free page object, or get new pages out of cache lock so that kernel
+// pool may grow for them. Caller holds cache lock.
+static void* kmem_page_alloc(struct kmem_cache* cache) {
+  if (!list_empty(&cache->free_pages)) {
+    cache->free_page_cnt--;
+    return (void*)list_pop(&cache->free_pages);
+  }
+
+  spinlock_release(&cache->lock);
+  void* obj = get_kernel_pages(cache->obj_pg_cnt);
+  spinlock_acquire(&cache->lock);
+  if (obj != NULL) {
+    cache->slab_cnt++;
+  }
+  return obj;
+}
+
+static void kmem_page_free(struct kmem_cache* cache, void* obj) {
+  ASSERT(((uint32_t)obj & 0x00000fff) == 0);
+  if (cache->free_page_cnt < KMEM_FREE_PAGE_KEEP) {
+    list_push(&cache->free_pages, (struct list_elem*)obj);
+    cache->free_page_cnt++;
+    return;
+  }
+  cache->slab_cnt--;
+  free_kernel_pages(obj, cache->obj_pg_cnt);
+}
+
+// kmem_cache_alloc
+// Allocate an object from cache, return NULL if kernel pool is exhausted.
+// Page objects are not cleaned when they are reused.
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+  void* obj;
+  spinlock_acquire(&cache->lock);
+
+  if (cache->obj_per_slab == 0) {
+    obj = kmem_page_alloc(cache);
+  } else {
+    if (list_empty(&cache->slabs_partial)) {
+      spinlock_release(&cache->lock);
+      struct slab* slab = slab_new(cache);
+      spinlock_acquire(&cache->lock);
+      if (slab == NULL) {
+        spinlock_release(&cache->lock);
+        return NULL;
+      }
+      // Another thread may have added a slab meanwhile, keep both
+      cache->slab_cnt++;
+      if (cache->ctor != NULL) {
+        cache->ctor_cnt += cache->obj_per_slab;
+      }
+      list_push(&cache->slabs_partial, &slab->slab_tag);
+      cache->empty_slab_cnt++;
+    }
+
+    struct slab* slab = elem2entry(struct slab, slab_tag,
+                                   cache->slabs_partial.head.next);
+    if (slab->inuse == 0) {
+      cache->empty_slab_cnt--;
+    }
+
+    obj = slab->free;
+    slab->free = *slot_link(cache, obj);
+    slab->inuse++;
+
+    if (slab->free == NULL) {
+      list_remove(&slab->slab_tag);
+      list_append(&cache->slabs_full, &slab->slab_tag);
+    }
+  }
+
+  if (obj != NULL) {
+    cache->obj_inuse++;
+    cache->alloc_cnt++;
+  }
+
+  spinlock_release(&cache->lock);
+  return obj;
+}
+
+// kmem_cache_free
+// Give an object back to its cache, it stays constructed.
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+  ASSERT(obj != NULL);
+  spinlock_acquire(&cache->lock);
+
+  cache->obj_inuse--;
+  cache->free_cnt++;
+
+  if (cache->obj_per_slab == 0) {
+    kmem_page_free(cache, obj);
+    spinlock_release(&cache->lock);
+    return;
+  }
+
+  struct slab* slab = obj2slab(obj);
+  ASSERT(slab->cache == cache && slab->inuse > 0);
+
+  *slot_link(cache, obj) = slab->free;
+  slab->free = obj;
+  slab->inuse--;
+
+  if (slab->inuse + 1 == cache->obj_per_slab) {
+    // Full slab becomes partial, prefer it to emptier ones
+    list_remove(&slab->slab_tag);
+    list_push(&cache->slabs_partial, &slab->slab_tag);
+  }
+
+  if (slab->inuse == 0) {
+    if (cache->empty_slab_cnt >= KMEM_EMPTY_SLAB_KEEP) {
+      slab_release(cache, slab);
+    } else {
+      // Keep it at the tail, so that it is used last
+      list_remove(&slab->slab_tag);
+      list_append(&cache->slabs_partial, &slab->slab_tag);
+      cache->empty_slab_cnt++;
+    }
+  }
+
+  spinlock_release(&cache->lock);
+}
+
+// kmem_cache_report
+// Print usage of all caches.
+void kmem_cache_report(void) {
+  printf("cache       size  inuse/total  pages  allocs  frees  ctors\n");
+  struct list_elem* elem = kmem_cache_list.head.next;
+  while (elem != &kmem_cache_list.tail) {
+    struct kmem_cache* c = elem2entry(struct kmem_cache, cache_tag, elem);
+    uint32_t total, pages;
+    if (c->obj_per_slab == 0) {
+      total = c->slab_cnt;
+      pages = c->slab_cnt * c->obj_pg_cnt;
+    } else {
+      total = c->slab_cnt * c->obj_per_slab;
+      pages = c->slab_cnt;
+    }
+    printf("%s  %d  %d/%d  %d  %d  %d  %d\n", c->name, c->obj_size,
+           c->obj_inuse, total, pages, c->alloc_cnt, c->free_cnt, c->ctor_cnt);
+    elem = elem->next;
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef __KERNEL_SLAB_H
+#define __KERNEL_SLAB_H
+
+#include "kernel/list.h"
+#include "spinlock.h"
+#include "stdint.h"
+
+typedef void kmem_ctor(void* obj);
+
+// A kmem_cache hands out kernel objects of a single type.
+//
+// Small objects are carved from one page slabs, each slab starts with a struct
+// slab header and keeps its own free slots. Objects of whole pages (like PCB)
+// are slabs by themselves and are kept in a free page list.
+//
+// A freed object goes back to its slab without destruction, so an object built
+// by ctor once is handed out again as it is. ctor is not allowed for page
+// objects since the free list link lives inside the free page.
+struct kmem_cache {
+  const char* name;
+  uint32_t obj_size;
+  uint32_t slot_size;     // Object plus free link if ctor is set
+  uint32_t link_off;      // Offset of free link in a slot
+  uint32_t obj_per_slab;  // 0 for page objects
+  uint32_t obj_pg_cnt;    // Pages of each page object
+  kmem_ctor* ctor;
+  spinlock_t lock;
+
+  struct list slabs_partial;  // Slabs with free slots, fullest first
+  struct list slabs_full;
+  uint32_t empty_slab_cnt;
+
+  struct list free_pages;  // Free page objects
+  uint32_t free_page_cnt;
+
+  // statistics
+  uint32_t slab_cnt;
+  uint32_t obj_inuse;
+  uint32_t alloc_cnt;
+  uint32_t free_cnt;
+  uint32_t ctor_cnt;
+
+  struct list_elem cache_tag;  // Tag in kmem_cache_list
+};
+
+void slab_init(void);
+void kmem_cache_create(struct kmem_cache* cache, const char* name,
+                       uint32_t obj_size, kmem_ctor* ctor);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void kmem_cache_report(void);
+
+#endif
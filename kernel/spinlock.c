@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "interrupt.h"
+#include "thread.h"
 
 void spinlock_init(spinlock_t* lock) { *lock = 0; }
 
@@ -15,6 +16,7 @@ void spinlock_acquire(spinlock_t* lock) {
     intr_set_status(old_status);
   }
   *lock += 1;
+  running_thread()->spin_cnt++;
   intr_set_status(old_status);
   return;
 }
@@ -23,5 +25,6 @@ void spinlock_release(spinlock_t* lock) {
   enum intr_status old_status = intr_disable();
   ASSERT(*lock == 1);
   *lock -= 1;
+  running_thread()->spin_cnt--;
   intr_set_status(old_status);
 }
@@ -0,0 +1,202 @@
+#include "swap.h"
+
+#include "debug.h"
+#include "disk.h"
+#include "interrupt.h"
+#include "kernel/lz.h"
+#include "kernel/print.h"
+#include "memory.h"
+#include "stdio.h"
+#include "stdnull.h"
+#include "string.h"
+#include "thread.h"
+
+#define SWAP_SLOT_SECS (PG_SIZE / 512)
+
+struct swap_stats swap_stats;
+
+// Reference count of each slot, 0 for free
+static uint8_t* slot_ref;
+
+// Compressed page of each slot kept in memory, NULL if it is on disk
+static void** slot_data;
+static uint16_t* slot_len;
+
+// Compressed pages of slots put under u_pa_pool lock, kfree'd later by
+// swap_reclaim out of it. Linked through their first word.
+static void* reclaim_list;
+
+// Slot to start the next search from
+static uint32_t slot_hint;
+
+// Compressed pages may take this many bytes of kernel memory
+static uint32_t mem_limit;
+
+// Work space of lz_compress, under swap_lock
+static uint16_t lz_hash[LZ_HASH_SIZE];
+static uint8_t lz_buf[SWAP_MEM_MAX_LEN];
+
+// Public
+void swap_init(void);
+bool swap_has_disk(void);
+int32_t swap_slot_alloc(void);
+void swap_slot_dup(uint32_t slot);
+void swap_slot_put(uint32_t slot);
+bool swap_reclaim(void);
+bool swap_store(uint32_t slot, void* page);
+void swap_read(uint32_t slot, void* buf);
+void swap_write(uint32_t slot, void* buf);
+void swap_stats_print(void);
+
+// Implementation
+
+void swap_init(void) {
+  put_str("swap_init start\n");
+  uint32_t slot_cnt = SWAP_MEM_SLOTS;
+  if (swap_partition != NULL) {
+    slot_cnt = swap_partition->sec_cnt / SWAP_SLOT_SECS;
+  }
+
+  slot_ref = sys_malloc(slot_cnt);
+  slot_data = sys_malloc(slot_cnt * sizeof(void*));
+  slot_len = sys_malloc(slot_cnt * sizeof(uint16_t));
+  if (slot_ref == NULL || slot_data == NULL || slot_len == NULL) {
+    put_str("  no memory for swap slots\n");
+    return;
+  }
+  memset(slot_ref, 0, slot_cnt);
+  memset(slot_data, 0, slot_cnt * sizeof(void*));
+  swap_stats.slot_cnt = slot_cnt;
+
+  // A quarter of free kernel memory at most for compressed pages
+  mem_limit = mem_free_pages(PF_KERNEL) / 4 * PG_SIZE;
+
+  printf("  swap on %s, %d pages, %dKB memory for compressed pages\n",
+         swap_partition == NULL ? "memory" : swap_partition->name, slot_cnt,
+         mem_limit / 1024);
+  put_str("swap_init done\n");
+}
+
+bool swap_has_disk(void) { return swap_partition != NULL; }
+
+// swap_slot_alloc
+// Get a free slot with one reference, -1 if all slots are in use.
+int32_t swap_slot_alloc(void) {
+  uint32_t i;
+  for (i = 0; i < swap_stats.slot_cnt; i++) {
+    uint32_t slot = (slot_hint + i) % swap_stats.slot_cnt;
+    if (slot_ref[slot] == 0) {
+      slot_ref[slot] = 1;
+      slot_hint = slot + 1;
+      swap_stats.slot_used++;
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void swap_slot_dup(uint32_t slot) {
+  ASSERT(slot < swap_stats.slot_cnt && slot_ref[slot] > 0);
+  // FIXME: more than 255 processes sharing a swapped page overflows
+  slot_ref[slot]++;
+}
+
+void swap_slot_put(uint32_t slot) {
+  ASSERT(slot < swap_stats.slot_cnt && slot_ref[slot] > 0);
+  if (--slot_ref[slot] > 0) {
+    return;
+  }
+  swap_stats.slot_used--;
+  if (slot_data[slot] != NULL) {
+    // swap_reclaim may be detaching the list without u_pa_pool lock
+    enum intr_status old_status = intr_disable();
+    *(void**)slot_data[slot] = reclaim_list;
+    reclaim_list = slot_data[slot];
+    intr_set_status(old_status);
+    slot_data[slot] = NULL;
+    swap_stats.mem_pages--;
+    swap_stats.mem_bytes -= slot_len[slot];
+  }
+}
+
+// swap_reclaim
+// kfree compressed pages of slots put since last call. Caller holds no
+// spinlock. Return false if there is nothing to free.
+bool swap_reclaim(void) {
+  enum intr_status old_status = intr_disable();
+  void* data = reclaim_list;
+  reclaim_list = NULL;
+  intr_set_status(old_status);
+  if (data == NULL) {
+    return false;
+  }
+  while (data != NULL) {
+    void* next = *(void**)data;
+    kfree(data);
+    data = next;
+  }
+  return true;
+}
+
+// swap_store
+// Keep page of slot compressed in memory, false if it does not compress well
+// enough or compressed pages already take all memory they may use. Caller
+// holds no spinlock, it compresses a whole page and may kmalloc.
+bool swap_store(uint32_t slot, void* page) {
+  ASSERT(slot_data[slot] == NULL);
+  swap_reclaim();
+  uint32_t len = lz_compress(page, PG_SIZE, lz_buf, SWAP_MEM_MAX_LEN, lz_hash);
+  void* data = NULL;
+  if (len > 0 && swap_stats.mem_bytes + len <= mem_limit) {
+    data = kmalloc(len);
+  }
+  if (data == NULL) {
+    swap_stats.mem_reject++;
+    return false;
+  }
+
+  memcpy(data, lz_buf, len);
+  slot_data[slot] = data;
+  slot_len[slot] = len;
+  swap_stats.mem_pages++;
+  swap_stats.mem_bytes += len;
+  return true;
+}
+
+// swap_read
+// Read page of slot into buf, from memory if it is kept there. The compressed
+// copy stays until the slot is free, other sharers may read it again.
+void swap_read(uint32_t slot, void* buf) {
+  if (slot_data[slot] != NULL) {
+    swap_stats.mem_hit++;
+    uint32_t len = lz_decompress(slot_data[slot], slot_len[slot], buf);
+    ASSERT(len == PG_SIZE);
+    return;
+  }
+  swap_stats.mem_miss++;
+  disk_read(swap_partition->hd, buf,
+            swap_partition->lba_start + slot * SWAP_SLOT_SECS, SWAP_SLOT_SECS);
+}
+
+void swap_write(uint32_t slot, void* buf) {
+  ASSERT(swap_partition != NULL);
+  disk_write(swap_partition->hd, buf,
+             swap_partition->lba_start + slot * SWAP_SLOT_SECS, SWAP_SLOT_SECS);
+}
+
+void swap_stats_print(void) {
+  printf("swap: %d in, %d out, %d of %d slots used\n", swap_stats.swap_in,
+         swap_stats.swap_out, swap_stats.slot_used, swap_stats.slot_cnt);
+  // Ratio in tenths, counted in 16 bytes to keep it in 32 bits
+  uint32_t ratio = swap_stats.mem_bytes == 0
+                       ? 0
+                       : swap_stats.mem_pages * (PG_SIZE / 16) * 10 /
+                             ((swap_stats.mem_bytes + 15) / 16);
+  uint32_t reads = swap_stats.mem_hit + swap_stats.mem_miss;
+  printf("swap: %d pages in %d bytes of memory, ratio %d.%d, %d rejected\n",
+         swap_stats.mem_pages, swap_stats.mem_bytes, ratio / 10, ratio % 10,
+         swap_stats.mem_reject);
+  printf("swap: memory hit %d, miss %d, hit rate %d%%\n", swap_stats.mem_hit,
+         swap_stats.mem_miss,
+         reads == 0 ? 0 : swap_stats.mem_hit * 100 / reads);
+}
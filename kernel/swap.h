@@ -0,0 +1,44 @@
+#ifndef __KERNEL_SWAP_H
+#define __KERNEL_SWAP_H
+
+#include "stdbool.h"
+#include "stdint.h"
+
+// A swap slot holds one page. Pages which compress well are kept in memory,
+// the others go to the partition of type FS_TYPE_SWAP if there is one. Slots
+// are refcounted, since fork copies PTEs of swapped out pages as they are.
+// Callers of swap_slot_* hold u_pa_pool lock, callers of swap_store,
+// swap_read and swap_write hold swap_lock and no spinlock.
+
+// Slots when there is no swap partition, pages are only kept in memory
+#define SWAP_MEM_SLOTS 4096
+
+// Compressed page must save a quarter at least to be kept in memory
+#define SWAP_MEM_MAX_LEN (PG_SIZE / 4 * 3)
+
+struct swap_stats {
+  uint32_t swap_in;     // Pages read back on fault
+  uint32_t swap_out;    // Pages evicted
+  uint32_t slot_cnt;
+  uint32_t slot_used;
+  uint32_t mem_pages;   // Pages kept compressed in memory
+  uint32_t mem_bytes;   // Their compressed size
+  uint32_t mem_hit;     // Swap in served from memory
+  uint32_t mem_miss;    // Swap in read from disk
+  uint32_t mem_reject;  // Pages not compressible or over memory limit
+};
+
+extern struct swap_stats swap_stats;
+
+void swap_init(void);
+bool swap_has_disk(void);
+int32_t swap_slot_alloc(void);
+void swap_slot_dup(uint32_t slot);
+void swap_slot_put(uint32_t slot);
+bool swap_reclaim(void);
+bool swap_store(uint32_t slot, void* page);
+void swap_read(uint32_t slot, void* buf);
+void swap_write(uint32_t slot, void* buf);
+void swap_stats_print(void);
+
+#endif
@@ -3,7 +3,10 @@
 #include "console.h"
 #include "fs.h"
 #include "kernel/print.h"
+#include "process.h"
+#include "shm.h"
 #include "stdint.h"
+#include "stdnull.h"
 #include "string.h"
 #include "thread.h"
 
@@ -14,8 +17,8 @@ int32_t __syscall3(SYSCALL_NUMBER n, void* arg0, void* arg1, void* arg2);
 
 uint32_t sys_getpid(void);
 pid_t getpid(void);
-void* malloc(uint32_t size);
-void free(void* va);
+void* trap_malloc(uint32_t size);
+void trap_free(void* va);
 int32_t open(const char* pathname, int32_t flags);
 int32_t close(int32_t fd);
 int32_t write(int32_t fd, const void* buf, int32_t size);
@@ -27,6 +30,20 @@ struct dir* opendir(const char* name);
 int32_t closedir(struct dir* dir);
 struct dir_entry* readdir(struct dir* dir);
 int32_t rmdir(const char* name);
+void trap_malloc_trim(void);
+void trap_malloc_stats(void);
+void* brk(void* addr);
+void* sbrk(int32_t increment);
+pid_t fork(void);
+void* mmap(void* addr, uint32_t len, int32_t prot, int32_t flags, int32_t fd,
+           uint32_t offset);
+int32_t munmap(void* addr, uint32_t len);
+void exit(int32_t status);
+pid_t wait(int32_t* status);
+int32_t meminfo(struct meminfo* info);
+void* shm_create(uint32_t key, uint32_t size);
+void* shm_attach(uint32_t key);
+int32_t shm_detach(void* addr);
 
 void syscall_init(void);
 
@@ -60,9 +77,17 @@ uint32_t sys_getpid(void) { return running_thread()->pid; }
 
 pid_t getpid(void) { return (pid_t)__syscall0(SYS_GETPID); }
 
-void* malloc(uint32_t size) { return (void*)__syscall1(SYS_MALLOC, size); }
+// trap_malloc, trap_free and trap_realloc enter kernel for every call, user
+// programs should use malloc, free and realloc in lib/user/malloc.h instead
+void* trap_malloc(uint32_t size) {
+  return (void*)__syscall1(SYS_MALLOC, size);
+}
+
+void trap_free(void* va) { __syscall1(SYS_FREE, va); }
 
-void free(void* va) { __syscall1(SYS_FREE, va); }
+void* trap_realloc(void* va, uint32_t size) {
+  return (void*)__syscall2(SYS_REALLOC, va, size);
+}
 
 int32_t open(const char* pathname, int32_t flags) {
   return __syscall2(SYS_OPEN, pathname, flags);
@@ -100,6 +125,57 @@ struct dir_entry* readdir(struct dir* dir) {
 
 int32_t rmdir(const char* name) { return __syscall1(SYS_RMDIR, name); }
 
+void trap_malloc_trim(void) { __syscall0(SYS_MALLOC_TRIM); }
+
+void trap_malloc_stats(void) { __syscall0(SYS_MALLOC_STATS); }
+
+void* brk(void* addr) { return (void*)__syscall1(SYS_BRK, addr); }
+
+// sbrk
+// Move heap end by increment bytes, return the old end or (void*)-1 on
+// failure.
+void* sbrk(int32_t increment) {
+  void* old = brk(NULL);
+  if (increment == 0) {
+    return old;
+  }
+  void* new = brk((void*)((uint32_t)old + increment));
+  if (new == old) {
+    return (void*)-1;
+  }
+  return old;
+}
+
+pid_t fork(void) { return (pid_t)__syscall0(SYS_FORK); }
+
+void* mmap(void* addr, uint32_t len, int32_t prot, int32_t flags, int32_t fd,
+           uint32_t offset) {
+  struct mmap_args args = {addr, len, prot, flags, fd, offset};
+  return (void*)__syscall1(SYS_MMAP, &args);
+}
+
+int32_t munmap(void* addr, uint32_t len) {
+  return __syscall2(SYS_MUNMAP, addr, len);
+}
+
+void exit(int32_t status) { __syscall1(SYS_EXIT, status); }
+
+pid_t wait(int32_t* status) { return (pid_t)__syscall1(SYS_WAIT, status); }
+
+int32_t meminfo(struct meminfo* info) {
+  return __syscall1(SYS_MEMINFO, info);
+}
+
+void* shm_create(uint32_t key, uint32_t size) {
+  return (void*)__syscall2(SYS_SHM_CREATE, key, size);
+}
+
+void* shm_attach(uint32_t key) {
+  return (void*)__syscall1(SYS_SHM_ATTACH, key);
+}
+
+int32_t shm_detach(void* addr) { return __syscall1(SYS_SHM_DETACH, addr); }
+
 void syscall_init(void) {
   put_str("syscall init start\n");
   syscall_table[SYS_GETPID] = sys_getpid;
@@ -116,5 +192,18 @@ void syscall_init(void) {
   syscall_table[SYS_CLOSEDIR] = sys_closedir;
   syscall_table[SYS_READDIR] = sys_readdir;
   syscall_table[SYS_RMDIR] = sys_rmdir;
+  syscall_table[SYS_MALLOC_TRIM] = sys_malloc_trim;
+  syscall_table[SYS_MALLOC_STATS] = sys_malloc_stats;
+  syscall_table[SYS_BRK] = sys_brk;
+  syscall_table[SYS_FORK] = sys_fork;
+  syscall_table[SYS_MMAP] = sys_mmap;
+  syscall_table[SYS_MUNMAP] = sys_munmap;
+  syscall_table[SYS_EXIT] = sys_exit;
+  syscall_table[SYS_WAIT] = sys_wait;
+  syscall_table[SYS_REALLOC] = sys_realloc;
+  syscall_table[SYS_MEMINFO] = sys_meminfo;
+  syscall_table[SYS_SHM_CREATE] = sys_shm_create;
+  syscall_table[SYS_SHM_ATTACH] = sys_shm_attach;
+  syscall_table[SYS_SHM_DETACH] = sys_shm_detach;
   put_str("syscall init done\n");
 }
@@ -19,6 +19,19 @@ typedef enum {
   SYS_CLOSEDIR,
   SYS_READDIR,
   SYS_RMDIR,
+  SYS_MALLOC_TRIM,
+  SYS_MALLOC_STATS,
+  SYS_BRK,
+  SYS_FORK,
+  SYS_MMAP,
+  SYS_MUNMAP,
+  SYS_EXIT,
+  SYS_WAIT,
+  SYS_REALLOC,
+  SYS_MEMINFO,
+  SYS_SHM_CREATE,
+  SYS_SHM_ATTACH,
+  SYS_SHM_DETACH,
 } SYSCALL_NUMBER;
 
 typedef void* syscall;
@@ -27,8 +40,9 @@ typedef void* syscall;
 syscall syscall_table[syscall_nr];
 
 pid_t getpid(void);
-void* malloc(uint32_t size);
-void free(void* va);
+void* trap_malloc(uint32_t size);
+void trap_free(void* va);
+void* trap_realloc(void* va, uint32_t size);
 int32_t open(const char* pathname, int32_t flags);
 int32_t close(int32_t fd);
 int32_t write(int32_t fd, const void* buf, int32_t size);
@@ -40,6 +54,20 @@ struct dir* opendir(const char* name);
 int32_t closedir(struct dir* dir);
 struct dir_entry* readdir(struct dir* dir);
 int32_t rmdir(const char* name);
+void trap_malloc_trim(void);
+void trap_malloc_stats(void);
+void* brk(void* addr);
+void* sbrk(int32_t increment);
+pid_t fork(void);
+void* mmap(void* addr, uint32_t len, int32_t prot, int32_t flags, int32_t fd,
+           uint32_t offset);
+int32_t munmap(void* addr, uint32_t len);
+void exit(int32_t status);
+pid_t wait(int32_t* status);
+int32_t meminfo(struct meminfo* info);
+void* shm_create(uint32_t key, uint32_t size);
+void* shm_attach(uint32_t key);
+int32_t shm_detach(void* addr);
 
 void syscall_init(void);
 
@@ -6,9 +6,11 @@
 #include "kernel/print.h"
 #include "memory.h"
 #include "process.h"
+#include "slab.h"
 #include "stdint.h"
 #include "stdnull.h"
 #include "string.h"
+#include "swap.h"
 #include "sync.h"
 
 // --
@@ -23,10 +25,16 @@ struct list thread_ready_list;
 
 struct list thread_all_list;
 
+// Exited tasks with no parent to wait for them, linked by all_list_tag
+struct list thread_dead_list;
+
 static struct list_elem* thread_tag;
 
 lock_t pid_lock;
 
+// PCB pages, each PCB takes a whole page together with its kernel stack
+struct kmem_cache task_cache;
+
 // --
 // extern definition
 // --
@@ -55,6 +63,10 @@ void thread_block(enum task_status stat);
 
 void thread_unblock(struct task_struct* pthread);
 
+void thread_reap(void);
+
+struct task_struct* thread_find(pid_t pid);
+
 static void make_main_thread(void);
 
 void thread_init(void);
@@ -118,11 +130,13 @@ void task_init(struct task_struct* pthread, char* name, int prio) {
   pthread->self_kstack = (uint32_t)((uint32_t)pthread + PG_SIZE);
   // TODO: each thread has a pid now
   pthread->pid = alloc_pid();
+  pthread->parent_pid = -1;
   strcpy(pthread->name, name);
   pthread->priority = prio;
   pthread->ticks = prio;
   pthread->elapsed_ticks = 0;
   pthread->pgdir = NULL;
+  mem_thread_init(pthread);
 
   // FIXME: fd_table should be shared by process
   // init file descriptors
@@ -143,7 +157,7 @@ void task_init(struct task_struct* pthread, char* name, int prio) {
 // add thread PCB to thread_ready_list and thread_all_list.
 struct task_struct* thread_start(char* name, int prio, thread_func function,
                                  void* func_arg) {
-  struct task_struct* thread = get_kernel_pages(1);
+  struct task_struct* thread = kmem_cache_alloc(&task_cache);
 
   task_init(thread, name, prio);
   thread_create(thread, function, func_arg);
@@ -203,6 +217,41 @@ void thread_yield(void) {
   intr_set_status(old_status);
 }
 
+// thread_reap
+// Free PCB of exited tasks on thread_dead_list. They have switched away for
+// good, so it is safe as long as we are not one of them.
+void thread_reap(void) {
+  while (1) {
+    enum intr_status old_status = intr_disable();
+    struct list_elem* tag = NULL;
+    if (!list_empty(&thread_dead_list)) {
+      tag = list_pop(&thread_dead_list);
+    }
+    intr_set_status(old_status);
+
+    if (tag == NULL) {
+      return;
+    }
+    struct task_struct* t = elem2entry(struct task_struct, all_list_tag, tag);
+    mem_thread_free(t);
+    kmem_cache_free(&task_cache, t);
+  }
+}
+
+static bool pid_check(struct list_elem* elem, int pid) {
+  return elem2entry(struct task_struct, all_list_tag, elem)->pid == pid;
+}
+
+// thread_find
+// Get the task of pid in thread_all_list, NULL if it has gone.
+struct task_struct* thread_find(pid_t pid) {
+  enum intr_status old_status = intr_disable();
+  struct list_elem* elem = list_tranversal(&thread_all_list, pid_check, pid);
+  intr_set_status(old_status);
+  return elem == NULL ? NULL
+                      : elem2entry(struct task_struct, all_list_tag, elem);
+}
+
 static void make_main_thread(void) {
   main_thread = running_thread();
   task_init(main_thread, "main", 31);
@@ -214,6 +263,13 @@ static void make_main_thread(void) {
 static void idle(void* UNUSED_ARG) {
   while (1) {
     thread_block(TASK_BLOCKED);
+    thread_reap();
+    // Refill the atomic reserve, balance pools, free dropped swap pages and
+    // zero free pages for allocators until some thread is ready to run
+    while (list_empty(&thread_ready_list) &&
+           (mem_atomic_refill() || mem_rebalance() || swap_reclaim() ||
+            mem_zero_refill())) {
+    }
     // Must open interrupt when hlt
     asm volatile("sti; hlt" : : : "memory");
   }
@@ -223,7 +279,9 @@ void thread_init(void) {
   put_str("thread_init start\n");
   list_init(&thread_ready_list);
   list_init(&thread_all_list);
+  list_init(&thread_dead_list);
   lock_init(&pid_lock);
+  kmem_cache_create(&task_cache, "task_struct", PG_SIZE, NULL);
   make_main_thread();
   idle_thread = thread_start("idle", 10, idle, NULL);
   put_str("thread_init done\n");
@@ -3,7 +3,10 @@
 
 #include "kernel/list.h"
 #include "memory.h"
+#include "slab.h"
 #include "stdint.h"
+#include "tlb.h"
+#include "vma.h"
 
 #define PG_SIZE 4096
 #define STACK_MAGIC 0x12345678
@@ -67,8 +70,11 @@ typedef int pid_t;
 struct task_struct {
   uint32_t self_kstack;  // Each thread has its own kernel stack
   pid_t pid;
+  pid_t parent_pid;  // Process waiting for its exit, -1 if there is none
+  int32_t exit_status;
   char name[16];
   enum task_status status;
+  uint32_t spin_cnt;  // Spinlocks held, pools must not grow under them
 
   int priority;
   int ticks;               // Ticks running on CPU each time
@@ -78,8 +84,19 @@ struct task_struct {
   struct list_elem all_list_tag;  // Tag in all thread list
 
   uint32_t* pgdir;           // Virtual address of thread's page directory
-  struct va_pool u_va_pool;  // User process's own virtual address
-  struct mem_block_desc u_block_descs[MEM_BLOCK_DESC_CNT];  // desc for malloc
+  struct vm_map vm;          // User process's own virtual address
+  uint32_t heap_start;       // User heap is [heap_start, brk)
+  uint32_t brk;
+  uint32_t pf_cnt;  // Page faults taken
+  // Allocator state lives out of PCB page, which kernel stack shares
+  struct mem_block_desc* u_block_descs;  // desc for malloc, NULL for thread
+
+  // Magazines caching free blocks of mag_descs for this thread, NULL if there
+  // was no memory for them
+  struct mem_block_desc* mag_descs;
+  struct mem_magazine* mags;
+
+  struct tlb_batch tlb;  // Pages unmapped but not yet flushed
 
   int32_t fd_table[MAX_PROC_OPEN_FD];
 
@@ -89,6 +106,11 @@ struct task_struct {
 // FIXME: user/process.c access these two lists, but it should not.
 extern struct list thread_ready_list;
 extern struct list thread_all_list;
+extern struct list thread_dead_list;
+
+extern struct kmem_cache task_cache;
+
+pid_t alloc_pid(void);
 
 void task_init(struct task_struct* pthread, char* name, int prio);
 
@@ -99,10 +121,12 @@ struct task_struct* thread_start(char* name, int prio, thread_func function,
                                  void* func_arg);
 
 struct task_struct* running_thread(void);
+struct task_struct* thread_find(pid_t pid);
 void thread_init(void);
 void thread_block(enum task_status);
 void thread_unblock(struct task_struct*);
 void thread_yield(void);
+void thread_reap(void);
 void schedule(void);
 
 #endif
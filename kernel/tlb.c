@@ -0,0 +1,169 @@
+#include "tlb.h"
+
+#include "debug.h"
+#include "memory.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "thread.h"
+#include "timer.h"
+
+struct tlb_stats tlb_stats;
+
+// CR4.PGE is on, kernel pages are global and survive CR3 reloads
+static bool pge_on;
+
+#define CR4_PGE (1 << 7)
+#define CPUID_PGE (1 << 13)
+
+// Public
+void tlb_init(void);
+void tlb_flush_page(uint32_t va);
+void tlb_flush_all(void);
+void tlb_batch_begin(void);
+void tlb_batch_add(uint32_t va);
+void tlb_batch_end(void);
+void tlb_stats_print(void);
+
+// Private
+static void tlb_flush_user(void);
+static uint32_t per_second(uint32_t cnt);
+
+// Implementation
+
+// tlb_init
+// Mark kernel pages global if CPU supports it. Page tables of kernel space are
+// shared by all page directories, so their TLB entries stay valid across
+// process switches. A 4MB page of direct map gets PG_G in its PDE, other PDEs
+// only point to page tables and PG_G goes to their PTEs.
+//
+// Without PSE the first kernel page table is also the one loader maps at PDE
+// 0 for the low 1MB, with user access. It is left alone, or that identity map
+// would survive CR3 switches too.
+void tlb_init(void) {
+  uint32_t edx;
+  asm volatile("cpuid" : "=d"(edx) : "a"(1) : "ebx", "ecx");
+  if (!(edx & CPUID_PGE)) {
+    return;
+  }
+
+  uint32_t low_pde = *(uint32_t*)0xfffff000;
+  uint32_t pde_idx;
+  for (pde_idx = PDE_IDX(K_BASE_ADDR); pde_idx < 1023; pde_idx++) {
+    uint32_t* pde = (uint32_t*)0xfffff000 + pde_idx;
+    if (!(*pde & PG_P_1)) {
+      continue;
+    }
+    if (*pde & PG_PS) {
+      *pde |= PG_G;
+      continue;
+    }
+    if ((low_pde & PG_P_1) && !(low_pde & PG_PS) &&
+        (*pde & 0xfffff000) == (low_pde & 0xfffff000)) {
+      continue;
+    }
+    uint32_t* pt = (uint32_t*)(0xffc00000 + (pde_idx << 12));
+    uint32_t i;
+    for (i = 0; i < 1024; i++) {
+      if (pt[i] & PG_P_1) {
+        pt[i] |= PG_G;
+      }
+    }
+  }
+
+  asm volatile("movl %%cr4, %%eax; orl %0, %%eax; movl %%eax, %%cr4"
+               :
+               : "i"(CR4_PGE)
+               : "eax", "memory");
+  pge_on = true;
+}
+
+void tlb_flush_page(uint32_t va) {
+  asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+  tlb_stats.page_flush++;
+}
+
+// tlb_flush_all
+// Flush all entries, global ones are only dropped by toggling CR4.PGE.
+void tlb_flush_all(void) {
+  if (!pge_on) {
+    tlb_flush_user();
+    return;
+  }
+  asm volatile(
+      "movl %%cr4, %%eax; xorl %0, %%eax; movl %%eax, %%cr4;"
+      "xorl %0, %%eax; movl %%eax, %%cr4"
+      :
+      : "i"(CR4_PGE)
+      : "eax", "memory");
+  tlb_stats.all_flush++;
+}
+
+// tlb_flush_user
+// Flush all non-global entries.
+static void tlb_flush_user(void) {
+  asm volatile("movl %%cr3, %%eax; movl %%eax, %%cr3" : : : "eax", "memory");
+  tlb_stats.all_flush++;
+}
+
+void tlb_batch_begin(void) { running_thread()->tlb.depth++; }
+
+// tlb_batch_add
+// Invalidate TLB entry of va, at once if running thread has no open batch.
+void tlb_batch_add(uint32_t va) {
+  struct tlb_batch* b = &running_thread()->tlb;
+  if (b->depth == 0) {
+    tlb_flush_page(va);
+    return;
+  }
+
+  tlb_stats.queued++;
+  if (va >= K_BASE_ADDR) {
+    b->kernel = true;
+  }
+  if (b->cnt < TLB_BATCH_MAX) {
+    b->va[b->cnt++] = va;
+  } else {
+    b->cnt = TLB_BATCH_MAX + 1;
+  }
+}
+
+// tlb_batch_end
+// Flush pages queued so far. An inner batch flushes too, it may be closing a
+// pool lock inside the outer one.
+void tlb_batch_end(void) {
+  struct tlb_batch* b = &running_thread()->tlb;
+  ASSERT(b->depth > 0);
+  b->depth--;
+  if (b->cnt == 0) {
+    return;
+  }
+
+  tlb_stats.batch++;
+  if (b->cnt > TLB_BATCH_MAX && b->kernel) {
+    tlb_flush_all();
+  } else if (b->cnt > TLB_BATCH_MAX) {
+    tlb_flush_user();
+  } else {
+    uint32_t i;
+    for (i = 0; i < b->cnt; i++) {
+      tlb_flush_page(b->va[i]);
+    }
+  }
+  b->cnt = 0;
+  b->kernel = false;
+}
+
+static uint32_t per_second(uint32_t cnt) {
+  uint32_t secs = ticks / IRQ0_FREQUENCY;
+  return secs == 0 ? cnt : cnt / secs;
+}
+
+void tlb_stats_print(void) {
+  printf("tlb: %d invlpg (%d/s), %d full flush (%d/s)\n", tlb_stats.page_flush,
+         per_second(tlb_stats.page_flush), tlb_stats.all_flush,
+         per_second(tlb_stats.all_flush));
+  printf("tlb: %d batches of %d pages\n", tlb_stats.batch, tlb_stats.queued);
+  printf("tlb: %d CR3 loads, %d skipped on context switch\n",
+         tlb_stats.cr3_load, tlb_stats.cr3_skip);
+}
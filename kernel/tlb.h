@@ -0,0 +1,40 @@
+#ifndef __KERNEL_TLB_H
+#define __KERNEL_TLB_H
+
+#include "stdbool.h"
+#include "stdint.h"
+
+// Past this many pages one CR3 reload is cheaper than invlpg each
+#define TLB_BATCH_MAX 32
+
+// Pages unmapped by a thread since tlb_batch_begin. Unmapping many pages, like
+// freeing a large block, queues them here and flushes once at tlb_batch_end.
+// Callers end a batch before releasing the pool lock, so no freed frame or
+// virtual page is handed out again while a stale entry may still map it.
+struct tlb_batch {
+  uint32_t depth;  // Nesting of tlb_batch_begin
+  uint32_t cnt;    // Queued pages, above TLB_BATCH_MAX means flush all
+  bool kernel;     // A global kernel page is queued
+  uint32_t va[TLB_BATCH_MAX];
+};
+
+struct tlb_stats {
+  uint32_t page_flush;  // invlpg executed
+  uint32_t all_flush;   // CR3 reloads
+  uint32_t batch;       // Non-empty batches flushed
+  uint32_t queued;      // Pages queued in batches
+  uint32_t cr3_load;    // Context switches to another page directory
+  uint32_t cr3_skip;    // Context switches keeping the page directory
+};
+
+extern struct tlb_stats tlb_stats;
+
+void tlb_init(void);
+void tlb_flush_page(uint32_t va);
+void tlb_flush_all(void);
+void tlb_batch_begin(void);
+void tlb_batch_add(uint32_t va);
+void tlb_batch_end(void);
+void tlb_stats_print(void);
+
+#endif
@@ -0,0 +1,429 @@
+#include "vma.h"
+
+#include "debug.h"
+#include "inode.h"
+#include "kernel/list.h"
+#include "shm.h"
+#include "slab.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "stdnull.h"
+
+#define PG_SIZE 4096
+
+static struct kmem_cache vma_cache;
+
+// Private
+static struct vm_area* vma_prev(struct vm_map* vm, struct vm_area* v);
+static struct vm_area* vma_next(struct vm_map* vm, struct vm_area* v);
+static struct vm_area* vma_first(struct vm_map* vm);
+static struct vm_area* vma_floor(struct vm_map* vm, uint32_t va);
+static void vma_update(struct vm_area* v);
+static void vma_split(struct vm_area* t, uint32_t key, struct vm_area** l,
+                      struct vm_area** r);
+static struct vm_area* vma_merge(struct vm_area* l, struct vm_area* r);
+static void vma_fixup(struct vm_area* t, uint32_t key);
+static void vma_refresh(struct vm_map* vm, struct vm_area* v);
+static struct vm_area* vma_new(uint32_t start, uint32_t end, uint32_t flags,
+                               struct inode_elem* file,
+                               struct shm_segment* shm, uint32_t pgoff);
+static bool vma_map_area(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                         uint32_t flags, struct inode_elem* file,
+                         struct shm_segment* shm, uint32_t pgoff);
+static void vma_free(struct vm_area* v);
+static void vma_insert(struct vm_map* vm, struct vm_area* v,
+                       struct list_elem* before);
+static void vma_remove(struct vm_map* vm, struct vm_area* v);
+
+// Public
+void vma_init(void);
+void vm_map_init(struct vm_map* vm, uint32_t start, uint32_t end);
+bool vm_map_copy(struct vm_map* dst, struct vm_map* src);
+void vm_map_clear(struct vm_map* vm);
+struct vm_area* vma_find(struct vm_map* vm, uint32_t va);
+uint32_t vma_get_unmapped(struct vm_map* vm, uint32_t pg_cnt);
+bool vma_map(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+             uint32_t flags);
+bool vma_map_file(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                  uint32_t flags, struct inode_elem* file, uint32_t pgoff);
+bool vma_map_shm(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                 uint32_t flags, struct shm_segment* shm);
+bool vma_unmap(struct vm_map* vm, uint32_t start, uint32_t pg_cnt);
+
+// Implementation
+
+static struct vm_area* vma_prev(struct vm_map* vm, struct vm_area* v) {
+  if (v->vma_tag.prev == &vm->vmas.head) {
+    return NULL;
+  }
+  return elem2entry(struct vm_area, vma_tag, v->vma_tag.prev);
+}
+
+static struct vm_area* vma_next(struct vm_map* vm, struct vm_area* v) {
+  if (v->vma_tag.next == &vm->vmas.tail) {
+    return NULL;
+  }
+  return elem2entry(struct vm_area, vma_tag, v->vma_tag.next);
+}
+
+static struct vm_area* vma_first(struct vm_map* vm) {
+  if (list_empty(&vm->vmas)) {
+    return NULL;
+  }
+  return elem2entry(struct vm_area, vma_tag, vm->vmas.head.next);
+}
+
+// vma_floor
+// Return the area with the largest start not above va, NULL if none.
+static struct vm_area* vma_floor(struct vm_map* vm, uint32_t va) {
+  struct vm_area* t = vm->root;
+  struct vm_area* floor = NULL;
+  while (t != NULL) {
+    if (t->start <= va) {
+      floor = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return floor;
+}
+
+static void vma_update(struct vm_area* v) {
+  v->max_gap = v->gap;
+  if (v->left != NULL && v->left->max_gap > v->max_gap) {
+    v->max_gap = v->left->max_gap;
+  }
+  if (v->right != NULL && v->right->max_gap > v->max_gap) {
+    v->max_gap = v->right->max_gap;
+  }
+}
+
+// vma_split
+// Split treap t into l with start below key and r with the rest.
+static void vma_split(struct vm_area* t, uint32_t key, struct vm_area** l,
+                      struct vm_area** r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (t->start < key) {
+    vma_split(t->right, key, &t->right, r);
+    *l = t;
+  } else {
+    vma_split(t->left, key, l, &t->left);
+    *r = t;
+  }
+  vma_update(t);
+}
+
+// vma_merge
+// Join treaps l and r, all keys in l are below those in r.
+static struct vm_area* vma_merge(struct vm_area* l, struct vm_area* r) {
+  if (l == NULL) {
+    return r;
+  }
+  if (r == NULL) {
+    return l;
+  }
+  if (l->prio > r->prio) {
+    l->right = vma_merge(l->right, r);
+    vma_update(l);
+    return l;
+  }
+  r->left = vma_merge(l, r->left);
+  vma_update(r);
+  return r;
+}
+
+// vma_fixup
+// Recompute max_gap on the path from t down to the node keyed by key.
+static void vma_fixup(struct vm_area* t, uint32_t key) {
+  if (t == NULL) {
+    return;
+  }
+  if (key < t->start) {
+    vma_fixup(t->left, key);
+  } else if (key > t->start) {
+    vma_fixup(t->right, key);
+  }
+  vma_update(t);
+}
+
+// vma_refresh
+// Bounds of v changed, update gaps of v and the area after it.
+static void vma_refresh(struct vm_map* vm, struct vm_area* v) {
+  struct vm_area* prev = vma_prev(vm, v);
+  v->gap = v->start - (prev != NULL ? prev->end : vm->start);
+  vma_fixup(vm->root, v->start);
+
+  struct vm_area* next = vma_next(vm, v);
+  if (next != NULL) {
+    next->gap = next->start - v->end;
+    vma_fixup(vm->root, next->start);
+  }
+}
+
+static struct vm_area* vma_new(uint32_t start, uint32_t end, uint32_t flags,
+                               struct inode_elem* file,
+                               struct shm_segment* shm, uint32_t pgoff) {
+  struct vm_area* v = kmem_cache_alloc(&vma_cache);
+  if (v == NULL) {
+    return NULL;
+  }
+  v->start = start;
+  v->end = end;
+  v->flags = flags;
+  v->file = file;
+  v->shm = shm;
+  v->pgoff = pgoff;
+  if (file != NULL) {
+    file->ref++;
+  }
+  if (shm != NULL) {
+    shm_get(shm);
+  }
+  // Hash of page number, keeps the treap balanced in expectation
+  v->prio = (start / PG_SIZE) * 2654435761u;
+  v->left = v->right = NULL;
+  return v;
+}
+
+// vma_insert
+// Link v into the list before elem before and into the treap.
+static void vma_insert(struct vm_map* vm, struct vm_area* v,
+                       struct list_elem* before) {
+  list_insert_before(before, &v->vma_tag);
+
+  struct vm_area* l;
+  struct vm_area* r;
+  v->gap = v->max_gap = 0;
+  vma_split(vm->root, v->start, &l, &r);
+  vm->root = vma_merge(vma_merge(l, v), r);
+  vm->vma_cnt++;
+
+  vma_refresh(vm, v);
+}
+
+static void vma_remove(struct vm_map* vm, struct vm_area* v) {
+  struct vm_area* l;
+  struct vm_area* m;
+  struct vm_area* r;
+  vma_split(vm->root, v->start, &l, &r);
+  vma_split(r, v->start + 1, &m, &r);
+  ASSERT(m == v);
+  vm->root = vma_merge(l, r);
+  vm->vma_cnt--;
+
+  struct vm_area* next = vma_next(vm, v);
+  list_remove(&v->vma_tag);
+  if (next != NULL) {
+    vma_refresh(vm, next);
+  }
+  vma_free(v);
+}
+
+static void vma_free(struct vm_area* v) {
+  if (v->file != NULL) {
+    inode_close(v->file);
+  }
+  if (v->shm != NULL) {
+    shm_put(v->shm);
+  }
+  kmem_cache_free(&vma_cache, v);
+}
+
+void vma_init(void) {
+  kmem_cache_create(&vma_cache, "vm_area", sizeof(struct vm_area), NULL);
+}
+
+void vm_map_init(struct vm_map* vm, uint32_t start, uint32_t end) {
+  vm->start = start;
+  vm->end = end;
+  vm->root = NULL;
+  list_init(&vm->vmas);
+  vm->vma_cnt = 0;
+}
+
+// vm_map_copy
+// Copy all areas of src into empty dst, dst is left empty on failure.
+bool vm_map_copy(struct vm_map* dst, struct vm_map* src) {
+  struct list_elem* elem;
+  for (elem = src->vmas.head.next; elem != &src->vmas.tail;
+       elem = elem->next) {
+    struct vm_area* v = elem2entry(struct vm_area, vma_tag, elem);
+    struct vm_area* copy =
+        vma_new(v->start, v->end, v->flags, v->file, v->shm, v->pgoff);
+    if (copy == NULL) {
+      vm_map_clear(dst);
+      return false;
+    }
+    vma_insert(dst, copy, &dst->vmas.tail);
+  }
+  return true;
+}
+
+// vm_map_clear
+// Free all areas of vm.
+void vm_map_clear(struct vm_map* vm) {
+  while (!list_empty(&vm->vmas)) {
+    struct list_elem* elem = list_pop(&vm->vmas);
+    vma_free(elem2entry(struct vm_area, vma_tag, elem));
+  }
+  vm_map_init(vm, vm->start, vm->end);
+}
+
+// vma_find
+// Return the area containing va, NULL if va is not mapped.
+struct vm_area* vma_find(struct vm_map* vm, uint32_t va) {
+  struct vm_area* t = vm->root;
+  while (t != NULL) {
+    if (va < t->start) {
+      t = t->left;
+    } else if (va >= t->end) {
+      t = t->right;
+    } else {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// vma_get_unmapped
+// Return the lowest address of pg_cnt free pages, 0 if there is no room.
+uint32_t vma_get_unmapped(struct vm_map* vm, uint32_t pg_cnt) {
+  uint32_t size = pg_cnt * PG_SIZE;
+  struct vm_area* t = vm->root;
+  while (t != NULL) {
+    if (t->left != NULL && t->left->max_gap >= size) {
+      t = t->left;
+    } else if (t->gap >= size) {
+      return t->start - t->gap;
+    } else if (t->right != NULL && t->right->max_gap >= size) {
+      t = t->right;
+    } else {
+      break;
+    }
+  }
+
+  // Room after the last area
+  uint32_t tail = vm->start;
+  if (!list_empty(&vm->vmas)) {
+    tail = elem2entry(struct vm_area, vma_tag, vm->vmas.tail.prev)->end;
+  }
+  if (vm->end - tail >= size) {
+    return tail;
+  }
+  return 0;
+}
+
+// vma_map
+// Add pages [start, start + pg_cnt * PG_SIZE) with flags, merge with areas
+// next to it of the same flags. Return false if the range is taken.
+bool vma_map(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+             uint32_t flags) {
+  return vma_map_file(vm, start, pg_cnt, flags, NULL, 0);
+}
+
+// vma_map_file
+// Like vma_map, the area maps file from page pgoff if file is not NULL. File
+// areas are never merged.
+bool vma_map_file(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                  uint32_t flags, struct inode_elem* file, uint32_t pgoff) {
+  return vma_map_area(vm, start, pg_cnt, flags, file, NULL, pgoff);
+}
+
+// vma_map_shm
+// Like vma_map, the area maps shared memory segment shm from its first page.
+// Segment areas are never merged.
+bool vma_map_shm(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                 uint32_t flags, struct shm_segment* shm) {
+  return vma_map_area(vm, start, pg_cnt, flags, NULL, shm, 0);
+}
+
+static bool vma_map_area(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                         uint32_t flags, struct inode_elem* file,
+                         struct shm_segment* shm, uint32_t pgoff) {
+  uint32_t end = start + pg_cnt * PG_SIZE;
+  if (pg_cnt == 0 || start < vm->start || end > vm->end || end < start) {
+    return false;
+  }
+
+  struct vm_area* prev = vma_floor(vm, start);
+  struct vm_area* next = (prev != NULL) ? vma_next(vm, prev) : vma_first(vm);
+  if ((prev != NULL && prev->end > start) ||
+      (next != NULL && next->start < end)) {
+    return false;
+  }
+
+  bool anon = file == NULL && shm == NULL;
+  bool join_prev = anon && prev != NULL && prev->file == NULL &&
+                   prev->shm == NULL && prev->end == start &&
+                   prev->flags == flags;
+  bool join_next = anon && next != NULL && next->file == NULL &&
+                   next->shm == NULL && next->start == end &&
+                   next->flags == flags;
+
+  if (join_prev && join_next) {
+    uint32_t next_end = next->end;
+    vma_remove(vm, next);
+    prev->end = next_end;
+    vma_refresh(vm, prev);
+  } else if (join_prev) {
+    prev->end = end;
+    vma_refresh(vm, prev);
+  } else if (join_next) {
+    next->start = start;
+    vma_refresh(vm, next);
+  } else {
+    struct vm_area* v = vma_new(start, end, flags, file, shm, pgoff);
+    if (v == NULL) {
+      return false;
+    }
+    vma_insert(vm, v, next != NULL ? &next->vma_tag : &vm->vmas.tail);
+  }
+  return true;
+}
+
+// vma_unmap
+// Remove pages [start, start + pg_cnt * PG_SIZE) from areas, an area covering
+// both sides is split. Return false if it runs out of memory to split.
+bool vma_unmap(struct vm_map* vm, uint32_t start, uint32_t pg_cnt) {
+  uint32_t end = start + pg_cnt * PG_SIZE;
+  struct vm_area* v = vma_floor(vm, start);
+  if (v == NULL) {
+    v = vma_first(vm);
+  } else if (v->end <= start) {
+    v = vma_next(vm, v);
+  }
+
+  while (v != NULL && v->start < end) {
+    struct vm_area* next = vma_next(vm, v);
+
+    if (v->start < start && v->end > end) {
+      struct vm_area* tail =
+          vma_new(end, v->end, v->flags, v->file, v->shm,
+                  v->pgoff + (end - v->start) / PG_SIZE);
+      if (tail == NULL) {
+        return false;
+      }
+      v->end = start;
+      vma_insert(vm, tail, next != NULL ? &next->vma_tag : &vm->vmas.tail);
+      vma_refresh(vm, v);
+      break;
+    }
+
+    if (v->start >= start && v->end <= end) {
+      vma_remove(vm, v);
+    } else if (v->start < start) {
+      v->end = start;
+      vma_refresh(vm, v);
+    } else {
+      v->pgoff += (end - v->start) / PG_SIZE;
+      v->start = end;
+      vma_refresh(vm, v);
+    }
+    v = next;
+  }
+  return true;
+}
@@ -0,0 +1,63 @@
+#ifndef __KERNEL_VMA_H
+#define __KERNEL_VMA_H
+
+#include "kernel/list.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+struct inode_elem;
+struct shm_segment;
+
+// vm_area flags
+#define VMA_DEMAND (1 << 0)  // Pages are mapped zeroed on first touch
+#define VMA_WRITE (1 << 1)   // Lazily mapped pages may be written
+#define VMA_FILE (1 << 2)    // Pages are cached pages of file, mapped on touch
+#define VMA_MMAP (1 << 3)    // Created by mmap, may be removed by munmap
+#define VMA_SHM (1 << 4)     // Pages of shared memory segment, mapped on touch
+
+// A vm_area covers user pages [start, end) of a process. Areas of a vm_map
+// never overlap and they are kept in an address ordered list as well as in a
+// treap keyed by start. Each node knows the gap between its start and the end
+// of the area before it, and the largest gap of its subtree, so both looking
+// up an address and finding the lowest free range of a size take O(log n).
+struct vm_area {
+  uint32_t start;
+  uint32_t end;
+  uint32_t flags;
+
+  struct inode_elem* file;   // Mapped file of VMA_FILE area, one ref held
+  struct shm_segment* shm;   // Segment of VMA_SHM area, one ref held
+  uint32_t pgoff;            // Page index in file or segment mapped at start
+
+  uint32_t gap;      // start minus end of previous area, or of map start
+  uint32_t max_gap;  // Largest gap in this subtree
+  uint32_t prio;     // Treap priority, larger one is nearer to root
+  struct vm_area* left;
+  struct vm_area* right;
+
+  struct list_elem vma_tag;  // Tag in vm_map's ordered list
+};
+
+struct vm_map {
+  uint32_t start;  // Areas live in [start, end)
+  uint32_t end;
+  struct vm_area* root;
+  struct list vmas;
+  uint32_t vma_cnt;
+};
+
+void vma_init(void);
+void vm_map_init(struct vm_map* vm, uint32_t start, uint32_t end);
+bool vm_map_copy(struct vm_map* dst, struct vm_map* src);
+void vm_map_clear(struct vm_map* vm);
+struct vm_area* vma_find(struct vm_map* vm, uint32_t va);
+uint32_t vma_get_unmapped(struct vm_map* vm, uint32_t pg_cnt);
+bool vma_map(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+             uint32_t flags);
+bool vma_map_file(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                  uint32_t flags, struct inode_elem* file, uint32_t pgoff);
+bool vma_map_shm(struct vm_map* vm, uint32_t start, uint32_t pg_cnt,
+                 uint32_t flags, struct shm_segment* shm);
+bool vma_unmap(struct vm_map* vm, uint32_t start, uint32_t pg_cnt);
+
+#endif
@@ -6,42 +6,48 @@ void bitmap_init(struct bitmap* btmp) {
   memset(btmp->bits, 0, btmp->btmp_bytes_len);
 }
 
-/* Test if the bits[bit_idx] is set, return true for set */
-bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
-  uint32_t byte_idx = bit_idx / 8;
-  uint32_t bit_odd = bit_idx % 8;
-  return btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd);
+/* Skip the leading words equal to val with rep scasd, return the number of
+ * skipped words */
+uint32_t bitmap_skip_words(const uint32_t* words, uint32_t cnt,
+                           uint32_t val) {
+  if (cnt == 0) {
+    return 0;
+  }
+  const uint32_t* p = words;
+  asm volatile("cld; repe scasl"
+               : "+D"(p), "+c"(cnt)
+               : "a"(val)
+               : "memory", "cc");
+  /* edi stops right after the first unmatched word, or at the end */
+  uint32_t skipped = p - words;
+  if (words[skipped - 1] != val) {
+    skipped--;
+  }
+  return skipped;
 }
 
-/* Scan the bitmap, find whether there are cnt continuous available bits. If yes
- * return the start index, else return -1 */
-int bitmap_scan(struct bitmap* btmp, uint32_t cnt) {
-  /* skip full used byte */
-  uint32_t byte_idx = 0;
-  while ((byte_idx < btmp->btmp_bytes_len) && (btmp->bits[byte_idx] == 0xff))
-    byte_idx++;
-
-  if (byte_idx >= btmp->btmp_bytes_len) {
-    return -1;
+/* Read the 32 bits word at word_idx, bytes beyond the bitmap read as 0xff so
+ * that they are never taken as free */
+uint32_t bitmap_word(struct bitmap* btmp, uint32_t word_idx) {
+  uint32_t byte_idx = word_idx * 4;
+  if (byte_idx + 4 <= btmp->btmp_bytes_len) {
+    return ((uint32_t*)btmp->bits)[word_idx];
   }
 
-  /* count if there are enough available bits */
-  uint32_t bit_left = (btmp->btmp_bytes_len - byte_idx) * 8;
-  uint32_t bit_p = byte_idx * 8;
-  uint32_t count = 0;
-  while (bit_left-- > 0) {
-    if (bitmap_scan_test(btmp, bit_p)) {
-      // bit has been set, recount
-      count = 0;
-    } else {
-      count++;
-    }
-    if (count == cnt) {
-      return bit_p - cnt + 1;
-    }
-    bit_p++;
+  uint32_t word = 0xffffffff;
+  uint32_t i;
+  for (i = 0; i < 4 && byte_idx + i < btmp->btmp_bytes_len; i++) {
+    word &= ~(0xff << (i * 8));
+    word |= btmp->bits[byte_idx + i] << (i * 8);
   }
-  return -1;
+  return word;
+}
+
+/* Test if the bits[bit_idx] is set, return true for set */
+bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx) {
+  uint32_t byte_idx = bit_idx / 8;
+  uint32_t bit_odd = bit_idx % 8;
+  return btmp->bits[byte_idx] & (BITMAP_MASK << bit_odd);
 }
 
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx) {
@@ -8,9 +8,17 @@ struct bitmap {
   uint8_t* bits; /* pointer point to map */
 };
 
+/* Index of the lowest set bit, word must not be 0 */
+static inline uint32_t bitmap_bsf(uint32_t word) {
+  uint32_t idx;
+  asm("bsfl %1, %0" : "=r"(idx) : "rm"(word) : "cc");
+  return idx;
+}
+
 void bitmap_init(struct bitmap* btmp);
+uint32_t bitmap_word(struct bitmap* btmp, uint32_t word_idx);
+uint32_t bitmap_skip_words(const uint32_t* words, uint32_t cnt, uint32_t val);
 bool bitmap_scan_test(struct bitmap* btmp, uint32_t bit_idx);
-int bitmap_scan(struct bitmap* btmp, uint32_t cnt);
 void bitmap_set(struct bitmap* btmp, uint32_t bit_idx);
 void bitmap_unset(struct bitmap* btmp, uint32_t bit_idx);
 #endif
@@ -0,0 +1,170 @@
+#include "hbitmap.h"
+
+#include "kernel/bitmap.h"
+#include "string.h"
+
+static bool hbitmap_word_free(struct hbitmap* hbtmp, uint32_t word_idx);
+static void hbitmap_update(struct hbitmap* hbtmp, uint32_t bit_idx);
+static int hbitmap_next_free(struct hbitmap* hbtmp, uint32_t from);
+
+/* Bytes of summary needed by a bitmap of btmp_bytes_len bytes */
+uint32_t hbitmap_summary_bytes(uint32_t btmp_bytes_len) {
+  uint32_t leaf_words = (btmp_bytes_len + 3) / 4;
+  uint32_t l1_words = (leaf_words + 31) / 32;
+  uint32_t l2_words = (l1_words + 31) / 32;
+  return (l1_words + l2_words) * 4;
+}
+
+/* Clear all leaf bits, btmp.btmp_bytes_len, btmp.bits and summary should be
+ * set by caller */
+void hbitmap_init(struct hbitmap* hbtmp) {
+  bitmap_init(&hbtmp->btmp);
+  hbitmap_rebuild(hbtmp);
+}
+
+/* Rebuild the summary from leaf bits, used after leaf bits are filled from
+ * somewhere else like disk */
+void hbitmap_rebuild(struct hbitmap* hbtmp) {
+  uint32_t leaf_words = (hbtmp->btmp.btmp_bytes_len + 3) / 4;
+  hbtmp->l1_words = (leaf_words + 31) / 32;
+  hbtmp->l2_words = (hbtmp->l1_words + 31) / 32;
+
+  uint32_t* l1 = hbtmp->summary;
+  uint32_t* l2 = hbtmp->summary + hbtmp->l1_words;
+  memset(hbtmp->summary, 0, (hbtmp->l1_words + hbtmp->l2_words) * 4);
+
+  uint32_t i;
+  for (i = 0; i < leaf_words; i++) {
+    if (hbitmap_word_free(hbtmp, i)) {
+      l1[i / 32] |= 1 << (i % 32);
+    }
+  }
+  for (i = 0; i < hbtmp->l1_words; i++) {
+    if (l1[i] != 0) {
+      l2[i / 32] |= 1 << (i % 32);
+    }
+  }
+}
+
+/* Test if leaf word has any free bit */
+static bool hbitmap_word_free(struct hbitmap* hbtmp, uint32_t word_idx) {
+  return bitmap_word(&hbtmp->btmp, word_idx) != 0xffffffff;
+}
+
+/* Bring the summary bits covering bit_idx up to date */
+static void hbitmap_update(struct hbitmap* hbtmp, uint32_t bit_idx) {
+  uint32_t word_idx = bit_idx / 32;
+  uint32_t l1_idx = word_idx / 32;
+  uint32_t* l1 = hbtmp->summary;
+  uint32_t* l2 = hbtmp->summary + hbtmp->l1_words;
+
+  if (hbitmap_word_free(hbtmp, word_idx)) {
+    l1[l1_idx] |= 1 << (word_idx % 32);
+  } else {
+    l1[l1_idx] &= ~(1 << (word_idx % 32));
+  }
+
+  if (l1[l1_idx] != 0) {
+    l2[l1_idx / 32] |= 1 << (l1_idx % 32);
+  } else {
+    l2[l1_idx / 32] &= ~(1 << (l1_idx % 32));
+  }
+}
+
+/* Find the first free bit from bit_idx from through the summary, full words
+ * are skipped by l1 and full l1 words by l2, return -1 if there is none */
+static int hbitmap_next_free(struct hbitmap* hbtmp, uint32_t from) {
+  uint32_t* l1 = hbtmp->summary;
+  uint32_t* l2 = hbtmp->summary + hbtmp->l1_words;
+  uint32_t word_idx = from / 32;
+  uint32_t l1_idx = word_idx / 32;
+  if (l1_idx >= hbtmp->l1_words) {
+    return -1;
+  }
+
+  uint32_t word = ~bitmap_word(&hbtmp->btmp, word_idx) &
+                  (0xffffffff << (from % 32));
+  if (word != 0) {
+    return word_idx * 32 + bitmap_bsf(word);
+  }
+
+  /* leaf words after word_idx in the same l1 word, then l2 */
+  uint32_t bits = l1[l1_idx] & ((0xffffffff << (word_idx % 32)) << 1);
+  if (bits == 0) {
+    uint32_t l2_idx = l1_idx / 32;
+    bits = l2[l2_idx] & ((0xffffffff << (l1_idx % 32)) << 1);
+    while (bits == 0) {
+      if (++l2_idx >= hbtmp->l2_words) {
+        return -1;
+      }
+      bits = l2[l2_idx];
+    }
+    l1_idx = l2_idx * 32 + bitmap_bsf(bits);
+    bits = l1[l1_idx];
+  }
+
+  word_idx = l1_idx * 32 + bitmap_bsf(bits);
+  word = ~bitmap_word(&hbtmp->btmp, word_idx);
+  return word_idx * 32 + bitmap_bsf(word);
+}
+
+/* Test if the bits[bit_idx] is set, return true for set */
+bool hbitmap_scan_test(struct hbitmap* hbtmp, uint32_t bit_idx) {
+  return bitmap_scan_test(&hbtmp->btmp, bit_idx);
+}
+
+/* Find cnt continuous available bits, return the start index or -1. Each
+ * candidate run starts at a free bit found by summary and grows over free
+ * words with rep scasd, when it hits a used bit the next candidate is looked
+ * up by summary again, so full words between runs are never read. */
+int hbitmap_scan(struct hbitmap* hbtmp, uint32_t cnt) {
+  uint32_t bit_len = hbtmp->btmp.btmp_bytes_len * 8;
+  uint32_t full_words = hbtmp->btmp.btmp_bytes_len / 4;
+  if (cnt > bit_len) {
+    return -1;
+  }
+  int start = hbitmap_next_free(hbtmp, 0);
+
+  while (start >= 0 && cnt > 1) {
+    uint32_t end = start + 1;
+    while (end - start < cnt && end < bit_len) {
+      uint32_t word_idx = end / 32;
+      uint32_t word = bitmap_word(&hbtmp->btmp, word_idx) &
+                      (0xffffffff << (end % 32));
+      if (word != 0) {
+        end = word_idx * 32 + bitmap_bsf(word);
+        break;
+      }
+      /* skip free words the run still needs with rep scasd */
+      word_idx++;
+      uint32_t limit = (start + cnt + 31) / 32;
+      if (limit > full_words) {
+        limit = full_words;
+      }
+      if (word_idx < limit) {
+        word_idx += bitmap_skip_words((uint32_t*)hbtmp->btmp.bits + word_idx,
+                                      limit - word_idx, 0);
+      }
+      end = word_idx * 32;
+    }
+
+    if (end - start >= cnt) {
+      return start;
+    }
+    if (end >= bit_len) {
+      return -1;
+    }
+    start = hbitmap_next_free(hbtmp, end);
+  }
+  return start;
+}
+
+void hbitmap_set(struct hbitmap* hbtmp, uint32_t bit_idx) {
+  bitmap_set(&hbtmp->btmp, bit_idx);
+  hbitmap_update(hbtmp, bit_idx);
+}
+
+void hbitmap_unset(struct hbitmap* hbtmp, uint32_t bit_idx) {
+  bitmap_unset(&hbtmp->btmp, bit_idx);
+  hbitmap_update(hbtmp, bit_idx);
+}
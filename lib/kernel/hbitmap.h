@@ -0,0 +1,30 @@
+#ifndef __LIB_KERNEL_HBITMAP_H
+#define __LIB_KERNEL_HBITMAP_H
+#include "kernel/bitmap.h"
+#include "stdbool.h"
+#include "stdint.h"
+
+/* hbitmap is a struct bitmap with a two-level summary on top of it.
+ *
+ * Bit w of level 1 is set when leaf word w has a free bit, bit i of level 2 is
+ * set when level 1 word i is not zero. Finding a free bit walks level 2, then
+ * one level 1 word, then one leaf word, instead of scanning all leaf words.
+ *
+ * The caller provides the summary memory, hbitmap_summary_bytes tells its
+ * size. Leaf bits stay in btmp.bits so they can be synced to disk as they are.
+ */
+struct hbitmap {
+  struct bitmap btmp; /* leaf layer */
+  uint32_t* summary;  /* level 1 words followed by level 2 words */
+  uint32_t l1_words;
+  uint32_t l2_words;
+};
+
+uint32_t hbitmap_summary_bytes(uint32_t btmp_bytes_len);
+void hbitmap_init(struct hbitmap* hbtmp);
+void hbitmap_rebuild(struct hbitmap* hbtmp);
+bool hbitmap_scan_test(struct hbitmap* hbtmp, uint32_t bit_idx);
+int hbitmap_scan(struct hbitmap* hbtmp, uint32_t cnt);
+void hbitmap_set(struct hbitmap* hbtmp, uint32_t bit_idx);
+void hbitmap_unset(struct hbitmap* hbtmp, uint32_t bit_idx);
+#endif
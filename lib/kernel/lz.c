@@ -0,0 +1,90 @@
+#include "lz.h"
+
+#include "string.h"
+
+/* Worst case output of one control byte and its 8 items */
+#define LZ_GROUP_MAX (1 + 8 * 3)
+
+static uint32_t lz_hash3(const uint8_t* p) {
+  uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+uint32_t lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst,
+                     uint32_t max, uint16_t* hash) {
+  uint32_t ip = 0, op = 0, ctrl = 0, item = 8;
+
+  /* Entries keep position + 1, 0 for empty */
+  memset(hash, 0, LZ_HASH_SIZE * sizeof(uint16_t));
+
+  while (ip < len) {
+    if (item == 8) {
+      if (op + LZ_GROUP_MAX > max) {
+        return 0;
+      }
+      ctrl = op++;
+      dst[ctrl] = 0;
+      item = 0;
+    }
+
+    uint32_t match = 0, off = 0;
+    if (ip + LZ_MIN_MATCH <= len) {
+      uint32_t h = lz_hash3(src + ip);
+      uint32_t cand = hash[h];
+      hash[h] = ip + 1;
+      if (cand != 0 && ip - (cand - 1) <= LZ_MAX_OFFSET) {
+        off = ip - (cand - 1);
+        uint32_t limit = len - ip;
+        if (limit > LZ_MAX_MATCH) {
+          limit = LZ_MAX_MATCH;
+        }
+        /* Overlapping match is fine, it repeats the last off bytes */
+        while (match < limit && src[ip - off + match] == src[ip + match]) {
+          match++;
+        }
+      }
+    }
+
+    if (match >= LZ_MIN_MATCH) {
+      uint32_t extra = match - LZ_MIN_MATCH;
+      uint32_t nibble = extra < 15 ? extra : 15;
+      dst[ctrl] |= 1 << item;
+      dst[op++] = off >> 4;
+      dst[op++] = ((off & 0xf) << 4) | nibble;
+      if (nibble == 15) {
+        dst[op++] = extra - 15;
+      }
+      ip += match;
+    } else {
+      dst[op++] = src[ip++];
+    }
+    item++;
+  }
+  return op;
+}
+
+uint32_t lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst) {
+  uint32_t ip = 0, op = 0;
+  while (ip < len) {
+    uint8_t ctrl = src[ip++];
+    uint32_t item;
+    for (item = 0; item < 8 && ip < len; item++) {
+      if (!(ctrl & (1 << item))) {
+        dst[op++] = src[ip++];
+        continue;
+      }
+      uint32_t off = (src[ip] << 4) | (src[ip + 1] >> 4);
+      uint32_t match = src[ip + 1] & 0xf;
+      ip += 2;
+      if (match == 15) {
+        match += src[ip++];
+      }
+      match += LZ_MIN_MATCH;
+      while (match-- > 0) {
+        dst[op] = dst[op - off];
+        op++;
+      }
+    }
+  }
+  return op;
+}
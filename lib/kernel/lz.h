@@ -0,0 +1,23 @@
+#ifndef __LIB_KERNEL_LZ_H
+#define __LIB_KERNEL_LZ_H
+#include "stdint.h"
+
+/* A small LZ77 codec for page sized buffers. Each control byte tells whether
+ * each of the next 8 items is a literal byte, or a back reference of 12 bit
+ * offset and 4 bit length, the length is extended by one more byte when its 4
+ * bits are all set. */
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_OFFSET 4095
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 15 + 255)
+
+/* Compress len bytes of src into dst, hash is LZ_HASH_SIZE entries of work
+ * space. Return compressed size, or 0 if it does not fit in max bytes. */
+uint32_t lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst,
+                     uint32_t max, uint16_t* hash);
+
+/* Decompress len bytes of src into dst, return the decompressed size */
+uint32_t lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst);
+#endif
@@ -0,0 +1,614 @@
+#include "malloc.h"
+
+#include "global.h"
+#include "process.h"
+#include "stdint.h"
+#include "stdio.h"
+#include "stdnull.h"
+#include "syscall.h"
+
+// --
+// User heap allocator
+// --
+
+// Heap is made of page runs, each starts with a struct run header. A small
+// run is one page split into blocks of one size class, a large run holds one
+// block and a free run is a hole kept in an address sorted list, adjacent
+// holes are merged. The run of any block is found by masking its address.
+//
+// This code runs in ring 3 and is linked into the shared kernel image, so it
+// must not use ASSERT or kernel globals. Its state lives in the per-process
+// data page at USER_DATA_PAGE, which is mapped zeroed before the process
+// starts, so everything below works from a zero initialized state.
+
+#define MALLOC_CLASS_CNT 13
+#define MALLOC_LARGE 0xffffffff
+
+#define RUN_MAGIC 0x6d616c6c       // "mall"
+#define RUN_FREE_MAGIC 0x66726565  // "free"
+
+// Blocks cached per size class, refilled or flushed by half
+#define TCACHE_SIZE 16
+
+// Heap grows by at least HEAP_GROW_PAGES, and a free run at heap top is given
+// back to kernel down to HEAP_GROW_PAGES once it reaches HEAP_TRIM_PAGES
+#define HEAP_GROW_PAGES 16
+#define HEAP_TRIM_PAGES 32
+
+struct run {
+  uint32_t magic;
+  uint32_t class_idx;  // Size class, or MALLOC_LARGE
+  uint32_t pg_cnt;
+  uint32_t free_cnt;  // Free blocks of a small run
+  void* free;         // Free block list of a small run
+  struct run* prev;
+  struct run* next;
+  uint32_t pad;
+};
+
+struct tcache {
+  uint32_t cnt;
+  void* blocks[TCACHE_SIZE];
+};
+
+struct malloc_state {
+  uint32_t brk;                           // Cached heap end, 0 before use
+  struct run* free_runs;                  // Address sorted free runs
+  struct run* partial[MALLOC_CLASS_CNT];  // Small runs with free blocks
+  struct tcache tcache[MALLOC_CLASS_CNT];
+
+  // statistics
+  uint32_t run_cnt[MALLOC_CLASS_CNT];
+  uint32_t large_cnt;
+  uint32_t tcache_hit;
+  uint32_t tcache_miss;
+  uint32_t brk_calls;
+  uint32_t realloc_inplace;  // Large blocks grown over free pages after them
+  uint32_t realloc_copy;     // Blocks grown by moving to a new one
+};
+
+#define MSTATE ((struct malloc_state*)USER_DATA_PAGE)
+
+// Block sizes are multiple of 16 and chosen to fill a page after the run
+// header with little left over
+static const uint32_t class_sizes[MALLOC_CLASS_CNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 336, 448, 672, 1008, 2032};
+
+// Public
+
+void* malloc(uint32_t size);
+void free(void* ptr);
+void* realloc(void* ptr, uint32_t size);
+void malloc_trim(void);
+void malloc_stats(void);
+
+// Private
+
+static uint32_t class_index(uint32_t size);
+static uint32_t blocks_per_run(uint32_t idx);
+static uint32_t run_end(struct run* run);
+static struct run* block_run(void* ptr);
+
+static struct run* run_insert(struct malloc_state* ms, struct run* run,
+                              uint32_t pg_cnt);
+static void run_release(struct malloc_state* ms, struct run* run,
+                        uint32_t pg_cnt);
+static void run_take(struct malloc_state* ms, struct run* run,
+                     uint32_t pg_cnt);
+static struct run* run_alloc(struct malloc_state* ms, uint32_t pg_cnt);
+static int heap_grow(struct malloc_state* ms, uint32_t pg_cnt);
+static void heap_trim(struct malloc_state* ms, struct run* top);
+
+static void partial_push(struct malloc_state* ms, struct run* run);
+static void partial_remove(struct malloc_state* ms, struct run* run);
+static void* run_block_get(struct malloc_state* ms, uint32_t idx);
+static void run_block_put(struct malloc_state* ms, void* ptr);
+
+static void* large_alloc(struct malloc_state* ms, uint32_t size);
+static int large_grow(struct malloc_state* ms, struct run* run,
+                      uint32_t pg_cnt);
+
+// --
+// Implementation
+// --
+
+static uint32_t class_index(uint32_t size) {
+  uint32_t idx;
+  for (idx = 0; idx < MALLOC_CLASS_CNT; idx++) {
+    if (size <= class_sizes[idx]) {
+      break;
+    }
+  }
+  return idx;
+}
+
+static uint32_t blocks_per_run(uint32_t idx) {
+  return (PG_SIZE - sizeof(struct run)) / class_sizes[idx];
+}
+
+static uint32_t run_end(struct run* run) {
+  return (uint32_t)run + run->pg_cnt * PG_SIZE;
+}
+
+static struct run* block_run(void* ptr) {
+  return (struct run*)((uint32_t)ptr & 0xfffff000);
+}
+
+// run_insert
+// Put pages at run into free run list, merge with neighbours. Return the free
+// run now covering them.
+static struct run* run_insert(struct malloc_state* ms, struct run* run,
+                              uint32_t pg_cnt) {
+  struct run* prev = NULL;
+  struct run* next = ms->free_runs;
+  while (next != NULL && next < run) {
+    prev = next;
+    next = next->next;
+  }
+
+  run->magic = RUN_FREE_MAGIC;
+  run->class_idx = 0;
+  run->pg_cnt = pg_cnt;
+  run->prev = prev;
+  run->next = next;
+  if (prev != NULL) {
+    prev->next = run;
+  } else {
+    ms->free_runs = run;
+  }
+  if (next != NULL) {
+    next->prev = run;
+  }
+
+  if (next != NULL && run_end(run) == (uint32_t)next) {
+    run->pg_cnt += next->pg_cnt;
+    run->next = next->next;
+    if (next->next != NULL) {
+      next->next->prev = run;
+    }
+    next->magic = 0;
+  }
+
+  if (prev != NULL && run_end(prev) == (uint32_t)run) {
+    prev->pg_cnt += run->pg_cnt;
+    prev->next = run->next;
+    if (run->next != NULL) {
+      run->next->prev = prev;
+    }
+    run->magic = 0;
+    run = prev;
+  }
+
+  return run;
+}
+
+static void run_release(struct malloc_state* ms, struct run* run,
+                        uint32_t pg_cnt) {
+  run = run_insert(ms, run, pg_cnt);
+  if (run->next == NULL && run_end(run) == ms->brk &&
+      run->pg_cnt >= HEAP_TRIM_PAGES) {
+    heap_trim(ms, run);
+  }
+}
+
+// run_alloc
+// First fit pg_cnt pages from free runs, grow heap if none fits.
+static struct run* run_alloc(struct malloc_state* ms, uint32_t pg_cnt) {
+  struct run* run;
+  while (1) {
+    for (run = ms->free_runs; run != NULL; run = run->next) {
+      if (run->pg_cnt >= pg_cnt) {
+        break;
+      }
+    }
+    if (run != NULL) {
+      break;
+    }
+    if (!heap_grow(ms, pg_cnt < HEAP_GROW_PAGES ? HEAP_GROW_PAGES : pg_cnt)) {
+      return NULL;
+    }
+  }
+
+  run_take(ms, run, pg_cnt);
+  return run;
+}
+
+// run_take
+// Take the first pg_cnt pages of free run out of free run list.
+static void run_take(struct malloc_state* ms, struct run* run,
+                     uint32_t pg_cnt) {
+  // Split the tail off and let it take run's place in the list
+  struct run* rest = run->next;
+  if (run->pg_cnt > pg_cnt) {
+    rest = (struct run*)((uint32_t)run + pg_cnt * PG_SIZE);
+    rest->magic = RUN_FREE_MAGIC;
+    rest->class_idx = 0;
+    rest->pg_cnt = run->pg_cnt - pg_cnt;
+    rest->next = run->next;
+  }
+  if (rest != NULL) {
+    rest->prev = run->prev;
+  }
+  if (run->prev != NULL) {
+    run->prev->next = rest;
+  } else {
+    ms->free_runs = rest;
+  }
+  if (run->next != NULL && run->next != rest) {
+    run->next->prev = rest;
+  }
+
+  run->pg_cnt = pg_cnt;
+  run->prev = run->next = NULL;
+}
+
+static int heap_grow(struct malloc_state* ms, uint32_t pg_cnt) {
+  if (ms->brk == 0) {
+    ms->brk = DIV_ROUND_UP((uint32_t)brk(NULL), PG_SIZE) * PG_SIZE;
+  }
+  if (pg_cnt > (USER_HEAP_END - ms->brk) / PG_SIZE) {
+    return 0;
+  }
+
+  uint32_t old = ms->brk;
+  uint32_t new = old + pg_cnt * PG_SIZE;
+  ms->brk_calls++;
+  if ((uint32_t)brk((void*)new) != new) {
+    return 0;
+  }
+  ms->brk = new;
+  run_insert(ms, (struct run*)old, pg_cnt);
+  return 1;
+}
+
+// heap_trim
+// Give pages of free run at heap top back to kernel, keep HEAP_GROW_PAGES of
+// them for following allocations.
+static void heap_trim(struct malloc_state* ms, struct run* top) {
+  uint32_t new = ms->brk - (top->pg_cnt - HEAP_GROW_PAGES) * PG_SIZE;
+  ms->brk_calls++;
+  if ((uint32_t)brk((void*)new) == new) {
+    ms->brk = new;
+    top->pg_cnt = HEAP_GROW_PAGES;
+  }
+}
+
+static void partial_push(struct malloc_state* ms, struct run* run) {
+  struct run** head = &ms->partial[run->class_idx];
+  run->prev = NULL;
+  run->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = run;
+  }
+  *head = run;
+}
+
+static void partial_remove(struct malloc_state* ms, struct run* run) {
+  if (run->prev != NULL) {
+    run->prev->next = run->next;
+  } else {
+    ms->partial[run->class_idx] = run->next;
+  }
+  if (run->next != NULL) {
+    run->next->prev = run->prev;
+  }
+  run->prev = run->next = NULL;
+}
+
+static void* run_block_get(struct malloc_state* ms, uint32_t idx) {
+  struct run* run = ms->partial[idx];
+
+  if (run == NULL) {
+    run = run_alloc(ms, 1);
+    if (run == NULL) {
+      return NULL;
+    }
+    run->magic = RUN_MAGIC;
+    run->class_idx = idx;
+    run->free_cnt = blocks_per_run(idx);
+    run->free = NULL;
+
+    uint32_t i;
+    uint32_t block = (uint32_t)(run + 1);
+    for (i = 0; i < run->free_cnt; i++) {
+      *(void**)block = run->free;
+      run->free = (void*)block;
+      block += class_sizes[idx];
+    }
+
+    partial_push(ms, run);
+    ms->run_cnt[idx]++;
+  }
+
+  void* ptr = run->free;
+  run->free = *(void**)ptr;
+  run->free_cnt--;
+  if (run->free_cnt == 0) {
+    partial_remove(ms, run);
+  }
+  return ptr;
+}
+
+static void run_block_put(struct malloc_state* ms, void* ptr) {
+  struct run* run = block_run(ptr);
+  uint32_t idx = run->class_idx;
+
+  *(void**)ptr = run->free;
+  run->free = ptr;
+  run->free_cnt++;
+
+  if (run->free_cnt == 1) {
+    partial_push(ms, run);
+  }
+
+  // Release an empty run unless it is the last one of its class
+  if (run->free_cnt == blocks_per_run(idx) &&
+      (run->prev != NULL || run->next != NULL)) {
+    partial_remove(ms, run);
+    ms->run_cnt[idx]--;
+    run_release(ms, run, 1);
+  }
+}
+
+static void* large_alloc(struct malloc_state* ms, uint32_t size) {
+  if (size > USER_HEAP_END - USER_HEAP_START) {
+    return NULL;
+  }
+
+  struct run* run =
+      run_alloc(ms, DIV_ROUND_UP(size + sizeof(struct run), PG_SIZE));
+  if (run == NULL) {
+    return NULL;
+  }
+  run->magic = RUN_MAGIC;
+  run->class_idx = MALLOC_LARGE;
+  ms->large_cnt++;
+  return run + 1;
+}
+
+// large_grow
+// Extend large run to pg_cnt pages over the free run right after it, heap
+// grows first if they reach heap top. Return 0 if the pages are taken.
+static int large_grow(struct malloc_state* ms, struct run* run,
+                      uint32_t pg_cnt) {
+  uint32_t extra = pg_cnt - run->pg_cnt;
+  struct run* next = ms->free_runs;
+  while (next != NULL && (uint32_t)next < run_end(run)) {
+    next = next->next;
+  }
+  if (next != NULL && (uint32_t)next != run_end(run)) {
+    next = NULL;
+  }
+
+  uint32_t free_cnt = (next == NULL) ? 0 : next->pg_cnt;
+  if (free_cnt < extra) {
+    uint32_t top = (next == NULL) ? run_end(run) : run_end(next);
+    uint32_t grow = extra - free_cnt;
+    if (top != ms->brk ||
+        !heap_grow(ms, grow < HEAP_GROW_PAGES ? HEAP_GROW_PAGES : grow)) {
+      return 0;
+    }
+    // New pages are merged into next, or start a free run there
+    next = (struct run*)run_end(run);
+  }
+
+  run_take(ms, next, extra);
+  run->pg_cnt = pg_cnt;
+  return 1;
+}
+
+// malloc
+// Small sizes are served from tcache of their class, a miss refills half of
+// it from small runs. Large sizes take their own page run.
+void* malloc(uint32_t size) {
+  struct malloc_state* ms = MSTATE;
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  uint32_t idx = class_index(size);
+  if (idx == MALLOC_CLASS_CNT) {
+    return large_alloc(ms, size);
+  }
+
+  struct tcache* tc = &ms->tcache[idx];
+  if (tc->cnt > 0) {
+    ms->tcache_hit++;
+    return tc->blocks[--tc->cnt];
+  }
+
+  ms->tcache_miss++;
+  while (tc->cnt < TCACHE_SIZE / 2) {
+    void* ptr = run_block_get(ms, idx);
+    if (ptr == NULL) {
+      break;
+    }
+    tc->blocks[tc->cnt++] = ptr;
+  }
+
+  if (tc->cnt == 0) {
+    return NULL;
+  }
+  return tc->blocks[--tc->cnt];
+}
+
+// free
+// A full tcache gives its older half back to their runs first.
+void free(void* ptr) {
+  struct malloc_state* ms = MSTATE;
+
+  if (ptr == NULL) {
+    return;
+  }
+
+  struct run* run = block_run(ptr);
+  if (run->magic != RUN_MAGIC) {
+    printf("free: invalid pointer 0x%x\n", (uint32_t)ptr);
+    return;
+  }
+
+  if (run->class_idx == MALLOC_LARGE) {
+    ms->large_cnt--;
+    run_release(ms, run, run->pg_cnt);
+    return;
+  }
+
+  struct tcache* tc = &ms->tcache[run->class_idx];
+  if (tc->cnt == TCACHE_SIZE) {
+    uint32_t i;
+    for (i = 0; i < TCACHE_SIZE / 2; i++) {
+      run_block_put(ms, tc->blocks[i]);
+    }
+    for (i = 0; i < TCACHE_SIZE / 2; i++) {
+      tc->blocks[i] = tc->blocks[i + TCACHE_SIZE / 2];
+    }
+    tc->cnt -= TCACHE_SIZE / 2;
+  }
+  tc->blocks[tc->cnt++] = ptr;
+}
+
+// realloc
+// A small block stays if size still fits its class. A large block shrinks in
+// place, and grows in place over free pages after it, others move to a new
+// block.
+void* realloc(void* ptr, uint32_t size) {
+  struct malloc_state* ms = MSTATE;
+
+  if (ptr == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  if (size > USER_HEAP_END - USER_HEAP_START) {
+    return NULL;
+  }
+
+  struct run* run = block_run(ptr);
+  if (run->magic != RUN_MAGIC) {
+    printf("realloc: invalid pointer 0x%x\n", (uint32_t)ptr);
+    return NULL;
+  }
+
+  uint32_t old_size;
+  if (run->class_idx == MALLOC_LARGE) {
+    old_size = run->pg_cnt * PG_SIZE - sizeof(struct run);
+    if (class_index(size) == MALLOC_CLASS_CNT) {
+      uint32_t pg_cnt = DIV_ROUND_UP(size + sizeof(struct run), PG_SIZE);
+      if (pg_cnt < run->pg_cnt) {
+        uint32_t rest = run->pg_cnt - pg_cnt;
+        run->pg_cnt = pg_cnt;
+        run_release(ms, (struct run*)run_end(run), rest);
+        return ptr;
+      }
+      if (pg_cnt == run->pg_cnt) {
+        return ptr;
+      }
+      if (large_grow(ms, run, pg_cnt)) {
+        ms->realloc_inplace++;
+        return ptr;
+      }
+    }
+  } else {
+    old_size = class_sizes[run->class_idx];
+    if (size <= old_size) {
+      return ptr;
+    }
+  }
+
+  void* new = malloc(size);
+  if (new == NULL) {
+    return NULL;
+  }
+
+  // Block sizes are multiple of 4, copy by words
+  uint32_t* dst = new;
+  uint32_t* src = ptr;
+  uint32_t cnt = DIV_ROUND_UP(size < old_size ? size : old_size, 4);
+  while (cnt-- > 0) {
+    *dst++ = *src++;
+  }
+  free(ptr);
+  if (size > old_size) {
+    ms->realloc_copy++;
+  }
+  return new;
+}
+
+// malloc_trim
+// Flush tcaches, release empty runs and give all free pages at heap top back
+// to kernel.
+void malloc_trim(void) {
+  struct malloc_state* ms = MSTATE;
+  uint32_t idx;
+
+  for (idx = 0; idx < MALLOC_CLASS_CNT; idx++) {
+    struct tcache* tc = &ms->tcache[idx];
+    while (tc->cnt > 0) {
+      run_block_put(ms, tc->blocks[--tc->cnt]);
+    }
+
+    struct run* run = ms->partial[idx];
+    while (run != NULL) {
+      struct run* next = run->next;
+      if (run->free_cnt == blocks_per_run(idx)) {
+        partial_remove(ms, run);
+        ms->run_cnt[idx]--;
+        run_insert(ms, run, 1);
+      }
+      run = next;
+    }
+  }
+
+  struct run* top = ms->free_runs;
+  while (top != NULL && top->next != NULL) {
+    top = top->next;
+  }
+  if (top == NULL || run_end(top) != ms->brk) {
+    return;
+  }
+
+  // Pages of top are gone after brk, unlink it first
+  struct run* prev = top->prev;
+  if (prev != NULL) {
+    prev->next = NULL;
+  } else {
+    ms->free_runs = NULL;
+  }
+
+  ms->brk_calls++;
+  if (brk(top) == top) {
+    ms->brk = (uint32_t)top;
+  } else {
+    run_insert(ms, top, top->pg_cnt);
+  }
+}
+
+void malloc_stats(void) {
+  struct malloc_state* ms = MSTATE;
+  uint32_t i;
+
+  printf("size runs tcached\n");
+  for (i = 0; i < MALLOC_CLASS_CNT; i++) {
+    printf("%d %d %d\n", class_sizes[i], ms->run_cnt[i], ms->tcache[i].cnt);
+  }
+
+  uint32_t heap_pg_cnt = 0;
+  if (ms->brk != 0) {
+    heap_pg_cnt = (ms->brk - USER_DATA_PAGE - PG_SIZE) / PG_SIZE;
+  }
+  uint32_t free_pg_cnt = 0;
+  struct run* run;
+  for (run = ms->free_runs; run != NULL; run = run->next) {
+    free_pg_cnt += run->pg_cnt;
+  }
+
+  printf("heap pages %d free pages %d large blocks %d\n", heap_pg_cnt,
+         free_pg_cnt, ms->large_cnt);
+  printf("tcache hit %d miss %d brk calls %d\n", ms->tcache_hit,
+         ms->tcache_miss, ms->brk_calls);
+  printf("realloc grow in place %d copied %d\n", ms->realloc_inplace,
+         ms->realloc_copy);
+}
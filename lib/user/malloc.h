@@ -0,0 +1,15 @@
+#ifndef __LIB_USER_MALLOC_H
+#define __LIB_USER_MALLOC_H
+
+#include "stdint.h"
+
+// User space allocator on top of the brk heap. Small blocks are carved from
+// one page runs and cached per process, so malloc and free only enter kernel
+// when the heap grows or shrinks.
+void* malloc(uint32_t size);
+void free(void* ptr);
+void* realloc(void* ptr, uint32_t size);
+void malloc_trim(void);
+void malloc_stats(void);
+
+#endif
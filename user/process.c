@@ -1,15 +1,16 @@
 #include "process.h"
 
 #include "debug.h"
+#include "fs.h"
 #include "global.h"
 #include "interrupt.h"
-#include "kernel/bitmap.h"
 #include "kernel/list.h"
 #include "memory.h"
 #include "stdint.h"
 #include "stdnull.h"
 #include "string.h"
 #include "thread.h"
+#include "tlb.h"
 
 #define DEFAULT_PRIO 31
 
@@ -38,8 +39,13 @@ void process_start(void* filename_) {
 
   proc_stack->eflags = (EFLAGS_IOPL_0 | EFLAGS_MBS | EFLAGS_IF_1);
 
-  proc_stack->esp =
-      (uint32_t)get_a_page(PF_USER, USER_STACK_TOP - PG_SIZE) + PG_SIZE;
+  // Stack and the per-process data page are only reserved, page fault
+  // handler maps them zeroed on first touch. Heap starts after the data page.
+  user_va_reserve(USER_STACK_TOP - USER_STACK_MAX, USER_STACK_MAX / PG_SIZE);
+  user_va_reserve(USER_DATA_PAGE, 1);
+  cur->heap_start = USER_DATA_PAGE + PG_SIZE;
+  cur->brk = cur->heap_start;
+  proc_stack->esp = USER_STACK_TOP;
 
   proc_stack->ss = SELECTOR_U_DATA;
 
@@ -53,6 +59,9 @@ void process_start(void* filename_) {
 
 #define KERNEL_PGDIR_VA 0x100000
 
+// page_dir_activate
+// Load page directory of pthread. CR3 is left alone if it is already there,
+// e.g. switching between kernel threads, so the TLB is kept.
 void page_dir_activate(struct task_struct* pthread) {
   uint32_t pgdir_pa = KERNEL_PGDIR_VA;
 
@@ -60,7 +69,15 @@ void page_dir_activate(struct task_struct* pthread) {
     pgdir_pa = va2pa((uint32_t)pthread->pgdir);
   }
 
+  uint32_t cr3;
+  asm volatile("movl %%cr3, %0" : "=r"(cr3));
+  if (cr3 == pgdir_pa) {
+    tlb_stats.cr3_skip++;
+    return;
+  }
+
   asm volatile("movl %0, %%cr3" : : "r"(pgdir_pa) : "memory");
+  tlb_stats.cr3_load++;
 }
 
 void process_activate(struct task_struct* pthread) {
@@ -97,24 +114,203 @@ uint32_t* create_page_dir(void) {
   return pgdir_va;
 }
 
-void create_user_va_bitmap(struct task_struct* proc) {
-  uint32_t bitmap_bytes_len = (K_BASE_ADDR - USER_VADDR_START) / PG_SIZE / 8;
-  uint32_t bitmap_pg_cnt = DIV_ROUND_UP(bitmap_bytes_len, PG_SIZE);
+// fork_child_start
+// First run of a forked child, return to user space with the syscall frame
+// copied from parent.
+static void fork_child_start(void* UNUSED_ARG) {
+  intr_disable();
+  struct task_struct* cur = running_thread();
+  struct intr_stack* proc_stack =
+      (struct intr_stack*)((uint32_t)cur + PG_SIZE - sizeof(struct intr_stack));
+  asm volatile(
+      "movl %0, %%esp;"
+      "jmp intr_exit"
+      :
+      : "g"(proc_stack)
+      : "memory");
+}
+
+// sys_fork
+// Duplicate running process. Child shares all user frames copy-on-write and
+// gets 0 from fork, parent gets child's pid, or -1 on failure.
+int32_t sys_fork(void) {
+  struct task_struct* parent = running_thread();
+  if (parent->pgdir == NULL) {
+    return -1;
+  }
+
+  thread_reap();
+  struct task_struct* child = kmem_cache_alloc(&task_cache);
+  if (child == NULL) {
+    return -1;
+  }
+
+  // Take the whole PCB page, the syscall frame on top of kernel stack included
+  memcpy(child, parent, PG_SIZE);
+  child->pid = alloc_pid();
+  child->parent_pid = parent->pid;
+  child->status = TASK_READY;
+  child->ticks = child->priority;
+  child->elapsed_ticks = 0;
+  child->pf_cnt = 0;
+  child->self_kstack = (uint32_t)child + PG_SIZE;
+  thread_create(child, fork_child_start, NULL);
+  if (!mem_thread_copy(child, parent)) {
+    kmem_cache_free(&task_cache, child);
+    return -1;
+  }
+
+  struct intr_stack* child_stack =
+      (struct intr_stack*)((uint32_t)child + PG_SIZE - sizeof(struct intr_stack));
+  child_stack->eax = 0;
+
+  // FIXME: files are not refcounted, child only keeps the std ones
+  int i;
+  for (i = 3; i < MAX_PROC_OPEN_FD; i++) {
+    child->fd_table[i] = -1;
+  }
+
+  vm_map_init(&child->vm, USER_VADDR_START, K_BASE_ADDR);
+  if (!vm_map_copy(&child->vm, &parent->vm)) {
+    mem_thread_free(child);
+    kmem_cache_free(&task_cache, child);
+    return -1;
+  }
+
+  child->pgdir = create_page_dir();
+  if (child->pgdir == NULL || !user_pages_share(child)) {
+    // Give back pages shared before running out of memory
+    if (child->pgdir != NULL) {
+      user_space_free(child->pgdir);
+    }
+    vm_map_clear(&child->vm);
+    mem_thread_free(child);
+    kmem_cache_free(&task_cache, child);
+    return -1;
+  }
+
+  enum intr_status old_status = intr_disable();
+  list_append(&thread_ready_list, &child->general_tag);
+  list_append(&thread_all_list, &child->all_list_tag);
+  intr_set_status(old_status);
+
+  return child->pid;
+}
+
+// sys_exit
+// Terminate running process with status. Files, user address space and page
+// directory are released here, the PCB is kept for parent's wait, or freed by
+// thread_reap if no process is going to wait for it.
+void sys_exit(int32_t status) {
+  struct task_struct* cur = running_thread();
+  cur->exit_status = status;
+
+  int32_t fd;
+  for (fd = 3; fd < MAX_PROC_OPEN_FD; fd++) {
+    if (cur->fd_table[fd] != -1) {
+      sys_close(fd);
+    }
+  }
 
-  proc->u_va_pool.start = USER_VADDR_START;
-  proc->u_va_pool.btmp.btmp_bytes_len = bitmap_bytes_len;
-  proc->u_va_pool.btmp.bits = get_kernel_pages(bitmap_pg_cnt);
+  // Run on kernel page directory from now on, so the process one can go
+  enum intr_status old_status = intr_disable();
+  uint32_t* pgdir = cur->pgdir;
+  cur->pgdir = NULL;
+  page_dir_activate(cur);
+  intr_set_status(old_status);
+  user_space_free(pgdir);
 
-  bitmap_init(&proc->u_va_pool.btmp);
+  // Drops file and segment refs of areas, which may free their frames, so do
+  // it after the pages are unmapped
+  vm_map_clear(&cur->vm);
+
+  intr_disable();
+  struct task_struct* parent = NULL;
+  struct list_elem* elem = thread_all_list.head.next;
+  while (elem != &thread_all_list.tail) {
+    struct task_struct* t = elem2entry(struct task_struct, all_list_tag, elem);
+    elem = elem->next;
+    if (t->pid == cur->parent_pid) {
+      parent = t;
+    } else if (t->parent_pid == cur->pid) {
+      // Nobody would wait for our children
+      t->parent_pid = -1;
+      if (t->status == TASK_HANGING) {
+        list_remove(&t->all_list_tag);
+        list_append(&thread_dead_list, &t->all_list_tag);
+      }
+    }
+  }
+
+  if (parent == NULL) {
+    list_remove(&cur->all_list_tag);
+    list_append(&thread_dead_list, &cur->all_list_tag);
+    cur->status = TASK_DIED;
+    schedule();
+  } else {
+    if (parent->status == TASK_WAITING) {
+      thread_unblock(parent);
+    }
+    thread_block(TASK_HANGING);
+  }
+  PANIC("sys_exit: exited process is scheduled");
+}
+
+// sys_wait
+// Wait for any child of running process to exit, free its PCB and store its
+// exit status in *status if not NULL. Return child's pid, or -1 if there is
+// no child.
+int32_t sys_wait(int32_t* status) {
+  struct task_struct* cur = running_thread();
+  enum intr_status old_status = intr_disable();
+  while (1) {
+    struct task_struct* child = NULL;
+    bool has_child = false;
+    struct list_elem* elem;
+    for (elem = thread_all_list.head.next; elem != &thread_all_list.tail;
+         elem = elem->next) {
+      struct task_struct* t =
+          elem2entry(struct task_struct, all_list_tag, elem);
+      if (t->parent_pid != cur->pid) {
+        continue;
+      }
+      has_child = true;
+      if (t->status == TASK_HANGING) {
+        child = t;
+        break;
+      }
+    }
+
+    if (child != NULL) {
+      list_remove(&child->all_list_tag);
+      intr_set_status(old_status);
+      pid_t pid = child->pid;
+      if (status != NULL) {
+        *status = child->exit_status;
+      }
+      mem_thread_free(child);
+      kmem_cache_free(&task_cache, child);
+      return pid;
+    }
+    if (!has_child) {
+      intr_set_status(old_status);
+      return -1;
+    }
+    // Woken up by an exiting child
+    thread_block(TASK_WAITING);
+  }
 }
 
 void process_execute(void* filename, char* name) {
-  struct task_struct* pthread = get_kernel_pages(1);
+  thread_reap();
+  struct task_struct* pthread = kmem_cache_alloc(&task_cache);
   task_init(pthread, name, DEFAULT_PRIO);
-  create_user_va_bitmap(pthread);
+  vm_map_init(&pthread->vm, USER_VADDR_START, K_BASE_ADDR);
   thread_create(pthread, process_start, filename);
   pthread->pgdir = create_page_dir();
-  mem_block_descs_init(pthread->u_block_descs);
+  if (pthread->pgdir == NULL || !mem_proc_init(pthread)) {
+    PANIC("process_execute: out of kernel memory");
+  }
 
   enum intr_status old_status = intr_disable();
 
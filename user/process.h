@@ -1,13 +1,29 @@
 #ifndef __USER_PROCESS_H
 #define __USER_PROCESS_H
 
+#include "stdint.h"
+
 // Kernel uses the top 1GB address, then it is the user stack top
 #define USER_STACK_TOP 0xc0000000
 
+// Stack may grow down to USER_STACK_TOP - USER_STACK_MAX
+#define USER_STACK_MAX 0x800000
+
 // ELF entry point
 #define USER_VADDR_START 0x8048000
 
+// User heap grows from USER_HEAP_START by brk. Its first page is reserved for
+// per-process data of user libraries, which are linked into the shared kernel
+// image and can not keep state in globals. Heap and stack pages are mapped
+// zeroed on first touch.
+#define USER_HEAP_START 0x40000000
+#define USER_HEAP_END (USER_STACK_TOP - USER_STACK_MAX)
+#define USER_DATA_PAGE USER_HEAP_START
+
 void process_start(void* filename_);
 void process_execute(void* filename, char* name);
+int32_t sys_fork(void);
+void sys_exit(int32_t status);
+int32_t sys_wait(int32_t* status);
 
 #endif